@@ -0,0 +1,514 @@
+#include "arith.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "variables.h"
+
+using namespace std;
+
+// How many compiled expressions are kept before the cache starts over
+const size_t ARITH_CACHE_SIZE = 4096;
+
+
+// The instructions an expression is compiled into, for a stack machine
+enum arith_opcode {
+  // Pushes the operand
+  OP_PUSH,
+  // Pushes the value of, or stores the top of the stack into (leaving it
+  // there), the variable the operand names
+  OP_LOAD,
+  OP_STORE,
+  // Adds one to, or takes one from, the variable and pushes its new value,
+  // or its old value for the POST ones
+  OP_PRE_INCREMENT,
+  OP_PRE_DECREMENT,
+  OP_POST_INCREMENT,
+  OP_POST_DECREMENT,
+  // Drops the top of the stack
+  OP_POP,
+  // Jumps to the operand, always or when the value it pops is 0 or not
+  OP_JUMP,
+  OP_JUMP_FALSE,
+  OP_JUMP_TRUE,
+  // Unary operators on the top of the stack
+  OP_NEGATE,
+  OP_NOT,
+  OP_COMPLEMENT,
+  // Binary operators on the top two
+  OP_ADD,
+  OP_SUBTRACT,
+  OP_MULTIPLY,
+  OP_DIVIDE,
+  OP_REMAINDER,
+  OP_POWER,
+  OP_SHIFT_LEFT,
+  OP_SHIFT_RIGHT,
+  OP_LESS,
+  OP_LESS_EQUAL,
+  OP_GREATER,
+  OP_GREATER_EQUAL,
+  OP_EQUAL,
+  OP_NOT_EQUAL,
+  OP_BIT_AND,
+  OP_BIT_XOR,
+  OP_BIT_OR
+};
+
+struct arith_instruction {
+  arith_opcode op;
+  // The number to push, the index of a variable name or where to jump
+  long long operand;
+};
+
+// A compiled expression, and the names of the variables it uses
+struct arith_program {
+  vector<arith_instruction> code;
+  vector<string> names;
+};
+
+// The operators, longest first so the first match is the whole operator
+static const char* const OPERATORS[] = {
+  "<<=", ">>=", "**", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "++",
+  "--", "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=", "+", "-", "*", "/",
+  "%", "<", ">", "&", "^", "|", "!", "~", "?", ":", "=", "(", ")", ","
+};
+
+// The binary operators, from the loosest binding to the tightest, with the
+// instruction each compiles to; && and || are compiled to jumps instead
+struct binary_operator {
+  const char* text;
+  int precedence;
+  arith_opcode op;
+};
+static const binary_operator BINARY_OPERATORS[] = {
+  { "||", 1, OP_BIT_OR }, { "&&", 2, OP_BIT_AND }, { "|", 3, OP_BIT_OR },
+  { "^", 4, OP_BIT_XOR }, { "&", 5, OP_BIT_AND }, { "==", 6, OP_EQUAL },
+  { "!=", 6, OP_NOT_EQUAL }, { "<", 7, OP_LESS }, { "<=", 7, OP_LESS_EQUAL },
+  { ">", 7, OP_GREATER }, { ">=", 7, OP_GREATER_EQUAL },
+  { "<<", 8, OP_SHIFT_LEFT }, { ">>", 8, OP_SHIFT_RIGHT }, { "+", 9, OP_ADD },
+  { "-", 9, OP_SUBTRACT }, { "*", 10, OP_MULTIPLY }, { "/", 10, OP_DIVIDE },
+  { "%", 10, OP_REMAINDER }, { "**", 11, OP_POWER }
+};
+
+// Where the compiler is in the expression, and what it has built
+struct arith_compiler {
+  string_view text;
+  size_t pos;
+  arith_program& program;
+  string& error;
+};
+
+// Compiled expressions by their text. Expansions on parallel's threads
+// evaluate too, so the cache, and the stack evaluating under its lock, are
+// shared carefully.
+static unordered_map<string, arith_program> compiled;
+static mutex compiled_mutex;
+static vector<long long> stack;
+
+
+// Returns the operator at the compiler's position, after any blanks, without
+// taking it, or an empty view if there isn't one
+static string_view next_operator(arith_compiler& c) {
+  while (c.pos < c.text.size() && isspace(c.text[c.pos])) c.pos++;
+  string_view rest = c.text.substr(c.pos);
+  for (int i = 0; i < sizeof(OPERATORS) / sizeof(OPERATORS[0]); i++) {
+    if (rest.substr(0, char_traits<char>::length(OPERATORS[i])) ==
+        OPERATORS[i]) {
+      return OPERATORS[i];
+    }
+  }
+  return string_view();
+}
+
+
+// Adds an instruction, returning where it is so a jump can be patched
+static size_t emit(arith_compiler& c, arith_opcode op, long long operand = 0) {
+  arith_instruction instruction = { op, operand };
+  c.program.code.push_back(instruction);
+  return c.program.code.size() - 1;
+}
+
+
+// Returns the index of a variable name in the program, adding it if needed
+static long long name_index(arith_compiler& c, string_view name) {
+  vector<string>& names = c.program.names;
+  for (size_t i = 0; i < names.size(); i++) {
+    if (names[i] == name) return i;
+  }
+  names.push_back(string(name));
+  return names.size() - 1;
+}
+
+
+// Notes the first error. Returns false, for the compile functions to return.
+static bool compile_error(arith_compiler& c, const string& message) {
+  if (c.error.empty()) c.error = message;
+  return false;
+}
+
+
+// Reads a variable name at the compiler's position, or returns an empty view
+static string_view take_name(arith_compiler& c) {
+  while (c.pos < c.text.size() && isspace(c.text[c.pos])) c.pos++;
+  size_t start = c.pos;
+  if (c.pos < c.text.size() &&
+      (isalpha(c.text[c.pos]) || c.text[c.pos] == '_')) {
+    while (c.pos < c.text.size() &&
+           (isalnum(c.text[c.pos]) || c.text[c.pos] == '_')) {
+      c.pos++;
+    }
+  }
+  return c.text.substr(start, c.pos - start);
+}
+
+
+static bool compile_comma(arith_compiler& c);
+static bool compile_assignment(arith_compiler& c);
+static bool compile_unary(arith_compiler& c, long long& variable);
+
+
+// Compiles a number, a variable (which may be followed by ++ or --) or a
+// parenthesized expression. variable is set to the variable's index when the
+// operand is a plain variable that can be assigned to, and -1 otherwise.
+static bool compile_operand(arith_compiler& c, long long& variable) {
+  variable = -1;
+  if (next_operator(c) == "(") {
+    c.pos++;
+    if (!compile_comma(c)) return false;
+    if (next_operator(c) != ")") return compile_error(c, "missing )");
+    c.pos++;
+    return true;
+  }
+  if (c.pos < c.text.size() && isdigit(c.text[c.pos])) {
+    // strtoll stops at the end of the number, and the text is a view, so copy
+    // the digits out first
+    size_t start = c.pos;
+    while (c.pos < c.text.size() && isalnum(c.text[c.pos])) c.pos++;
+    string digits(c.text.substr(start, c.pos - start));
+    char* end;
+    errno = 0;
+    long long value = strtoll(digits.c_str(), &end, 0);
+    if (*end || errno == ERANGE) {
+      return compile_error(c, "invalid number " + digits);
+    }
+    emit(c, OP_PUSH, value);
+    return true;
+  }
+  string_view name = take_name(c);
+  if (name.empty()) {
+    return compile_error(c, "syntax error: operand expected");
+  }
+  long long index = name_index(c, name);
+  string_view op = next_operator(c);
+  if (op == "++" || op == "--") {
+    c.pos += 2;
+    emit(c, op == "++" ? OP_POST_INCREMENT : OP_POST_DECREMENT, index);
+    return true;
+  }
+  emit(c, OP_LOAD, index);
+  variable = index;
+  return true;
+}
+
+
+// Compiles an operand with any unary operators in front of it
+static bool compile_unary(arith_compiler& c, long long& variable) {
+  string_view op = next_operator(c);
+  if (op == "++" || op == "--") {
+    c.pos += 2;
+    string_view name = take_name(c);
+    if (name.empty()) {
+      return compile_error(c, string(op) + " needs a variable");
+    }
+    emit(c, op == "++" ? OP_PRE_INCREMENT : OP_PRE_DECREMENT,
+         name_index(c, name));
+    variable = -1;
+    return true;
+  }
+  if (op == "-" || op == "+" || op == "!" || op == "~") {
+    c.pos++;
+    if (!compile_unary(c, variable)) return false;
+    variable = -1;
+    if (op == "-") emit(c, OP_NEGATE);
+    if (op == "!") emit(c, OP_NOT);
+    if (op == "~") emit(c, OP_COMPLEMENT);
+    return true;
+  }
+  return compile_operand(c, variable);
+}
+
+
+// Compiles binary operators binding at least as tightly as min_precedence, by
+// precedence climbing
+static bool compile_binary(arith_compiler& c, int min_precedence,
+                           long long& variable) {
+  if (!compile_unary(c, variable)) return false;
+  while (true) {
+    string_view op = next_operator(c);
+    const binary_operator* found = NULL;
+    for (int i = 0; i < sizeof(BINARY_OPERATORS) / sizeof(BINARY_OPERATORS[0]);
+         i++) {
+      if (op == BINARY_OPERATORS[i].text) found = &BINARY_OPERATORS[i];
+    }
+    if (!found || found->precedence < min_precedence) return true;
+    c.pos += op.size();
+    variable = -1;
+    long long unused;
+
+    if (op == "&&" || op == "||") {
+      // The right side only runs if the left doesn't decide the answer
+      arith_opcode decided = op == "&&" ? OP_JUMP_FALSE : OP_JUMP_TRUE;
+      size_t first = emit(c, decided);
+      if (!compile_binary(c, found->precedence + 1, unused)) return false;
+      size_t second = emit(c, decided);
+      emit(c, OP_PUSH, op == "&&");
+      size_t skip = emit(c, OP_JUMP);
+      c.program.code[first].operand = c.program.code.size();
+      c.program.code[second].operand = c.program.code.size();
+      emit(c, OP_PUSH, op != "&&");
+      c.program.code[skip].operand = c.program.code.size();
+      continue;
+    }
+
+    // ** groups to the right, the rest to the left
+    int next = found->precedence + (op == "**" ? 0 : 1);
+    if (!compile_binary(c, next, unused)) return false;
+    emit(c, found->op);
+  }
+}
+
+
+// Compiles a conditional a ? b : c, or just the operators below it
+static bool compile_conditional(arith_compiler& c, long long& variable) {
+  if (!compile_binary(c, 1, variable)) return false;
+  if (next_operator(c) != "?") return true;
+  c.pos++;
+  variable = -1;
+  size_t to_else = emit(c, OP_JUMP_FALSE);
+  if (!compile_assignment(c)) return false;
+  if (next_operator(c) != ":") return compile_error(c, "missing : after ?");
+  c.pos++;
+  size_t to_end = emit(c, OP_JUMP);
+  c.program.code[to_else].operand = c.program.code.size();
+  if (!compile_assignment(c)) return false;
+  c.program.code[to_end].operand = c.program.code.size();
+  return true;
+}
+
+
+// Compiles an assignment to a variable, which groups to the right, or just
+// the operators below it
+static bool compile_assignment(arith_compiler& c) {
+  long long variable;
+  if (!compile_conditional(c, variable)) return false;
+  string_view op = next_operator(c);
+  if (op.empty() || op.back() != '=' || op == "==" || op == "!=" ||
+      op == "<=" || op == ">=") {
+    return true;
+  }
+  if (variable == -1) {
+    return compile_error(c, "attempted assignment to non-variable");
+  }
+  c.pos += op.size();
+  // A plain = doesn't need the old value
+  if (op == "=") c.program.code.pop_back();
+  if (!compile_assignment(c)) return false;
+  if (op != "=") {
+    string_view binary = op.substr(0, op.size() - 1);
+    for (int i = 0; i < sizeof(BINARY_OPERATORS) / sizeof(BINARY_OPERATORS[0]);
+         i++) {
+      if (binary == BINARY_OPERATORS[i].text) emit(c, BINARY_OPERATORS[i].op);
+    }
+  }
+  emit(c, OP_STORE, variable);
+  return true;
+}
+
+
+// Compiles expressions separated by commas, whose value is the last one's
+static bool compile_comma(arith_compiler& c) {
+  if (!compile_assignment(c)) return false;
+  while (next_operator(c) == ",") {
+    c.pos++;
+    emit(c, OP_POP);
+    if (!compile_assignment(c)) return false;
+  }
+  return true;
+}
+
+
+// Compiles the whole expression. Returns false with error set if it is
+// malformed.
+static bool compile(string_view text, arith_program& program, string& error) {
+  arith_compiler c = { text, 0, program, error };
+  next_operator(c);
+  // An empty expression is 0
+  if (c.pos == text.size()) {
+    emit(c, OP_PUSH, 0);
+    return true;
+  }
+  if (!compile_comma(c)) return false;
+  next_operator(c);
+  if (c.pos != text.size()) {
+    return compile_error(c, "syntax error in expression (error token is \"" +
+                            string(text.substr(c.pos)) + "\")");
+  }
+  return true;
+}
+
+
+// Reads a variable as a number. One that is unset or empty is 0.
+static bool load(const string& name, long long& value, string& error) {
+  const char* text = variable_get(name);
+  if (!text) {
+    value = 0;
+    return true;
+  }
+  char* end;
+  errno = 0;
+  value = strtoll(text, &end, 0);
+  while (isspace(*end)) end++;
+  if (*end || errno == ERANGE) {
+    error = name + ": not a number: " + text;
+    return false;
+  }
+  return true;
+}
+
+
+// Sets a variable to a number
+static void store(const string& name, long long value) {
+  variable_set(name, to_string(value), false);
+}
+
+
+// Raises base to a power that isn't negative, by squaring
+static long long power(long long base, long long exponent) {
+  unsigned long long result = 1, factor = base;
+  while (exponent > 0) {
+    if (exponent & 1) result *= factor;
+    factor *= factor;
+    exponent >>= 1;
+  }
+  return result;
+}
+
+
+// Runs a compiled expression on the shared stack. Returns false with error
+// set on a runtime error, like dividing by zero.
+static bool run(const arith_program& program, long long& result,
+                string& error) {
+  stack.clear();
+  const vector<arith_instruction>& code = program.code;
+  size_t pc = 0;
+  while (pc < code.size()) {
+    const arith_instruction& in = code[pc++];
+    long long value;
+    // Every binary operator works on the top two values, leaving one
+    long long left = stack.size() >= 2 ? stack[stack.size() - 2] : 0;
+    long long right = stack.empty() ? 0 : stack.back();
+    unsigned long long uleft = left, uright = right;
+    switch (in.op) {
+      case OP_PUSH:
+        stack.push_back(in.operand);
+        continue;
+      case OP_LOAD:
+        if (!load(program.names[in.operand], value, error)) return false;
+        stack.push_back(value);
+        continue;
+      case OP_STORE:
+        store(program.names[in.operand], right);
+        continue;
+      case OP_PRE_INCREMENT:
+      case OP_PRE_DECREMENT:
+      case OP_POST_INCREMENT:
+      case OP_POST_DECREMENT: {
+        const string& name = program.names[in.operand];
+        if (!load(name, value, error)) return false;
+        bool up = in.op == OP_PRE_INCREMENT || in.op == OP_POST_INCREMENT;
+        long long changed = (unsigned long long) value + (up ? 1 : -1);
+        store(name, changed);
+        bool pre = in.op == OP_PRE_INCREMENT || in.op == OP_PRE_DECREMENT;
+        stack.push_back(pre ? changed : value);
+        continue;
+      }
+      case OP_POP:
+        stack.pop_back();
+        continue;
+      case OP_JUMP:
+        pc = in.operand;
+        continue;
+      case OP_JUMP_FALSE:
+      case OP_JUMP_TRUE:
+        stack.pop_back();
+        if ((right != 0) == (in.op == OP_JUMP_TRUE)) pc = in.operand;
+        continue;
+      case OP_NEGATE:
+        stack.back() = -uright;
+        continue;
+      case OP_NOT:
+        stack.back() = !right;
+        continue;
+      case OP_COMPLEMENT:
+        stack.back() = ~right;
+        continue;
+      case OP_DIVIDE:
+      case OP_REMAINDER:
+        if (right == 0) {
+          error = "division by 0";
+          return false;
+        }
+        // -1 is special cased, as the smallest number over it overflows
+        if (right == -1) {
+          value = in.op == OP_DIVIDE ? -uleft : 0;
+        } else {
+          value = in.op == OP_DIVIDE ? left / right : left % right;
+        }
+        break;
+      case OP_POWER:
+        if (right < 0) {
+          error = "exponent less than 0";
+          return false;
+        }
+        value = power(left, right);
+        break;
+      case OP_ADD: value = uleft + uright; break;
+      case OP_SUBTRACT: value = uleft - uright; break;
+      case OP_MULTIPLY: value = uleft * uright; break;
+      case OP_SHIFT_LEFT: value = uleft << (right & 63); break;
+      case OP_SHIFT_RIGHT: value = left >> (right & 63); break;
+      case OP_LESS: value = left < right; break;
+      case OP_LESS_EQUAL: value = left <= right; break;
+      case OP_GREATER: value = left > right; break;
+      case OP_GREATER_EQUAL: value = left >= right; break;
+      case OP_EQUAL: value = left == right; break;
+      case OP_NOT_EQUAL: value = left != right; break;
+      case OP_BIT_AND: value = left & right; break;
+      case OP_BIT_XOR: value = left ^ right; break;
+      case OP_BIT_OR: value = left | right; break;
+    }
+    stack.pop_back();
+    stack.back() = value;
+  }
+  result = stack.empty() ? 0 : stack.back();
+  return true;
+}
+
+
+bool arith_evaluate(string_view expression, long long& result, string& error) {
+  lock_guard<mutex> lock(compiled_mutex);
+  string text(expression);
+  unordered_map<string, arith_program>::iterator found = compiled.find(text);
+  if (found == compiled.end()) {
+    arith_program program;
+    if (!compile(expression, program, error)) return false;
+    if (compiled.size() >= ARITH_CACHE_SIZE) compiled.clear();
+    found = compiled.emplace(text, move(program)).first;
+  }
+  return run(found->second, result, error);
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+
+using std::string;
+using std::string_view;
+
+
+// Evaluates the arithmetic expression of a $((...)), with the operators and
+// precedence of C on long long: + - * / % ** << >> < <= > >= == != & ^ | &&
+// || ! ~ ?: and the comma, assignments (= += -= *= /= %= <<= >>= &= ^= |=)
+// and ++ and -- on variables. A variable's value is read as a number, and one
+// that is unset or empty is 0. Each expression is compiled once, and running
+// it again, as a loop does, only evaluates it. Returns false with error set
+// if the expression is malformed or divides by zero.
+bool arith_evaluate(string_view expression, long long& result, string& error);
@@ -0,0 +1,113 @@
+// Measures command completion against a large synthetic $PATH: building the
+// index, answering a Tab press, and catching up after one directory changes.
+// usage: completion [directories] [programs per directory]
+// Prints the results as JSON.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../completion_index.h"
+#include "../variables.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Tab presses to time
+const int PRESSES = 2000;
+
+
+// Returns a made up program name
+string program_name(mt19937& random) {
+  static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
+  string name;
+  int length = 3 + random() % 10;
+  for (int i = 0; i < length; i++) name += letters[random() % 26];
+  return name;
+}
+
+
+// Removes the directories and everything in them
+void remove_tree(const string& root, const vector<string>& dirs,
+                 const vector<vector<string> >& files) {
+  for (int d = 0; d < dirs.size(); d++) {
+    for (int f = 0; f < files[d].size(); f++) {
+      unlink((dirs[d] + "/" + files[d][f]).c_str());
+    }
+    rmdir(dirs[d].c_str());
+  }
+  rmdir(root.c_str());
+}
+
+
+int main(int argc, char** argv) {
+  int dir_count = argc > 1 ? atoi(argv[1]) : 200;
+  int per_dir = argc > 2 ? atoi(argv[2]) : 250;
+
+  // Fill the directories with empty programs
+  char root_template[] = "/tmp/completion_benchXXXXXX";
+  string root = mkdtemp(root_template);
+  mt19937 random(42);
+  vector<string> dirs;
+  vector<vector<string> > files(dir_count);
+  string path;
+  for (int d = 0; d < dir_count; d++) {
+    dirs.push_back(root + "/bin" + to_string(d));
+    mkdir(dirs[d].c_str(), 0755);
+    for (int f = 0; f < per_dir; f++) {
+      files[d].push_back(program_name(random));
+      close(open((dirs[d] + "/" + files[d][f]).c_str(), O_CREAT | O_WRONLY,
+                 0755));
+    }
+    path += (d ? ":" : "") + dirs[d];
+  }
+  variable_set("PATH", path, true);
+
+  // The first Tab press reads everything
+  steady_clock::time_point start = steady_clock::now();
+  completion_index_refresh();
+  double cold_ms = duration<double, milli>(steady_clock::now() - start)
+                   .count();
+
+  // Later presses check each directory and collect the matches
+  size_t matched = 0;
+  start = steady_clock::now();
+  for (int i = 0; i < PRESSES; i++) {
+    string prefix = program_name(random).substr(0, 1 + i % 3);
+    completion_index_refresh();
+    pair<size_t, size_t> range = completion_index_range(prefix);
+    vector<string> matches(completion_index().begin() + range.first,
+                           completion_index().begin() + range.second);
+    matched += matches.size();
+  }
+  double press_us = duration<double, micro>(steady_clock::now() - start)
+                    .count() / PRESSES;
+
+  // A program installed in one directory
+  string added = dirs[0] + "/zzz_new_program";
+  close(open(added.c_str(), O_CREAT | O_WRONLY, 0755));
+  files[0].push_back("zzz_new_program");
+  start = steady_clock::now();
+  completion_index_refresh();
+  double changed_ms = duration<double, milli>(steady_clock::now() - start)
+                      .count();
+  pair<size_t, size_t> range = completion_index_range("zzz_new");
+  bool correct = range.second - range.first == 1;
+
+  remove_tree(root, dirs, files);
+
+  cout << "{\"path_dirs\": " << dir_count
+       << ", \"programs\": " << completion_index().size()
+       << ", \"index_build_ms\": " << cold_ms
+       << ", \"tab_press_us\": " << press_us
+       << ", \"average_matches\": " << matched / PRESSES
+       << ", \"one_dir_changed_ms\": " << changed_ms
+       << ", \"correct\": " << (correct ? "true" : "false") << "}" << endl;
+  return correct ? 0 : 1;
+}
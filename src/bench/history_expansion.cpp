@@ -0,0 +1,107 @@
+// Measures what history expansion costs with a long history: opening the
+// store, handing the newest entries to readline, !N, and !prefix (the first
+// of which builds the index).
+// usage: history_expansion [number of entries]
+// Prints the results as JSON.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../history_store.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Lookups to time of each kind
+const int LOOKUPS = 10000;
+
+// Entries the shell hands to readline at startup
+const size_t PRELOAD = 1000;
+
+
+// Makes up a command from a few hundred programs and a number
+string random_command(mt19937& random) {
+  char line[64];
+  snprintf(line, sizeof(line), "prog%u --option %u", (unsigned) random() % 500,
+           (unsigned) random() % 100000);
+  return line;
+}
+
+
+int main(int argc, char** argv) {
+  size_t entries = argc > 1 ? atol(argv[1]) : 100000;
+
+  // Another process writes the history, as an earlier session would have
+  char path[] = "/tmp/history_benchXXXXXX";
+  close(mkstemp(path));
+  unlink(path);
+  mt19937 random(42);
+  if (fork() == 0) {
+    history_open(path);
+    for (size_t n = 0; n < entries; n++) {
+      history_append(random_command(random));
+    }
+    exit(0);
+  }
+  wait(NULL);
+
+  // What a new shell does before its first prompt
+  steady_clock::time_point start = steady_clock::now();
+  history_open(path);
+  size_t count = history_count();
+  size_t bytes = 0;
+  for (size_t n = count > PRELOAD ? count - PRELOAD + 1 : 1; n <= count; n++) {
+    bytes += string(history_entry(n)).size();
+  }
+  double open_us = duration<double, micro>(steady_clock::now() - start)
+                   .count();
+
+  // !N
+  bool correct = count == entries;
+  start = steady_clock::now();
+  for (int i = 0; i < LOOKUPS; i++) {
+    bytes += history_entry(1 + random() % count).size();
+  }
+  double number_ns = duration<double, nano>(steady_clock::now() - start)
+                     .count() / LOOKUPS;
+
+  // The index the shell builds on a thread after opening the history, and
+  // !prefix, the first time and then as usual
+  start = steady_clock::now();
+  history_index_build();
+  double build_ms = duration<double, milli>(steady_clock::now() - start)
+                    .count();
+  start = steady_clock::now();
+  correct = correct && history_find_prefix("prog1") != 0;
+  double first_prefix_ms = duration<double, milli>(steady_clock::now() -
+                                                   start).count();
+  start = steady_clock::now();
+  for (int i = 0; i < LOOKUPS; i++) {
+    string prefix = "prog" + to_string(random() % 500) + " --option " +
+                    to_string(random() % 10);
+    size_t found = history_find_prefix(prefix);
+    if (found && history_entry(found).substr(0, prefix.size()) != prefix) {
+      correct = false;
+    }
+  }
+  double prefix_us = duration<double, micro>(steady_clock::now() - start)
+                     .count() / LOOKUPS;
+
+  unlink(path);
+  unlink((string(path) + ".idx").c_str());
+
+  cout << "{\"entries\": " << count
+       << ", \"open_and_preload_us\": " << open_us
+       << ", \"bang_number_ns\": " << number_ns
+       << ", \"index_build_ms\": " << build_ms
+       << ", \"first_bang_prefix_ms\": " << first_prefix_ms
+       << ", \"bang_prefix_us\": " << prefix_us
+       << ", \"correct\": " << (correct ? "true" : "false") << "}" << endl;
+  return correct ? 0 : 1;
+}
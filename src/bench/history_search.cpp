@@ -0,0 +1,141 @@
+// Measures the per-keystroke latency of the history search behind Ctrl-R on
+// a large generated history, and checks every answer against a plain scan.
+// usage: history_search [number of entries]
+// Prints the results as JSON.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "../history_store.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// What the user types, one keystroke at a time
+const char* const QUERIES[] = {
+  "git commit", "make -j", "ssh build", "grep -rn TODO", "cd /var/log",
+  "docker run", "vim src/shell.cpp", "g", "ls", "xyzzy", "kubectl get pods"
+};
+
+// Matches kept for the widget to step through
+const size_t RESULTS = 100;
+
+
+// Fills in a command template with a number
+string command_from(size_t shape, unsigned number) {
+  static const char* const commands[] = {
+    "git status", "git commit -m \"fix %u\"", "git checkout feature-%u",
+    "make -j%u", "ls -la /home/user/project%u", "cd /var/log/app%u",
+    "ssh build%u.example.com", "grep -rn TODO src/module%u",
+    "docker run --rm image:%u", "vim src/file%u.cpp", "python3 script%u.py",
+    "kubectl get pods -n team%u", "curl -s http://localhost:%u/health",
+    "tar xzf release-%u.tar.gz", "ls", "make", "cd .."
+  };
+  const size_t count = sizeof(commands) / sizeof(commands[0]);
+  char line[128];
+  snprintf(line, sizeof(line), commands[shape % count], number);
+  return line;
+}
+
+
+// Makes up a plausible command. Most are habits, drawn from a few thousand
+// commands with the first ones far more likely; the rest are one-offs.
+string random_command(mt19937& random) {
+  uniform_real_distribution<double> uniform(0, 1);
+  if (uniform(random) < 0.2) {
+    return command_from(random(), 1000 + random() % 1000000);
+  }
+  size_t habit = pow(uniform(random), 3) * 5000;
+  return command_from(habit, habit / 17);
+}
+
+
+// The entries a plain scan finds for the term, as distinct lines
+set<string> scan(string_view term) {
+  set<string> found;
+  size_t count = history_count();
+  for (size_t n = 1; n <= count; n++) {
+    string_view line = history_entry(n);
+    if (line.find(term) != string_view::npos) found.insert(string(line));
+  }
+  return found;
+}
+
+
+int main(int argc, char** argv) {
+  size_t entries = argc > 1 ? atol(argv[1]) : 1000000;
+
+  // Write the history out, the way the shell would
+  char path[] = "/tmp/history_benchXXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  unlink(path);
+  history_open(path);
+  mt19937 random(42);
+  for (size_t n = 0; n < entries; n++) {
+    history_append(random_command(random));
+  }
+
+  // The shell builds the index on a thread once the history is open
+  steady_clock::time_point start = steady_clock::now();
+  history_index_build();
+  double build_ms = duration<double, milli>(steady_clock::now() - start)
+                    .count();
+
+  // Time every keystroke of every query
+  vector<double> latencies;
+  for (const char* query : QUERIES) {
+    string term;
+    for (const char* c = query; *c; c++) {
+      term.push_back(*c);
+      start = steady_clock::now();
+      history_rank(term, RESULTS);
+      latencies.push_back(duration<double, micro>(steady_clock::now() -
+                                                  start).count());
+    }
+  }
+
+  // Then check each answer: the best results must be the right lines, once
+  // each
+  bool correct = true;
+  for (const char* query : QUERIES) {
+    string term;
+    for (const char* c = query; *c; c++) {
+      term.push_back(*c);
+      vector<size_t> results = history_rank(term, RESULTS);
+      set<string> expected = scan(term);
+      set<string> seen;
+      for (size_t r = 0; r < results.size(); r++) {
+        string line(history_entry(results[r]));
+        if (!expected.count(line) || !seen.insert(line).second) {
+          correct = false;
+        }
+      }
+      if (results.size() != min(expected.size(), RESULTS)) correct = false;
+    }
+  }
+
+  unlink(path);
+  unlink((string(path) + ".idx").c_str());
+
+  sort(latencies.begin(), latencies.end());
+  double p50 = latencies[latencies.size() / 2];
+  double p99 = latencies[latencies.size() * 99 / 100];
+  cout << "{\"entries\": " << entries
+       << ", \"index_build_ms\": " << build_ms
+       << ", \"keystrokes\": " << latencies.size()
+       << ", \"keystroke_p50_us\": " << p50
+       << ", \"keystroke_p99_us\": " << p99
+       << ", \"keystroke_max_us\": " << latencies.back()
+       << ", \"correct\": " << (correct ? "true" : "false") << "}" << endl;
+  return correct ? 0 : 1;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Measures how many external commands per second the shell can launch, by
+# running the external `true` in a loop with each process launch backend.
+# usage: launch_rate.sh [path to myshell] [number of commands]
+
+SHELL_BIN=${1:-./myshell}
+COUNT=${2:-5000}
+# The program, as true on its own is a built-in
+TRUE=$(which true)
+
+SCRIPT=$(mktemp /tmp/launch_benchXXXXXX)
+
+# Time COUNT runs of `true`, after the given setup line
+run() {
+  { echo "$1"; yes "$TRUE" | head -n "$COUNT"; } > "$SCRIPT"
+  start=$(date +%s.%N)
+  "$SHELL_BIN" "$SCRIPT" > /dev/null
+  end=$(date +%s.%N)
+  echo "$start $end" | awk -v n="$COUNT" '{ printf "%.0f", n / ($2 - $1) }'
+}
+
+spawn=$(run "set -o spawn")
+fork=$(run "set +o spawn")
+rm -f "$SCRIPT"
+echo "{\"commands\": $COUNT, \"posix_spawn_per_sec\": $spawn, \"fork_per_sec\": $fork}"
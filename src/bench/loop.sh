@@ -0,0 +1,29 @@
+#!/bin/sh
+# Measures how many passes per second a while loop of built-ins and
+# arithmetic makes, against running the same commands as separate lines that
+# are each parsed afresh, and against bash running the loop.
+# usage: loop.sh [path to myshell] [number of passes]
+
+SHELL_BIN=${1:-./myshell}
+COUNT=${2:-1000000}
+
+LOOP="i=0; while [ \$i -lt $COUNT ]; do i=\$((i + 1)); done"
+SCRIPT=$(mktemp /tmp/loop_benchXXXXXX)
+# The loop unrolled, one pass to a line
+{ echo "i=0"; yes "[ \$i -lt $COUNT ] && i=\$((i + 1))" | head -n "$COUNT"; } \
+  > "$SCRIPT"
+
+# Prints the passes per second of the given command
+rate() {
+  start=$(date +%s.%N)
+  "$@" > /dev/null
+  end=$(date +%s.%N)
+  echo "$start $end" | awk -v n="$COUNT" '{ printf "%.0f", n / ($2 - $1) }'
+}
+
+loop=$(rate "$SHELL_BIN" -c "$LOOP")
+reparsed=$(rate "$SHELL_BIN" "$SCRIPT")
+bash=$(rate bash -c "$LOOP")
+rm -f "$SCRIPT"
+echo "{\"passes\": $COUNT, \"loop_per_sec\": $loop," \
+     "\"reparsed_per_sec\": $reparsed, \"bash_loop_per_sec\": $bash}"
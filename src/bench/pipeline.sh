@@ -0,0 +1,31 @@
+#!/bin/sh
+# Measures how fast data flows through a pipeline of cats run by the shell,
+# the best of a few runs, with the built-in cat and with the external one.
+# usage: pipeline.sh [path to myshell] [megabytes]
+
+SHELL_BIN=${1:-./myshell}
+MEGABYTES=${2:-256}
+RUNS=3
+EXTERNAL_CAT=$(command -v cat)
+
+FILE=$(mktemp /tmp/pipeline_benchXXXXXX)
+head -c "${MEGABYTES}M" /dev/zero > "$FILE"
+
+# Prints the best rate, in MB/s, of the pipeline run with the given cat
+best_rate() {
+  best=0
+  for run in $(seq "$RUNS"); do
+    start=$(date +%s.%N)
+    "$SHELL_BIN" -c "$1 $FILE | $1 | $1 > /dev/null"
+    end=$(date +%s.%N)
+    rate=$(echo "$start $end" | awk -v mb="$MEGABYTES" '{ printf "%.0f", mb / ($2 - $1) }')
+    [ "$rate" -gt "$best" ] && best=$rate
+  done
+  echo "$best"
+}
+
+builtin=$(best_rate cat)
+external=$(best_rate "$EXTERNAL_CAT")
+rm -f "$FILE"
+
+echo "{\"megabytes\": $MEGABYTES, \"stages\": 3, \"mb_per_sec\": $builtin, \"external_mb_per_sec\": $external}"
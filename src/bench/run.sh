@@ -0,0 +1,21 @@
+#!/bin/sh
+# Runs every benchmark and prints their results as one JSON object, to keep
+# and compare across changes. Run from src/ after building (make bench does
+# both).
+# usage: bench/run.sh [path to myshell]
+
+SHELL_BIN=${1:-./myshell}
+BENCH=$(dirname "$0")
+
+echo "{"
+echo "  \"tokenizer\": $("$BENCH/tokenizer"),"
+echo "  \"pipeline\": $(sh "$BENCH/pipeline.sh" "$SHELL_BIN"),"
+echo "  \"launch_rate\": $(sh "$BENCH/launch_rate.sh" "$SHELL_BIN"),"
+echo "  \"startup\": $("$BENCH/startup" "$SHELL_BIN"),"
+echo "  \"server\": $(sh "$BENCH/server.sh" "$SHELL_BIN"),"
+echo "  \"loop\": $(sh "$BENCH/loop.sh" "$SHELL_BIN"),"
+echo "  \"completion\": $("$BENCH/completion"),"
+echo "  \"history_expansion\": $("$BENCH/history_expansion"),"
+echo "  \"history_search\": $("$BENCH/history_search"),"
+echo "  \"text_scan\": $("$BENCH/text_scan")"
+echo "}"
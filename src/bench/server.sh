@@ -0,0 +1,36 @@
+#!/bin/sh
+# Measures how many short command lines per second run through a warm
+# myshell --server, sent by myshell --client and by myshell-client, against
+# starting a cold myshell -c for each.
+# usage: server.sh [path to myshell] [number of runs]
+
+SHELL_BIN=${1:-./myshell}
+CLIENT_BIN=$(dirname "$SHELL_BIN")/myshell-client
+COUNT=${2:-1000}
+
+SOCKET=$(mktemp -u /tmp/server_benchXXXXXX)
+"$SHELL_BIN" --server "$SOCKET" &
+SERVER=$!
+# Wait for the socket to appear
+while [ ! -S "$SOCKET" ]; do sleep 0.01; done
+
+# Run the command line COUNT times with the given command in front
+rate() {
+  start=$(date +%s.%N)
+  i=0
+  while [ $i -lt "$COUNT" ]; do
+    "$@" "echo hi" > /dev/null
+    i=$((i + 1))
+  done
+  end=$(date +%s.%N)
+  echo "$start $end" | awk -v n="$COUNT" '{ printf "%.0f", n / ($2 - $1) }'
+}
+
+cold=$(rate "$SHELL_BIN" -c)
+client=$(rate "$SHELL_BIN" --client "$SOCKET")
+small=$(rate "$CLIENT_BIN" "$SOCKET")
+kill $SERVER
+rm -f "$SOCKET"
+echo "{\"runs\": $COUNT, \"cold_dash_c_per_sec\": $cold," \
+     "\"dash_dash_client_per_sec\": $client," \
+     "\"myshell_client_per_sec\": $small}"
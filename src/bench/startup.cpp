@@ -0,0 +1,106 @@
+// Measures how long the shell takes to start: to its first prompt on a
+// terminal, and to run a single command with -c.
+// usage: startup [path to myshell] [runs]
+// Prints the results as JSON, with the median of the runs.
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <pty.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace std::chrono;
+
+// How long to wait for a prompt before giving up
+const int PROMPT_TIMEOUT_MS = 5000;
+
+
+// Starts the shell on a new terminal and returns the milliseconds until its
+// prompt appears, or -1 if it never does
+double time_to_prompt(const char* shell) {
+  steady_clock::time_point start = steady_clock::now();
+  int terminal;
+  pid_t pid = forkpty(&terminal, NULL, NULL, NULL);
+  if (pid == -1) return -1;
+  if (pid == 0) {
+    execl(shell, shell, (char*) NULL);
+    _exit(127);
+  }
+
+  // The prompt ends with "$ "
+  string output;
+  double elapsed = -1;
+  struct pollfd wanted = { terminal, POLLIN, 0 };
+  while (poll(&wanted, 1, PROMPT_TIMEOUT_MS) > 0) {
+    char buffer[4096];
+    ssize_t got = read(terminal, buffer, sizeof(buffer));
+    if (got <= 0) break;
+    output.append(buffer, got);
+    if (output.find("$ ") != string::npos) {
+      elapsed = duration<double, milli>(steady_clock::now() - start).count();
+      break;
+    }
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  close(terminal);
+  return elapsed;
+}
+
+
+// Runs "shell -c true" and returns the milliseconds it took
+double time_to_run(const char* shell) {
+  steady_clock::time_point start = steady_clock::now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl(shell, shell, "-c", "true", (char*) NULL);
+    _exit(127);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+  return duration<double, milli>(steady_clock::now() - start).count();
+}
+
+
+// Returns the middle value
+double median(vector<double> values) {
+  sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+
+int main(int argc, char** argv) {
+  const char* shell = argc > 1 ? argv[1] : "./myshell";
+  int runs = argc > 2 ? atoi(argv[2]) : 20;
+
+  // Start from an empty history, so the user's doesn't count
+  char history[] = "/tmp/startup_historyXXXXXX";
+  close(mkstemp(history));
+  setenv("HISTFILE", history, 1);
+
+  vector<double> prompt;
+  vector<double> command;
+  bool correct = true;
+  for (int i = 0; i < runs; i++) {
+    prompt.push_back(time_to_prompt(shell));
+    command.push_back(time_to_run(shell));
+    if (prompt.back() < 0 || command.back() < 0) correct = false;
+  }
+  unlink(history);
+  unlink((string(history) + ".idx").c_str());
+
+  cout << "{\"runs\": " << runs
+       << ", \"first_prompt_ms\": " << median(prompt)
+       << ", \"dash_c_true_ms\": " << median(command)
+       << ", \"correct\": " << (correct ? "true" : "false") << "}" << endl;
+  return correct ? 0 : 1;
+}
@@ -0,0 +1,139 @@
+// Measures the newline, word and substring kernels behind the wc and grep
+// built-ins, in GB/s, at every SIMD level this CPU supports, after checking
+// each level against the scalar one on many sizes and alignments.
+// usage: text_scan [megabytes] [passes]
+// Prints the results as JSON.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../text_scan.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Names of the levels, in the order of scan_level
+const char* const LEVEL_NAMES[] = { "scalar", "sse2", "avx2" };
+
+// The words the text is made from. The needle only appears where it is put.
+const char* const WORDS[] = {
+  "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "error:",
+  "warning", "src/shell.cpp", "12345", "\t", "  ", "a", "needles"
+};
+
+// What grep looks for in the timing runs, planted once near the end
+const string NEEDLE = "needle in a haystack";
+
+
+// Builds text of about the given size out of lines of random words
+static string make_text(size_t size, mt19937& random) {
+  const size_t count = sizeof(WORDS) / sizeof(WORDS[0]);
+  string text;
+  text.reserve(size + 128);
+  while (text.size() < size) {
+    int words = random() % 14;
+    for (int w = 0; w < words; w++) {
+      if (w > 0) text += ' ';
+      text += WORDS[random() % count];
+    }
+    text += random() % 50 ? '\n' : '\r';
+  }
+  return text;
+}
+
+
+// Compares every level with the scalar one on random pieces of the text, and
+// with needles taken from the text itself, missing from it, or at its edges
+static bool check_levels(const string& text, scan_level best,
+                         mt19937& random) {
+  bool correct = true;
+  for (int trial = 0; trial < 20000; trial++) {
+    size_t start = random() % 64;
+    size_t size = random() % (trial < 10000 ? 200 : 5000);
+    if (start + size > text.size()) continue;
+    const char* data = text.data() + start;
+
+    string needle;
+    int kind = random() % 4;
+    if (kind < 2 && size > 0) {
+      size_t from = random() % size;
+      needle = text.substr(start + from, random() % 40);
+    } else if (kind == 2) {
+      size_t length = min(size, (size_t) random() % 8 + 1);
+      needle.assign(data + size - length, length);
+    } else {
+      needle = "absent" + to_string(trial);
+    }
+
+    scan_set_level(SCAN_SCALAR);
+    size_t lines = count_newlines(data, size);
+    bool in_word = random() % 2;
+    bool started_in_word = in_word;
+    size_t words = count_words(data, size, in_word);
+    const char* found = find_substring(data, size, needle);
+    for (int level = SCAN_SSE2; level <= best; level++) {
+      scan_set_level((scan_level) level);
+      bool level_in_word = started_in_word;
+      if (count_newlines(data, size) != lines ||
+          count_words(data, size, level_in_word) != words ||
+          level_in_word != in_word ||
+          find_substring(data, size, needle) != found) {
+        correct = false;
+      }
+    }
+  }
+  return correct;
+}
+
+
+// Returns the GB/s of running the kernel over the text the given times
+template <class kernel_function>
+static double gb_per_sec(const string& text, int passes,
+                         kernel_function kernel) {
+  steady_clock::time_point start = steady_clock::now();
+  for (int p = 0; p < passes; p++) kernel();
+  double seconds = duration<double>(steady_clock::now() - start).count();
+  return text.size() * (double) passes / seconds / 1e9;
+}
+
+
+int main(int argc, char** argv) {
+  size_t megabytes = argc > 1 ? atol(argv[1]) : 64;
+  int passes = argc > 2 ? atoi(argv[2]) : 5;
+
+  mt19937 random(42);
+  string text = make_text(megabytes << 20, random);
+  text.replace(text.size() - 100, NEEDLE.size(), NEEDLE);
+  scan_level best = scan_best_level();
+  bool correct = check_levels(text, best, random);
+
+  cout << "{\"megabytes\": " << megabytes;
+  for (int level = SCAN_SCALAR; level <= best; level++) {
+    scan_set_level((scan_level) level);
+    size_t lines = 0, words = 0;
+    const char* found = NULL;
+    double newline_rate = gb_per_sec(text, passes, [&]() {
+      lines = count_newlines(text.data(), text.size());
+    });
+    double word_rate = gb_per_sec(text, passes, [&]() {
+      bool in_word = false;
+      words = count_words(text.data(), text.size(), in_word);
+    });
+    double substring_rate = gb_per_sec(text, passes, [&]() {
+      found = find_substring(text.data(), text.size(), NEEDLE);
+    });
+    if (found != text.data() + text.size() - 100) correct = false;
+
+    cout << ", \"" << LEVEL_NAMES[level] << "\": {"
+         << "\"newlines_gb_per_sec\": " << newline_rate
+         << ", \"words_gb_per_sec\": " << word_rate
+         << ", \"substring_gb_per_sec\": " << substring_rate
+         << ", \"lines\": " << lines << ", \"words\": " << words << "}";
+  }
+  cout << ", \"correct\": " << (correct ? "true" : "false") << "}" << endl;
+  return correct ? 0 : 1;
+}
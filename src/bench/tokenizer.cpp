@@ -0,0 +1,76 @@
+// Measures how fast lines are broken into words and pipelines, on long lines
+// with a mix of plain words, quotes, variables, redirections and pipes.
+// usage: tokenizer [line length in bytes] [iterations]
+// Prints the results as JSON.
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../parser.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// The pieces a line is made from, repeated until it is long enough
+const char* const PIECES[] = {
+  "grep", "-rn", "\"some quoted text\"", "$HOME/src", "'single quoted'",
+  "--flag=value", "file_name.txt", "${VAR}", "a\\ b", "|", "sort", "-u",
+  "|", "wc", "-l"
+};
+
+
+int main(int argc, char** argv) {
+  size_t length = argc > 1 ? atol(argv[1]) : 64 * 1024;
+  int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+
+  // Build the line
+  const size_t count = sizeof(PIECES) / sizeof(PIECES[0]);
+  string line;
+  size_t words = 0;
+  bool piped = false;
+  for (size_t p = 0; line.size() < length; p++) {
+    if (!line.empty()) line += ' ';
+    line += PIECES[p % count];
+    piped = strcmp(PIECES[p % count], "|") == 0;
+    if (!piped) words++;
+  }
+  // A pipe can't end the line
+  if (piped) {
+    line += " cat";
+    words++;
+  }
+
+  // tokenize works in place, so each run gets a fresh copy
+  vector<char> buffer(line.size() + 1);
+  arena mem;
+  pipeline parsed;
+  string error;
+  bool correct = true;
+  steady_clock::time_point start = steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    memcpy(&buffer[0], line.c_str(), line.size() + 1);
+    mem.reset();
+    if (!tokenize(&buffer[0], mem, parsed, error)) correct = false;
+  }
+  double seconds = duration<double>(steady_clock::now() - start).count();
+
+  // Every word should have been found
+  size_t found = 0;
+  for (int c = 0; c < parsed.commands.size(); c++) {
+    found += parsed.commands[c].words.size();
+  }
+  if (found != words) correct = false;
+
+  cout << "{\"line_bytes\": " << line.size()
+       << ", \"words\": " << words
+       << ", \"commands\": " << parsed.commands.size()
+       << ", \"lines_per_sec\": " << (long) (iterations / seconds)
+       << ", \"mb_per_sec\": "
+       << (long) (line.size() * (double) iterations / seconds / 1e6)
+       << ", \"correct\": " << (correct ? "true" : "false") << "}" << endl;
+  return correct ? 0 : 1;
+}
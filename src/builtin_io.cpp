@@ -0,0 +1,39 @@
+#include "builtin_io.h"
+
+#include "builtins.h"
+
+using namespace std;
+
+
+fd_buffer::fd_buffer(int fd) : fd(fd) {
+  setp(buffer, buffer + sizeof(buffer));
+}
+
+
+fd_buffer::~fd_buffer() {
+  sync();
+}
+
+
+void fd_buffer::reset(int fd) {
+  sync();
+  this->fd = fd;
+}
+
+
+int fd_buffer::overflow(int c) {
+  if (sync() == -1) return traits_type::eof();
+  if (c != traits_type::eof()) {
+    *pptr() = c;
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+
+int fd_buffer::sync() {
+  size_t size = pptr() - pbase();
+  setp(buffer, buffer + sizeof(buffer));
+  if (size > 0 && write_all(fd, buffer, size) == -1) return -1;
+  return 0;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <ostream>
+#include <streambuf>
+
+
+using std::ostream;
+using std::streambuf;
+
+
+// A stream buffer that writes to a file descriptor when it fills up or is
+// flushed, and when it is destroyed. Once a write fails, e.g. to a pipe
+// whose reader has gone, the stream fails and drops anything more.
+class fd_buffer : public streambuf {
+ public:
+  fd_buffer(int fd);
+  ~fd_buffer();
+
+  // Writes out what is left for the current descriptor and switches to fd,
+  // so the buffer can be used again
+  void reset(int fd);
+
+ protected:
+  int overflow(int c);
+  int sync();
+
+ private:
+  fd_buffer(const fd_buffer&);
+  fd_buffer& operator=(const fd_buffer&);
+
+  int fd;
+  char buffer[8192];
+};
+
+
+// Where a built-in reads and writes: its own stdin, stdout and stderr, which
+// lead wherever its stage of the pipeline does, and buffered streams over the
+// last two. Built-ins never use the shell's std::cout, std::cerr or
+// descriptors 0 to 2 directly, so they can run on a thread while the shell
+// and other built-ins use those.
+struct builtin_io {
+  int in_fd;
+  int out_fd;
+  int err_fd;
+  ostream& out;
+  ostream& err;
+};
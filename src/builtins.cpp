@@ -1,105 +1,225 @@
 #include "builtins.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <climits>
+#include <iomanip>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history_store.h"
+#include "interpreter.h"
+#include "jobs.h"
+#include "line_reader.h"
+#include "path_search.h"
+#include "shell.h"
+#include "text_scan.h"
+#include "variables.h"
+
 using namespace std;
 
-// Allow reference to the alias map for the alias command
-extern map<string, string> aliases;
 
-int com_ls(vector<string>& tokens) {
-  // if no directory is given, use the local directory
-  if (tokens.size() < 2) {
-    tokens.push_back(".");
-  }
+// Allow reference to the shell options for the set command
+extern map<string, bool*> options;
 
-  // open the directory
-  DIR* dir = opendir(tokens[1].c_str());
+// Number of entries the history command shows by default
+const size_t HISTORY_SHOWN = 100;
 
-  // catch an errors opening the directory
-  if (!dir) {
-    // print the error from the last system call with the given prefix
-    perror("ls error");
+// Whether there is a user at the prompt, for the exit command
+extern bool interactive;
 
-    // return error
-    return 1;
+// Characters that make a grep pattern a regular expression rather than a
+// plain string
+const char* const REGEX_CHARACTERS = "\\.[]*^$";
+
+// How much of a stream wc reads at once
+const size_t SCAN_BUFFER_SIZE = 128 * 1024;
+
+// How much output grep gathers before writing it
+const size_t OUTPUT_FLUSH = 64 * 1024;
+
+volatile sig_atomic_t builtin_interrupted = 0;
+
+// Guards the sharing of Ctrl-C by built-ins running at the same time
+static mutex interrupt_mutex;
+
+// How many built-ins are catching Ctrl-C, and how many are ignoring it
+static int interrupt_catchers = 0;
+static int interrupt_ignorers = 0;
+
+// The handling from before the first of them
+static struct sigaction interrupt_saved;
+
+// The current directory, as the shell keeps track of it, so the prompt and
+// pwd don't have to ask the kernel each time
+static string current_directory;
+
+
+// Whether the path names the same directory as info
+static bool same_directory(const string& path, const struct stat& info) {
+  struct stat other;
+  return !path.empty() && path[0] == '/' && stat(path.c_str(), &other) == 0 &&
+         other.st_dev == info.st_dev && other.st_ino == info.st_ino;
+}
+
+
+// Resolves the . and .. in an absolute path, without looking at the file
+// system, as typed paths through symbolic links are followed back out
+static string normalize_path(const string& path) {
+  vector<string> parts;
+  size_t start = 0;
+  while (start < path.size()) {
+    size_t end = path.find('/', start);
+    if (end == string::npos) end = path.size();
+    string part = path.substr(start, end - start);
+    if (part == "..") {
+      if (!parts.empty()) parts.pop_back();
+    } else if (!part.empty() && part != ".") {
+      parts.push_back(part);
+    }
+    start = end + 1;
+  }
+  string result;
+  for (int i = 0; i < parts.size(); i++) result += "/" + parts[i];
+  return result.empty() ? "/" : result;
+}
+
+
+// Asks the kernel for the current directory, or returns "" if it can't say
+static string physical_directory() {
+  vector<char> buffer(PATH_MAX);
+  while (!getcwd(&buffer[0], buffer.size())) {
+    if (errno != ERANGE) return "";
+    buffer.resize(buffer.size() * 2);
   }
+  return string(&buffer[0]);
+}
+
 
-  // output each entry in the directory
-  for (dirent* current = readdir(dir); current; current = readdir(dir)) {
-    cout << current->d_name << endl;
+// Sets the directory the shell keeps track of after a change to it, taking
+// the path it was reached by if that still leads there. PWD is exported as
+// it.
+static void set_directory(const string& path) {
+  struct stat here;
+  if (stat(".", &here) == 0 && same_directory(path, here)) {
+    current_directory = path;
+  } else {
+    current_directory = physical_directory();
   }
-  // close the dir
-  closedir(dir);
+  variable_set("PWD", current_directory, true);
+}
 
-  // return success
-  return 0;
+
+void directory_init() {
+  const char* pwd = variable_get("PWD");
+  set_directory(pwd ? pwd : "");
 }
 
 
-int com_cd(vector<string>& tokens) {
+const string& pwd() {
+  return current_directory;
+}
+
+
+int com_cd(vector<string>& tokens, builtin_io& io) {
   // Ensure a directory was passed
   if (tokens.size() < 2) {
     tokens.push_back(".");
   }
+  // cd - goes back to the last directory, and says where that is
+  string target = tokens[1];
+  bool back = target == "-";
+  if (back) {
+    const char* old = variable_get("OLDPWD");
+    if (!old) {
+      io.err << "cd: OLDPWD not set" << endl;
+      return 1;
+    }
+    target = old;
+  }
   // Use the chdir syscall
-  if (chdir(tokens[1].c_str()) != 0) {
-    perror("cd error");
+  if (chdir(target.c_str()) != 0) {
+    io.err << "cd error: " << strerror(errno) << endl;
     return 1;
   };
+
+  string previous = current_directory;
+  string path = target[0] == '/' ? target : current_directory + "/" + target;
+  set_directory(normalize_path(path));
+  variable_set("OLDPWD", previous, true);
+  if (back) io.out << current_directory << endl;
   return 0;
 }
 
 
-int com_pwd(vector<string>& tokens) {
+int com_pwd(vector<string>& tokens, builtin_io& io) {
   // Get dir
-  string curDir = pwd();
-  cout << curDir << endl;
+  const string& curDir = pwd();
+  if (curDir.empty()) {
+    io.err << "pwd: the current directory can't be found" << endl;
+    return 1;
+  }
+  io.out << curDir << endl;
   return 0;
 }
 
 
-int com_alias(vector<string>& tokens) {
+int com_alias(vector<string>& tokens, builtin_io& io) {
   // if no alias passed, list all of the current aliases
   if (tokens.size() < 2) {
-    // iterator
-    typedef map<string, string>::iterator it;
-    for (it i = aliases.begin(); i != aliases.end(); i++) {
-      // Print out the value
-      cout << "alias " << i->first << "=\'" << i->second << "\'" << endl;
+    vector<string> names = alias_names();
+    for (int i = 0; i < names.size(); i++) {
+      string value;
+      if (alias_value(names[i], value)) {
+        io.out << "alias " << names[i] << "=\'" << value << "\'" << endl;
+      }
     }
+    return 0;
   }
-  else {
-    // Define the new alias in the map
-    // split the arg by =
-    string arg = tokens[1];
+
+  int status = 0;
+  for (int i = 1; i < tokens.size(); i++) {
+    const string& arg = tokens[i];
     size_t splitIndex = arg.find("=");
-    // check we found the =
-    if (splitIndex != string::npos) {
-      // split and asign in the map
-      aliases[arg.substr(0, splitIndex)] = arg.substr(splitIndex + 1);
-    } else {
-      // alert of the usage
-      cout << "usage: alias newname=command" << endl;
-      return 1;
+    // A name on its own shows that alias
+    if (splitIndex == string::npos) {
+      string value;
+      if (alias_value(arg, value)) {
+        io.out << "alias " << arg << "=\'" << value << "\'" << endl;
+      } else {
+        io.err << "alias: " << arg << ": not found" << endl;
+        status = 1;
+      }
+      continue;
+    }
+    // Otherwise define it, tokenizing the value once here
+    string error;
+    if (!alias_define(arg.substr(0, splitIndex), arg.substr(splitIndex + 1),
+                      error)) {
+      io.err << "alias: " << error << endl;
+      status = 1;
     }
   }
-
-  return 0;
+  return status;
 }
 
 
-int com_unalias(vector<string>& tokens) {
+int com_unalias(vector<string>& tokens, builtin_io& io) {
   // Check that just one arg was passed (-a or a name)
   if (tokens.size() != 2) {
-    cout << "usage: unalias [-a or name]" << endl;
+    io.err << "usage: unalias [-a or name]" << endl;
     return 1;
   }
   // Erase all or just one alias
   if (tokens[1] == "-a")
-    aliases.clear();
+    alias_clear();
   else {
     // see if the alias is erased
-    if (aliases.erase(tokens[1]) != 1) {
-        cout << "alias '" << tokens[1] << "' was not found" << endl;
+    if (!alias_remove(tokens[1])) {
+        io.err << "alias '" << tokens[1] << "' was not found" << endl;
         return 1;
     }
   }
@@ -107,48 +227,660 @@ int com_unalias(vector<string>& tokens) {
 }
 
 
-int com_echo(vector<string>& tokens) {
-  // Iterate over the tokens, cout all but the first
+int com_echo(vector<string>& tokens, builtin_io& io) {
+  // Iterate over the tokens, write out all but the first with a space
+  // between them, and none at the end, which $(echo ...) would keep
   for (int i = 1; i < tokens.size(); i++) {
-      cout << tokens[i] << " ";
+      if (i > 1) io.out << " ";
+      io.out << tokens[i];
   }
-  cout << endl;
+  io.out << endl;
   return 0;
 }
 
 
-int com_exit(vector<string>& tokens) {
-  // Print a message
-  cout << "shell closed" << endl;
-  // Call the exit sys call
-  exit(0);
+int com_exit(vector<string>& tokens, builtin_io& io) {
+  // Print a message for the user at the prompt
+  if (interactive) io.out << "shell closed" << endl;
+  io.out.flush();
+  // Call the exit sys call, with the status if one was given
+  exit(tokens.size() > 1 ? atoi(tokens[1].c_str()) : 0);
   // Shouldn't ever get here
   return 0;
 } 
 
 
-int com_history(vector<string>& tokens) {
-  // Use the history library
-  // history_get(i) returns a pointer to the line that was instruction i
-  // Only print up to 100 recent commands
-  int startIndex = max(1, history_length - 99);
-  for (int i = startIndex; history_get(i) != NULL; i++) {
-    cout << "   " << i << " " << history_get(i)->line << endl;
+int com_exec(vector<string>& tokens, builtin_io& io) {
+  // Without a command, the redirections were all there was to it
+  if (tokens.size() < 2) return 0;
+  // The command takes over the process, with the built-in's descriptors and
+  // the default handling of the signals the shell ignores
+  io.out.flush();
+  cout.flush();
+  if (io.in_fd != STDIN_FILENO) dup2(io.in_fd, STDIN_FILENO);
+  if (io.out_fd != STDOUT_FILENO) dup2(io.out_fd, STDOUT_FILENO);
+  if (io.err_fd != STDERR_FILENO) dup2(io.err_fd, STDERR_FILENO);
+  job_child_setup(-1);
+  vector<string_view> words(tokens.begin() + 1, tokens.end());
+  exec_external_command(words, hash_lookup(tokens[1]),
+                        variables_environment());
+  // Shouldn't ever get here
+  return 0;
+}
+
+
+int com_history(vector<string>& tokens, builtin_io& io) {
+  // Search the history store for a term or a prefix, newest first
+  if (tokens.size() == 3 && (tokens[1] == "-s" || tokens[1] == "-p")) {
+    vector<size_t> found;
+    if (tokens[1] == "-s") {
+      found = history_search(tokens[2], HISTORY_SHOWN);
+    } else {
+      size_t pos = history_find_prefix(tokens[2]);
+      if (pos) found.push_back(pos);
+    }
+    for (int i = found.size() - 1; i >= 0; i--) {
+      io.out << "   " << found[i] << " " << history_entry(found[i]) << endl;
+    }
+    return found.empty() ? 1 : 0;
+  }
+  if (tokens.size() > 2 || (tokens.size() == 2 && !isdigit(tokens[1][0]))) {
+    io.err << "usage: history [n] | -s term | -p prefix" << endl;
+    return 2;
+  }
+
+  // Otherwise print the most recent commands, 100 unless told otherwise
+  size_t shown = tokens.size() == 2 ? atoi(tokens[1].c_str()) : HISTORY_SHOWN;
+  size_t count = history_count();
+  size_t startIndex = count > shown ? count - shown + 1 : 1;
+  for (size_t i = startIndex; i <= count; i++) {
+    io.out << "   " << i << " " << history_entry(i) << endl;
+  }
+  return 0;
+}
+
+int com_set(vector<string>& tokens, builtin_io& io) {
+  // Check for the -o or +o flag
+  if (tokens.size() < 2 || (tokens[1] != "-o" && tokens[1] != "+o")) {
+    io.err << "usage: set [-o or +o] [option]" << endl;
+    return 1;
+  }
+  // No option named, list them all
+  if (tokens.size() < 3) {
+    typedef map<string, bool*>::iterator it;
+    for (it i = options.begin(); i != options.end(); i++) {
+      io.out << i->first << "\t" << (*i->second ? "on" : "off") << endl;
+    }
+    return 0;
+  }
+  // Find and switch the option
+  map<string, bool*>::iterator option = options.find(tokens[2]);
+  if (option == options.end()) {
+    io.err << "set: unknown option '" << tokens[2] << "'" << endl;
+    return 1;
+  }
+  *option->second = (tokens[1] == "-o");
+  return 0;
+}
+
+
+int com_export(vector<string>& tokens, builtin_io& io) {
+  // No names, list the environment in a form that can be read back in
+  if (tokens.size() < 2) {
+    vector<string> exported;
+    for (char** e = variables_environment(); *e; e++) {
+      exported.push_back(*e);
+    }
+    sort(exported.begin(), exported.end());
+    for (int i = 0; i < exported.size(); i++) {
+      size_t eq_pos = exported[i].find('=');
+      io.out << "export " << exported[i].substr(0, eq_pos) << "=\"";
+      for (size_t c = eq_pos + 1; c < exported[i].size(); c++) {
+        char ch = exported[i][c];
+        if (ch == '"' || ch == '\\' || ch == '$' || ch == '`') io.out << '\\';
+        io.out << ch;
+      }
+      io.out << "\"" << endl;
+    }
+    return 0;
+  }
+  int return_value = 0;
+  for (int i = 1; i < tokens.size(); i++) {
+    size_t eq_pos = assignment_length(tokens[i]);
+    if (eq_pos > 0) {
+      variable_set(string_view(tokens[i]).substr(0, eq_pos - 1),
+                   string_view(tokens[i]).substr(eq_pos), true);
+    } else if (is_variable_name(tokens[i])) {
+      variable_export(tokens[i]);
+    } else {
+      io.err << "export: '" << tokens[i] << "': not a valid identifier"
+             << endl;
+      return_value = 1;
+    }
+  }
+  return return_value;
+}
+
+
+int com_true(vector<string>& tokens, builtin_io& io) {
+  return 0;
+}
+
+
+int com_false(vector<string>& tokens, builtin_io& io) {
+  return 1;
+}
+
+
+// Reads the loop count of a break or continue, which leaves at most every
+// loop there is. Returns 0 with an error printed if it isn't usable.
+static int loop_count(vector<string>& tokens, builtin_io& io) {
+  if (loop_depth == 0) {
+    io.err << tokens[0] << ": only meaningful in a loop" << endl;
+    return 0;
+  }
+  int count = tokens.size() > 1 ? atoi(tokens[1].c_str()) : 1;
+  if (count < 1) {
+    io.err << tokens[0] << ": " << tokens[1] << ": loop count out of range"
+           << endl;
+    return 0;
+  }
+  return min(count, loop_depth);
+}
+
+
+int com_break(vector<string>& tokens, builtin_io& io) {
+  int count = loop_count(tokens, io);
+  if (count == 0) return 1;
+  breaking = count;
+  return 0;
+}
+
+
+int com_continue(vector<string>& tokens, builtin_io& io) {
+  int count = loop_count(tokens, io);
+  if (count == 0) return 1;
+  continuing = count;
+  return 0;
+}
+
+
+int com_return(vector<string>& tokens, builtin_io& io) {
+  if (function_depth == 0) {
+    io.err << "return: can only return from a function" << endl;
+    return 1;
+  }
+  returning = true;
+  return tokens.size() > 1 ? atoi(tokens[1].c_str()) & 0xff : last_status;
+}
+
+
+int com_hash(vector<string>& tokens, builtin_io& io) {
+  // No arguments, list the hash
+  if (tokens.size() < 2) {
+    map<string, hash_entry> hashed = hash_snapshot();
+    if (hashed.empty()) {
+      io.out << "hash: hash table empty" << endl;
+      return 0;
+    }
+    io.out << "hits\tcommand" << endl;
+    typedef map<string, hash_entry>::iterator it;
+    for (it i = hashed.begin(); i != hashed.end(); i++) {
+      io.out << "   " << i->second.hits << "\t" << i->second.path << endl;
+    }
+    return 0;
+  }
+  // Forget everything
+  if (tokens[1] == "-r") {
+    hash_clear();
+    return 0;
+  }
+  // Show how well the hash is doing
+  if (tokens[1] == "-s") {
+    unsigned long hits, misses;
+    hash_stats(hits, misses);
+    io.out << "hits: " << hits << " misses: " << misses << endl;
+    return 0;
+  }
+  // Forget just the named commands
+  int return_value = 0;
+  if (tokens[1] == "-d") {
+    for (int i = 2; i < tokens.size(); i++) {
+      if (!hash_forget(tokens[i])) {
+        io.err << "hash: " << tokens[i] << " not found" << endl;
+        return_value = 1;
+      }
+    }
+    return return_value;
+  }
+  // Search for each name again and remember it
+  for (int i = 1; i < tokens.size(); i++) {
+    hash_forget(tokens[i]);
+    if (hash_lookup(tokens[i]).empty()) {
+      io.err << "hash: " << tokens[i] << " not found" << endl;
+      return_value = 1;
+    }
+  }
+  return return_value;
+}
+
+
+int com_jobs(vector<string>& tokens, builtin_io& io) {
+  jobs_reap();
+  // List in job number order
+  map<int, job*> sorted;
+  for (map<int, job>::iterator i = jobs.begin(); i != jobs.end(); i++) {
+    sorted[i->second.number] = &i->second;
+  }
+  const char* states[] = { "Running", "Stopped", "Done" };
+  typedef map<int, job*>::iterator it;
+  for (it i = sorted.begin(); i != sorted.end(); i++) {
+    job& j = *i->second;
+    io.out << "[" << j.number << "]  " << states[j.state] << "\t\t" << j.text
+         << endl;
+    // Done jobs have now been reported
+    if (j.state == JOB_DONE) jobs.erase(j.pgid);
+  }
+  return 0;
+}
+
+
+int com_fg(vector<string>& tokens, builtin_io& io) {
+  job* j = job_find(tokens.size() > 1 ? tokens[1] : "");
+  if (!j) {
+    io.err << "fg: no such job" << endl;
+    return 1;
+  }
+  // Hand back the job's status, as if it had been run in the foreground
+  return exit_code(job_foreground(*j));
+}
+
+
+int com_bg(vector<string>& tokens, builtin_io& io) {
+  job* j = job_find(tokens.size() > 1 ? tokens[1] : "");
+  if (!j) {
+    io.err << "bg: no such job" << endl;
+    return 1;
   }
+  job_background(*j);
   return 0;
 }
 
-string pwd() {
-  // Define buffer
-  char* curDir = (char*) malloc(sizeof(char) * 1024);
-  // Syscall for current directory
-  getcwd(curDir, 1024);
-  // Check if got the dir correctly
-  if (curDir != NULL) {
-    // Cast, deallocate, and return
-    string ret = (string) curDir; 
-    free(curDir);
-    return ret;
+
+int com_wait(vector<string>& tokens, builtin_io& io) {
+  int status = 0;
+  // Wait for the next job to finish
+  if (tokens.size() > 1 && tokens[1] == "-n") {
+    if (jobs.empty()) return 127;
+    status = job_wait(NULL, true);
+  }
+  // Wait for everything
+  else if (tokens.size() < 2) {
+    status = job_wait(NULL, false);
+  }
+  // Wait for each job given
+  else {
+    for (int i = 1; i < tokens.size(); i++) {
+      job* j = job_find(tokens[i]);
+      if (!j) {
+        io.err << "wait: " << tokens[i] << ": no such job" << endl;
+        status = 127 << 8;
+        continue;
+      }
+      status = job_wait(j, false);
+    }
+  }
+  return exit_code(status);
+}
+
+
+// Calls scan with each block of the input, until it runs out or scan returns
+// false: all of what is left of a regular file at once, mapped into memory,
+// or a buffer at a time of anything else. With whole_lines, a block from a
+// buffer never ends partway through a line, which means holding on to a
+// line however long it gets.
+// Returns 0, or -1 with errno set if the input couldn't be read.
+template <class block_function>
+static int scan_input(int fd, bool whole_lines, block_function scan) {
+  struct stat info;
+  if (fstat(fd, &info) == -1) return -1;
+  off_t offset = S_ISREG(info.st_mode) ? lseek(fd, 0, SEEK_CUR) : -1;
+  // Files claiming to be empty, like those in /proc, have to be read
+  if (offset != -1 && info.st_size > offset) {
+    void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+      scan((const char*) mapped + offset, info.st_size - offset);
+      munmap(mapped, info.st_size);
+      // Leave the input read, as it would be after reading it
+      lseek(fd, 0, SEEK_END);
+      return 0;
+    }
+  }
+
+  if (!whole_lines) {
+    vector<char> buffer(SCAN_BUFFER_SIZE);
+    while (true) {
+      ssize_t got = read(fd, buffer.data(), buffer.size());
+      if (got == -1 && errno == EINTR && !builtin_interrupted) continue;
+      if (got <= 0) return got;
+      if (!scan(buffer.data(), got)) return 0;
+    }
+  }
+
+  line_reader reader;
+  line_reader_init(reader, fd);
+  reader.interrupted = &builtin_interrupted;
+  const char* data;
+  size_t size;
+  while (true) {
+    if (read_block(reader, data, size)) {
+      if (!scan(data, size)) return 0;
+    }
+    else if (reader.error == EINTR && !builtin_interrupted) {
+      continue;
+    }
+    else {
+      errno = reader.error;
+      return reader.error ? -1 : 0;
+    }
+  }
+}
+
+
+// Opens a file named on the command line for reading, with "-" standing for
+// the built-in's stdin. Returns the descriptor, or -1 after reporting why it
+// couldn't.
+static int open_input(const string& command, const string& name,
+                      builtin_io& io) {
+  if (name == "-") return io.in_fd;
+  int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    io.err << command << ": " << name << ": " << strerror(errno) << endl;
+  }
+  return fd;
+}
+
+
+// Returns the number of digits in n
+static int digits(size_t n) {
+  int count = 1;
+  for (; n >= 10; n /= 10) count++;
+  return count;
+}
+
+
+int com_wc(vector<string>& tokens, builtin_io& io) {
+  // The lines, words and bytes counts, and which of them are shown
+  const char flags[] = { 'l', 'w', 'c' };
+  bool shown[3] = { false, false, false };
+  int first = 1;
+  for (; first < tokens.size() && tokens[first].size() > 1 &&
+         tokens[first][0] == '-'; first++) {
+    if (tokens[first] == "--") {
+      first++;
+      break;
+    }
+    for (int c = 1; c < tokens[first].size(); c++) {
+      const char* flag = (const char*) memchr(flags, tokens[first][c], 3);
+      if (!flag) return run_external_command(tokens, io);
+      shown[flag - flags] = true;
+    }
+  }
+  if (!shown[0] && !shown[1] && !shown[2]) {
+    shown[0] = shown[1] = shown[2] = true;
+  }
+  int columns = shown[0] + shown[1] + shown[2];
+
+  vector<string> names(tokens.begin() + first, tokens.end());
+  bool named = !names.empty();
+  if (!named) names.push_back("-");
+
+  // Open everything first, as the columns are made wide enough for the
+  // combined size of the files, or for 7 digits if something isn't a file
+  int return_value = 0;
+  vector<int> fds;
+  size_t total_size = 0;
+  int width = 1;
+  for (int i = 0; i < names.size(); i++) {
+    int fd = open_input("wc", names[i], io);
+    if (fd == -1) return_value = 1;
+    struct stat info;
+    if (fd != -1 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+      total_size += info.st_size;
+    } else {
+      width = 7;
+    }
+    fds.push_back(fd);
+  }
+  if (names.size() > 1 || columns > 1) {
+    width = max(width, digits(total_size));
+  } else {
+    width = 1;
+  }
+
+  catch_interrupts(false);
+  size_t totals[3] = { 0, 0, 0 };
+  for (int i = 0; i < names.size() && !builtin_interrupted; i++) {
+    if (fds[i] == -1) continue;
+    size_t counts[3] = { 0, 0, 0 };
+    bool in_word = false;
+    int result = scan_input(fds[i], false,
+                            [&](const char* data, size_t size) {
+      if (shown[0]) counts[0] += count_newlines(data, size);
+      if (shown[1]) counts[1] += count_words(data, size, in_word);
+      counts[2] += size;
+      return !builtin_interrupted;
+    });
+    if (result == -1 && !builtin_interrupted) {
+      io.err << "wc: " << names[i] << ": " << strerror(errno) << endl;
+      return_value = 1;
+    }
+    if (fds[i] != io.in_fd) close(fds[i]);
+    if (result == -1 || builtin_interrupted) continue;
+
+    const char* separator = "";
+    for (int c = 0; c < 3; c++) {
+      totals[c] += counts[c];
+      if (!shown[c]) continue;
+      io.out << separator << setw(width) << counts[c];
+      separator = " ";
+    }
+    if (named) io.out << " " << names[i];
+    io.out << endl;
+  }
+  // The files after an interrupted one are still open
+  for (int i = 0; i < fds.size(); i++) {
+    if (builtin_interrupted && fds[i] != -1 && fds[i] != io.in_fd) {
+      close(fds[i]);
+    }
+  }
+
+  if (names.size() > 1 && !builtin_interrupted) {
+    const char* separator = "";
+    for (int c = 0; c < 3; c++) {
+      if (!shown[c]) continue;
+      io.out << separator << setw(width) << totals[c];
+      separator = " ";
+    }
+    io.out << " total" << endl;
+  }
+  if (builtin_interrupted) return_value = 128 + SIGINT;
+  release_interrupts(false);
+  return return_value;
+}
+
+
+int com_grep(vector<string>& tokens, builtin_io& io) {
+  bool fixed = false;
+  bool count_only = false;
+  bool numbered = false;
+  bool quiet = false;
+  int first = 1;
+  for (; first < tokens.size() && tokens[first].size() > 1 &&
+         tokens[first][0] == '-'; first++) {
+    if (tokens[first] == "--") {
+      first++;
+      break;
+    }
+    for (int c = 1; c < tokens[first].size(); c++) {
+      char flag = tokens[first][c];
+      if (flag == 'F') fixed = true;
+      else if (flag == 'c') count_only = true;
+      else if (flag == 'n') numbered = true;
+      else if (flag == 'q') quiet = true;
+      else return run_external_command(tokens, io);
+    }
   }
-  return NULL;
+  // A missing pattern, several patterns or a regular expression
+  if (first == tokens.size() ||
+      tokens[first].find('\n') != string::npos ||
+      (!fixed &&
+       tokens[first].find_first_of(REGEX_CHARACTERS) != string::npos)) {
+    return run_external_command(tokens, io);
+  }
+  string_view pattern = tokens[first];
+
+  vector<string> names(tokens.begin() + first + 1, tokens.end());
+  bool prefixed = names.size() > 1;
+  if (names.empty()) names.push_back("-");
+
+  catch_interrupts(false);
+  bool matched = false;
+  bool failed = false;
+  string out;
+  for (int i = 0; i < names.size() && !builtin_interrupted; i++) {
+    int fd = open_input("grep", names[i], io);
+    if (fd == -1) {
+      failed = true;
+      continue;
+    }
+    string prefix;
+    if (prefixed) {
+      prefix = (names[i] == "-" ? "(standard input)" : names[i]) + ":";
+    }
+
+    size_t matches = 0;
+    size_t line_number = 1;
+    bool write_failed = false;
+    // Writes out what has been gathered, noting if that fails
+    auto flush = [&](string& text) {
+      if (!text.empty() && write_all(io.out_fd, text.data(),
+                                     text.size()) == -1) {
+        write_failed = true;
+        return false;
+      }
+      text.clear();
+      return true;
+    };
+    int result = scan_input(fd, true, [&](const char* data, size_t size) {
+      const char* end = data + size;
+      // Lines are only numbered up to where they are needed
+      const char* counted = data;
+      for (const char* p = data; p < end; ) {
+        const char* hit = find_substring(p, end - p, pattern);
+        if (!hit) break;
+        matches++;
+        if (quiet) return false;
+
+        // p is always at the start of a line
+        const char* start = (const char*) memrchr(p, '\n', hit - p);
+        start = start ? start + 1 : p;
+        const char* newline = (const char*) memchr(hit, '\n', end - hit);
+        p = newline ? newline + 1 : end;
+        if (count_only) continue;
+
+        out += prefix;
+        if (numbered) {
+          line_number += count_newlines(counted, start - counted);
+          counted = start;
+          out += to_string(line_number) + ":";
+        }
+        out.append(start, p - start);
+        if (!newline) out += '\n';
+        if (out.size() >= OUTPUT_FLUSH && !flush(out)) return false;
+      }
+      if (numbered) line_number += count_newlines(counted, end - counted);
+      // Matches in a stream show up as soon as they are read
+      return flush(out) && !builtin_interrupted;
+    });
+    if (fd != io.in_fd) close(fd);
+
+    if (result == -1 && !builtin_interrupted) {
+      io.err << "grep: " << names[i] << ": " << strerror(errno) << endl;
+      failed = true;
+    }
+    // A reader that has gone needs no telling
+    if (write_failed) {
+      if (errno != EPIPE) {
+        io.err << "grep: write error: " << strerror(errno) << endl;
+      }
+      failed = true;
+      break;
+    }
+    matched = matched || matches > 0;
+    if (quiet && matched) break;
+    if (count_only) out += prefix + to_string(matches) + "\n";
+  }
+  if (!out.empty() && write_all(io.out_fd, out.data(), out.size()) == -1) {
+    if (errno != EPIPE) {
+      io.err << "grep: write error: " << strerror(errno) << endl;
+    }
+    failed = true;
+  }
+
+  int return_value = (failed && !(quiet && matched)) ? 2 : (matched ? 0 : 1);
+  if (builtin_interrupted) return_value = 128 + SIGINT;
+  release_interrupts(false);
+  return return_value;
+}
+
+
+static void interrupt_handler(int signum) {
+  builtin_interrupted = 1;
+}
+
+
+// Sets up the handling that the built-ins holding Ctrl-C call for
+static void install_interrupt_handler() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = interrupt_catchers ? interrupt_handler : SIG_IGN;
+  sigemptyset(&action.sa_mask);
+  // No SA_RESTART, so a blocked read or splice returns and sees the flag
+  sigaction(SIGINT, &action, NULL);
+}
+
+
+void catch_interrupts(bool ignore) {
+  lock_guard<mutex> lock(interrupt_mutex);
+  if (interrupt_catchers + interrupt_ignorers == 0) {
+    builtin_interrupted = 0;
+    sigaction(SIGINT, NULL, &interrupt_saved);
+  }
+  (ignore ? interrupt_ignorers : interrupt_catchers)++;
+  install_interrupt_handler();
+}
+
+
+void release_interrupts(bool ignore) {
+  lock_guard<mutex> lock(interrupt_mutex);
+  (ignore ? interrupt_ignorers : interrupt_catchers)--;
+  if (interrupt_catchers + interrupt_ignorers == 0) {
+    sigaction(SIGINT, &interrupt_saved, NULL);
+  } else {
+    install_interrupt_handler();
+  }
+}
+
+
+int write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written == -1 && errno == EINTR && !builtin_interrupted) continue;
+    if (written == -1) return -1;
+    data += written;
+    size -= written;
+  }
+  return 0;
 }
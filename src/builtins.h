@@ -1,4 +1,5 @@
 #pragma once
+#include <csignal>
 #include <cstdlib>
 #include <iostream>
 #include <string>
@@ -11,49 +12,200 @@
 // Allows to read the history
 #include<readline/history.h>
 
+#include "builtin_io.h"
+
 
 using std::vector;
 using std::string;
 
 
 // Lists all the files in the specified directory. If not given an argument,
-// the current working directory is used instead.
-int com_ls(vector<string>& tokens);
+// the current working directory is used instead. Entries are sorted by name
+// and shown in columns on a terminal, or one per line elsewhere or with -1.
+// -a also shows hidden entries (-A all but . and ..), -p marks directories
+// and -l gives the long format. Entries are read in large getdents64
+// batches, looked up with statx (by several threads in large directories)
+// and written out in a few large writes. Other options run the real ls.
+int com_ls(vector<string>& tokens, builtin_io& io);
 
 
 // Changes the current working directory to that specified by the given
-// argument.
-int com_cd(vector<string>& tokens);
+// argument, or back to $OLDPWD for "-". PWD and OLDPWD are exported as the
+// new and old directories.
+int com_cd(vector<string>& tokens, builtin_io& io);
 
 
 // Displays the current working directory.
-int com_pwd(vector<string>& tokens);
+int com_pwd(vector<string>& tokens, builtin_io& io);
 
 
 // If called without an argument, then any existing aliases are displayed.
-// Otherwise, the second argument is assumed to be a new alias and an entry
-// is made in the alias map.
-int com_alias(vector<string>& tokens);
+// Otherwise each name=value argument defines an alias, whose value may hold
+// several words, and each bare name displays that alias.
+int com_alias(vector<string>& tokens, builtin_io& io);
 
 
 // Removes aliases. If "-a" is provided as the second argument, then all
 // existing aliases are removed. Otherwise, the second argument is assumed to
 // be a specific alias to remove and if it exists, that alias is deleted.
-int com_unalias(vector<string>& tokens);
+int com_unalias(vector<string>& tokens, builtin_io& io);
 
 
 // Prints all arguments to the terminal.
-int com_echo(vector<string>& tokens);
+int com_echo(vector<string>& tokens, builtin_io& io);
+
+
+// Exits the program, with the given status or 0.
+int com_exit(vector<string>& tokens, builtin_io& io);
+
+
+// Replaces the shell with the command, if one is given. Run in the shell
+// itself, its redirections stay in place for every command after it, so
+// "exec 3>>log" opens a file once for a whole loop to write to with >&3. At
+// the end of a pipeline or in "$(...)" it only replaces a copy of the shell.
+int com_exec(vector<string>& tokens, builtin_io& io);
+
+
+// Displays the most recent commands (100, or n with "history n"), with their
+// numbers in the history store, which keeps commands from every session.
+// "history -s term" lists the commands containing term and "history -p
+// prefix" the most recent one starting with prefix.
+int com_history(vector<string>& tokens, builtin_io& io);
+
+
+// Switches shell options. "set -o name" turns an option on and "set +o name"
+// turns it off. Without a name, all options and their settings are listed.
+int com_set(vector<string>& tokens, builtin_io& io);
+
+
+// Exports variables to the environment of the commands the shell starts.
+// "export NAME=value" sets and exports a variable and "export NAME" exports
+// one as it is. Without names, every exported variable is listed.
+int com_export(vector<string>& tokens, builtin_io& io);
+
+
+// Manages the hash of command locations. Without arguments, every remembered
+// command is listed with its number of hits. "-r" forgets all of them, "-d"
+// forgets the named ones, "-s" shows the hit and miss counts, and any other
+// names are looked up on $PATH and remembered.
+int com_hash(vector<string>& tokens, builtin_io& io);
+
+
+// Lists the background and stopped jobs with their state.
+int com_jobs(vector<string>& tokens, builtin_io& io);
+
+
+// Brings a job (the most recent one, or the given %n) to the foreground and
+// waits for it.
+int com_fg(vector<string>& tokens, builtin_io& io);
+
+
+// Continues a stopped job (the most recent one, or the given %n) in the
+// background.
+int com_bg(vector<string>& tokens, builtin_io& io);
+
+
+// Waits for the given jobs (%n or pid) to finish, or for all of them if none
+// are given. With "-n", waits only for the next job to finish. Returns the
+// status of the last job waited for.
+int com_wait(vector<string>& tokens, builtin_io& io);
+
+
+// Runs a command once per argument, at most N at a time ("-j N", one per
+// processor by default). Arguments follow ":::" or, without one, are read a
+// line at a time from stdin. Each {} in the command is replaced by the
+// argument, which is otherwise added at the end, and the words are run as
+// they are, without being expanded again. A job's output is printed in one
+// piece when it finishes, and a timing summary goes to stderr unless "-q" is
+// given. Returns the number of failed jobs (at most 101).
+int com_parallel(vector<string>& tokens, builtin_io& io);
+
+
+// Concatenates the files (or stdin, for none or "-") onto stdout. The data is
+// moved in the kernel where it can: splice when stdin or stdout is a pipe,
+// copy_file_range between files and sendfile from a file to anything else.
+// Only -u is supported; other options run the real cat.
+int com_cat(vector<string>& tokens, builtin_io& io);
+
+
+// Copies stdin to stdout and to each of the files, truncating them first or,
+// with "-a", appending. "-i" ignores Ctrl-C. When stdin is a pipe the data is
+// duplicated with tee(2) and spliced out, never read by the shell. Other
+// options run the real tee.
+int com_tee(vector<string>& tokens, builtin_io& io);
+
+
+// Counts the lines, words and bytes of each file (or stdin, for none or "-"),
+// with a total when there are several. -l, -w and -c pick the counts shown.
+// Regular files are mapped and everything else read a buffer at a time, and
+// both are counted with the widest SIMD kernels the CPU has. Other options
+// run the real wc.
+int com_wc(vector<string>& tokens, builtin_io& io);
+
+
+// Prints the lines of each file (or stdin) that contain the pattern, as
+// "grep -F pattern" does. -c counts the lines instead, -n numbers them and
+// -q only sets the status, 0 if a line matched, 1 if none did and 2 on an
+// error. Without -F, a pattern with no regular expression characters in it is
+// searched for the same way. Anything else, other options or a real regular
+// expression, runs the real grep. Files are searched as text, even binary
+// ones.
+int com_grep(vector<string>& tokens, builtin_io& io);
+
+
+// Evaluates a conditional expression, as test or [ (which needs a closing
+// ]): file tests like -e, -f and -d, string tests -n and -z and comparisons
+// with = and !=, integer comparisons -eq, -ne, -lt, -le, -gt and -ge, and !,
+// -a, -o and parentheses to combine them. Returns 0 if it is true, 1 if it is
+// false and 2 if it is malformed.
+int com_test(vector<string>& tokens, builtin_io& io);
+
+
+// Does nothing, successfully (true and :) or not (false).
+int com_true(vector<string>& tokens, builtin_io& io);
+int com_false(vector<string>& tokens, builtin_io& io);
+
+
+// Leaves the innermost loop, or the nth one out with "break n", or goes on to
+// its next pass with continue.
+int com_break(vector<string>& tokens, builtin_io& io);
+int com_continue(vector<string>& tokens, builtin_io& io);
+
+
+// Returns from a function, with the given status or that of the last
+// command.
+int com_return(vector<string>& tokens, builtin_io& io);
+
+
+// Works out the current directory, from $PWD if that still leads there, and
+// exports it as PWD. Called at startup, and after the directory is changed
+// other than by cd.
+void directory_init();
+
+
+// Returns the current working directory as the shell keeps track of it,
+// without a system call, or "" if it couldn't be found.
+const string& pwd();
+
+
+// Set when Ctrl-C interrupts a built-in that is catching it.
+extern volatile sig_atomic_t builtin_interrupted;
 
 
-// Exits the program.
-int com_exit(vector<string>& tokens);
+// Makes Ctrl-C set builtin_interrupted and interrupt any blocked system call,
+// instead of killing the process running a long built-in, which may be the
+// shell itself. With ignore, Ctrl-C is ignored instead, unless another
+// built-in is catching it. Built-ins running at the same time share the
+// handling, and the first to call resets the flag.
+void catch_interrupts(bool ignore);
 
 
-// Displays all previously entered commands, as well as their associated line
-// numbers in history.
-int com_history(vector<string>& tokens);
+// Called by each built-in that caught (or ignored) Ctrl-C when it is done,
+// with the same ignore. The last one puts back the handling from before the
+// first.
+void release_interrupts(bool ignore);
 
 
-// Returns the current working directory.
-string pwd();
+// Writes all of the data, however many calls it takes. Returns 0, or -1 with
+// errno set.
+int write_all(int fd, const char* data, size_t size);
@@ -0,0 +1,306 @@
+#include "builtins.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "shell.h"
+
+using namespace std;
+
+// Most one splice, sendfile or copy_file_range call is asked to move
+const size_t COPY_CHUNK = 1 << 30;
+
+// Size of the buffer for data that has to pass through user space
+const size_t BUFFER_SIZE = 128 * 1024;
+
+// Capacity asked of the pipes we move data through, so each splice moves more
+// at once. Asking for more than the system allows just leaves them as they are.
+const int PIPE_SIZE = 1024 * 1024;
+
+// The ways of moving data in the kernel, without reading it
+enum copy_method { COPY_SPLICE, COPY_FILE_RANGE, COPY_SENDFILE };
+
+
+// Whether a failed system call was just interrupted and should be retried
+static bool retry(ssize_t result) {
+  return result == -1 && errno == EINTR && !builtin_interrupted;
+}
+
+
+// Whether a kernel copy failed only because the descriptors don't support it,
+// e.g. an output opened for appending, or different file systems
+static bool unsupported(int error) {
+  return error == EINVAL || error == ENOSYS || error == EXDEV ||
+         error == EOPNOTSUPP || error == EBADF || error == ESPIPE;
+}
+
+
+// Moves everything left in from to each of the outputs through a buffer.
+// Returns 0, or -1 with errno set.
+static int buffered_copy(int from, const vector<int>& outputs) {
+  vector<char> buffer(BUFFER_SIZE);
+  while (true) {
+    ssize_t got = read(from, buffer.data(), buffer.size());
+    if (retry(got)) continue;
+    if (got <= 0) return got;
+    for (int i = 0; i < outputs.size(); i++) {
+      if (write_all(outputs[i], buffer.data(), got) == -1) return -1;
+    }
+  }
+}
+
+
+// Repeats one kind of kernel copy from in to out until in runs out. Returns 0
+// at the end of in, 1 if the descriptors can't be copied between this way
+// (the data so far has been moved, so another way can carry on), or -1 with
+// errno set.
+static int kernel_copy(copy_method method, int in, int out) {
+  while (true) {
+    ssize_t moved;
+    if (method == COPY_SPLICE) {
+      moved = splice(in, NULL, out, NULL, COPY_CHUNK,
+                     SPLICE_F_MOVE | SPLICE_F_MORE);
+    } else if (method == COPY_FILE_RANGE) {
+      moved = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+    } else {
+      moved = sendfile(out, in, NULL, COPY_CHUNK);
+    }
+    if (moved == 0) return 0;
+    if (retry(moved)) continue;
+    if (moved == -1) return unsupported(errno) ? 1 : -1;
+  }
+}
+
+
+// Copies everything from in to out, in the kernel when it can: splice when
+// either end is a pipe, copy_file_range between regular files and sendfile
+// from a regular file to anything else. Whatever those can't handle goes
+// through a buffer. Files claiming to be empty, like those in /proc, are
+// always read, as the kernel copies would find nothing in them.
+// Returns 0, or -1 with errno set.
+static int copy_fd(int in, int out) {
+  struct stat in_stat, out_stat;
+  if (fstat(in, &in_stat) == -1 || fstat(out, &out_stat) == -1) return -1;
+
+  int result = 1;
+  if (S_ISFIFO(in_stat.st_mode) || S_ISFIFO(out_stat.st_mode)) {
+    if (S_ISFIFO(out_stat.st_mode)) fcntl(out, F_SETPIPE_SZ, PIPE_SIZE);
+    result = kernel_copy(COPY_SPLICE, in, out);
+  }
+  else if (S_ISREG(in_stat.st_mode) && in_stat.st_size > 0) {
+    if (S_ISREG(out_stat.st_mode)) {
+      result = kernel_copy(COPY_FILE_RANGE, in, out);
+    }
+    if (result == 1) result = kernel_copy(COPY_SENDFILE, in, out);
+  }
+  if (result == 1) result = buffered_copy(in, vector<int>(1, out));
+  return result;
+}
+
+
+// Moves exactly size bytes from the pipe from to out, with splice or, once out
+// has turned out not to take spliced data, through the buffer.
+// Returns 0, or -1 with errno set.
+static int drain_pipe(int from, int out, size_t size, bool& buffered,
+                      vector<char>& buffer) {
+  while (size > 0) {
+    ssize_t moved;
+    if (!buffered) {
+      moved = splice(from, NULL, out, NULL, size,
+                     SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (moved == -1 && unsupported(errno)) {
+        buffered = true;
+        buffer.resize(BUFFER_SIZE);
+        continue;
+      }
+    } else {
+      moved = read(from, buffer.data(), min(size, buffer.size()));
+      if (moved > 0 && write_all(out, buffer.data(), moved) == -1) return -1;
+    }
+    if (retry(moved)) continue;
+    if (moved == -1) return -1;
+    // The data was already waiting in the pipe, so it can't run out
+    if (moved == 0) {
+      errno = EIO;
+      return -1;
+    }
+    size -= moved;
+  }
+  return 0;
+}
+
+
+// Copies everything from the pipe in to each of the outputs without reading
+// it. tee(2) duplicates what is waiting in the pipe into a private pipe for
+// every output but the last, which then takes the original with splice. The
+// private pipes are as big as in, so each always takes all of it.
+// Returns as kernel_copy does.
+static int pipe_tee(int in, const vector<int>& outputs) {
+  int copies = outputs.size() - 1;
+  vector<int> fds(2 * copies, -1);
+  int capacity = 0;
+  int result = 0;
+  for (int i = 0; i < copies && result == 0; i++) {
+    if (pipe2(&fds[2 * i], O_CLOEXEC) == -1) result = -1;
+  }
+
+  vector<bool> buffered(outputs.size(), false);
+  vector<char> buffer;
+  bool started = false;
+  while (result == 0) {
+    // Keep up if the writer has grown the pipe
+    int wanted = fcntl(in, F_GETPIPE_SZ);
+    if (wanted > capacity) {
+      for (int i = 0; i < copies; i++) {
+        if (fcntl(fds[2 * i + 1], F_SETPIPE_SZ, wanted) < wanted) {
+          errno = EINVAL;
+          result = started ? -1 : 1;
+        }
+      }
+      capacity = wanted;
+      if (result != 0) break;
+    }
+
+    // Wait for some data, then copy it into each private pipe
+    ssize_t size;
+    while (retry(size = tee(in, fds[1], COPY_CHUNK, 0)));
+    if (size == 0) break;
+    if (size == -1) {
+      result = (!started && unsupported(errno)) ? 1 : -1;
+      break;
+    }
+    started = true;
+    for (int i = 1; i < copies && result == 0; i++) {
+      ssize_t copied;
+      while (retry(copied = tee(in, fds[2 * i + 1], size, 0)));
+      if (copied != size) {
+        if (copied != -1) errno = EIO;
+        result = -1;
+      }
+    }
+
+    // Empty the private pipes and then the original
+    for (int i = 0; i < copies && result == 0; i++) {
+      bool out_buffered = buffered[i];
+      result = drain_pipe(fds[2 * i], outputs[i], size, out_buffered, buffer);
+      buffered[i] = out_buffered;
+    }
+    if (result == 0) {
+      bool out_buffered = buffered[copies];
+      result = drain_pipe(in, outputs[copies], size, out_buffered, buffer);
+      buffered[copies] = out_buffered;
+    }
+  }
+
+  for (int i = 0; i < fds.size(); i++) {
+    if (fds[i] != -1) close(fds[i]);
+  }
+  return result;
+}
+
+
+// Copies everything from in to each of the outputs, in the kernel when in is
+// a pipe. Returns 0, or -1 with errno set.
+static int tee_fd(int in, const vector<int>& outputs) {
+  if (outputs.size() == 1) return copy_fd(in, outputs[0]);
+  struct stat in_stat;
+  if (fstat(in, &in_stat) == -1) return -1;
+  int result = 1;
+  if (S_ISFIFO(in_stat.st_mode)) result = pipe_tee(in, outputs);
+  if (result == 1) result = buffered_copy(in, outputs);
+  return result;
+}
+
+
+int com_cat(vector<string>& tokens, builtin_io& io) {
+  // Options other than -u (output is never held back anyway) are left to the
+  // real cat
+  int first = 1;
+  for (; first < tokens.size() && tokens[first].size() > 1 &&
+         tokens[first][0] == '-'; first++) {
+    if (tokens[first] == "--") {
+      first++;
+      break;
+    }
+    if (tokens[first] != "-u") return run_external_command(tokens, io);
+  }
+
+  catch_interrupts(false);
+  // With no files, copy stdin
+  if (first == tokens.size()) tokens.push_back("-");
+  int return_value = 0;
+  for (int i = first; i < tokens.size() && !builtin_interrupted; i++) {
+    bool from_stdin = tokens[i] == "-";
+    int in = from_stdin ? io.in_fd
+                        : open(tokens[i].c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1 || copy_fd(in, io.out_fd) == -1) {
+      // Once the reader has gone, the rest of the files are pointless
+      if (in != -1 && errno == EPIPE) {
+        if (!from_stdin) close(in);
+        return_value = 1;
+        break;
+      }
+      if (!builtin_interrupted) {
+        io.err << "cat: " << tokens[i] << ": " << strerror(errno) << endl;
+      }
+      return_value = 1;
+    }
+    if (in != -1 && !from_stdin) close(in);
+  }
+  if (builtin_interrupted) return_value = 128 + SIGINT;
+  release_interrupts(false);
+  return return_value;
+}
+
+
+int com_tee(vector<string>& tokens, builtin_io& io) {
+  // -a appends to the files and -i ignores Ctrl-C. Anything else is left to
+  // the real tee.
+  bool append = false;
+  bool ignore_interrupts = false;
+  int first = 1;
+  for (; first < tokens.size() && tokens[first].size() > 1 &&
+         tokens[first][0] == '-'; first++) {
+    if (tokens[first] == "--") {
+      first++;
+      break;
+    }
+    for (int c = 1; c < tokens[first].size(); c++) {
+      if (tokens[first][c] == 'a') append = true;
+      else if (tokens[first][c] == 'i') ignore_interrupts = true;
+      else return run_external_command(tokens, io);
+    }
+  }
+
+  // A file that can't be opened is reported, and the rest still written
+  int return_value = 0;
+  vector<int> outputs(1, io.out_fd);
+  mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+  for (int i = first; i < tokens.size(); i++) {
+    int fd = open(tokens[i].c_str(), flags, mode);
+    if (fd == -1) {
+      io.err << "tee: " << tokens[i] << ": " << strerror(errno) << endl;
+      return_value = 1;
+    } else {
+      outputs.push_back(fd);
+    }
+  }
+
+  catch_interrupts(ignore_interrupts);
+  if (tee_fd(io.in_fd, outputs) == -1) {
+    if (!builtin_interrupted && errno != EPIPE) {
+      io.err << "tee: " << strerror(errno) << endl;
+    }
+    return_value = 1;
+  }
+  if (builtin_interrupted) return_value = 128 + SIGINT;
+  release_interrupts(ignore_interrupts);
+
+  for (int i = 1; i < outputs.size(); i++) close(outputs[i]);
+  return return_value;
+}
@@ -0,0 +1,147 @@
+#include "client.h"
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+// The worker running the client's commands, and the signal last passed on
+// to it
+static volatile pid_t worker_pid = 0;
+static volatile sig_atomic_t forwarded = 0;
+
+
+bool socket_address(const char* path, struct sockaddr_un& address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(address.sun_path, path);
+  return true;
+}
+
+
+bool read_full(int fd, void* data, size_t size) {
+  char* at = (char*) data;
+  while (size > 0) {
+    ssize_t got = read(fd, at, size);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) return false;
+    at += got;
+    size -= got;
+  }
+  return true;
+}
+
+
+// Writes exactly size bytes, however many calls it takes. Returns false on an
+// error.
+static bool write_full(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t put = send(fd, data, size, MSG_NOSIGNAL);
+    if (put == -1 && errno == EINTR) continue;
+    if (put == -1) return false;
+    data += put;
+    size -= put;
+  }
+  return true;
+}
+
+
+// Passes a signal sent to the client on to the worker and everything it has
+// started
+static void forward_signal(int signum) {
+  forwarded = signum;
+  if (worker_pid > 0) kill(-worker_pid, signum);
+}
+
+
+int run_client(const char* path, const char* commands) {
+  struct sockaddr_un address;
+  if (!socket_address(path, address)) {
+    perror(path);
+    return 1;
+  }
+  int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (connection == -1 ||
+      connect(connection, (struct sockaddr*) &address,
+              sizeof(address)) == -1) {
+    perror(path);
+    return 1;
+  }
+
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    perror("getcwd");
+    return 1;
+  }
+  request_header header = { (uint32_t) strlen(cwd),
+                            (uint32_t) strlen(commands) };
+
+  // Send the header with our stdin, stdout and stderr attached, then the rest
+  char control[CMSG_SPACE(PASSED_FDS * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct iovec part = { &header, sizeof(header) };
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  struct cmsghdr* passed = CMSG_FIRSTHDR(&message);
+  passed->cmsg_level = SOL_SOCKET;
+  passed->cmsg_type = SCM_RIGHTS;
+  passed->cmsg_len = CMSG_LEN(PASSED_FDS * sizeof(int));
+  int fds[PASSED_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  memcpy(CMSG_DATA(passed), fds, sizeof(fds));
+  if (sendmsg(connection, &message, MSG_NOSIGNAL) != sizeof(header) ||
+      !write_full(connection, cwd, header.cwd_length) ||
+      !write_full(connection, commands, header.command_length)) {
+    perror(path);
+    return 1;
+  }
+
+  // Pass signals on once the worker is known, without restarting the reads,
+  // so one sent before then is noticed too
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = forward_signal;
+  sigemptyset(&action.sa_mask);
+  int signals[] = { SIGINT, SIGQUIT, SIGTERM, SIGHUP };
+  for (int i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+    sigaction(signals[i], &action, NULL);
+  }
+  int32_t reply;
+  if (!read_full(connection, &reply, sizeof(reply))) {
+    fputs("myshell: the server closed the connection\n", stderr);
+    return 1;
+  }
+  worker_pid = reply;
+  if (forwarded) kill(-worker_pid, forwarded);
+
+  // The worker gets our terminal while it runs, so it can read from it and
+  // Ctrl-C reaches it directly
+  bool terminal = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+  if (terminal) tcsetpgrp(STDIN_FILENO, worker_pid);
+
+  bool answered = read_full(connection, &reply, sizeof(reply));
+
+  // Take the terminal back, from the background now
+  if (terminal) {
+    signal(SIGTTOU, SIG_IGN);
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    signal(SIGTTOU, SIG_DFL);
+  }
+  close(connection);
+  if (answered) return reply;
+  // Killed before it could answer
+  if (forwarded) return 128 + forwarded;
+  fputs("myshell: the server closed the connection\n", stderr);
+  return 1;
+}
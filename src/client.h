@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <sys/un.h>
+
+
+// The client side of myshell --server, and what it shares with the server.
+// It uses nothing but the C library, so myshell-client, built from it alone,
+// starts far quicker than the shell does.
+
+
+// The number of fds a client passes: its stdin, stdout and stderr
+const int PASSED_FDS = 3;
+
+// What a client sends first, with its stdin, stdout and stderr attached as
+// SCM_RIGHTS. Its working directory and the command line follow, in that
+// order. The worker answers with its pid, once it leads a process group of its
+// own, and the exit status of the commands when they are done, each as an
+// int32_t.
+struct request_header {
+  uint32_t cwd_length;
+  uint32_t command_length;
+};
+
+
+// Fills in the address of the socket at path. Returns false with errno set
+// if the path is too long for one.
+bool socket_address(const char* path, struct sockaddr_un& address);
+
+
+// Reads exactly size bytes, however many calls it takes. Returns false at the
+// end of the stream or on an error.
+bool read_full(int fd, void* data, size_t size);
+
+
+// Sends the commands to the server at path, to run with this process's
+// stdin, stdout, stderr and working directory, and waits for them. Signals
+// like Ctrl-C are passed on to the worker running them, which also gets the
+// terminal while it runs. Returns the exit status of the commands.
+int run_client(const char* path, const char* commands);
@@ -0,0 +1,120 @@
+#include "completion_index.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "path_search.h"
+#include "variables.h"
+
+using namespace std;
+
+// The programs found in one $PATH directory the last time it was read
+struct indexed_dir {
+  struct timespec mtime;
+  vector<string> names;
+};
+
+// Every directory read so far, by path
+static map<string, indexed_dir> dirs;
+
+// Names offered no matter what $PATH holds
+static vector<string> fixed_names;
+
+// The merged, sorted list of all names
+static vector<string> names;
+
+// The $PATH directories the merged list was built from, and whether it
+// needs building again
+static vector<string> indexed_dirs;
+static bool stale = true;
+
+
+void completion_index_add(const string& name) {
+  fixed_names.push_back(name);
+  stale = true;
+}
+
+
+// Reads every entry of a directory into the cache entry
+static void read_dir(const string& path, indexed_dir& entry) {
+  entry.names.clear();
+  DIR* dir = opendir(path.c_str());
+  // an unreadable directory just contributes nothing
+  if (!dir) return;
+  for (dirent* cur = readdir(dir); cur; cur = readdir(dir)) {
+    // Dont push . or ..
+    if (cur->d_name[0] == '.' &&
+        (cur->d_name[1] == '\0' ||
+         (cur->d_name[1] == '.' && cur->d_name[2] == '\0')))
+      continue;
+    entry.names.push_back(cur->d_name);
+  }
+  closedir(dir);
+}
+
+
+void completion_index_refresh() {
+  const char* path = variable_get("PATH");
+  vector<string> current = path ? split_path(path) : vector<string>();
+  if (current != indexed_dirs) {
+    indexed_dirs = current;
+    stale = true;
+  }
+
+  // Reread only the directories that changed
+  for (int i = 0; i < indexed_dirs.size(); i++) {
+    struct stat info;
+    if (stat(indexed_dirs[i].c_str(), &info) != 0) {
+      info.st_mtim.tv_sec = 0;
+      info.st_mtim.tv_nsec = 0;
+    }
+    map<string, indexed_dir>::iterator found = dirs.find(indexed_dirs[i]);
+    if (found != dirs.end() &&
+        found->second.mtime.tv_sec == info.st_mtim.tv_sec &&
+        found->second.mtime.tv_nsec == info.st_mtim.tv_nsec) {
+      continue;
+    }
+    indexed_dir& entry = dirs[indexed_dirs[i]];
+    entry.mtime = info.st_mtim;
+    read_dir(indexed_dirs[i], entry);
+    stale = true;
+  }
+
+  if (!stale) return;
+
+  // Merge everything into one sorted list without duplicates
+  names = fixed_names;
+  for (int i = 0; i < indexed_dirs.size(); i++) {
+    vector<string>& more = dirs[indexed_dirs[i]].names;
+    names.insert(names.end(), more.begin(), more.end());
+  }
+  sort(names.begin(), names.end());
+  names.erase(unique(names.begin(), names.end()), names.end());
+  stale = false;
+}
+
+
+const vector<string>& completion_index() {
+  return names;
+}
+
+
+pair<size_t, size_t> completion_index_range(const string& prefix) {
+  vector<string>::const_iterator first =
+    lower_bound(names.begin(), names.end(), prefix);
+  // Everything with the prefix sorts before the prefix with its last
+  // character bumped up by one
+  vector<string>::const_iterator last = names.end();
+  string bound = prefix;
+  while (!bound.empty() && (unsigned char) bound.back() == 0xff) {
+    bound.pop_back();
+  }
+  if (!bound.empty()) {
+    bound.back()++;
+    last = lower_bound(first, names.cend(), bound);
+  }
+  return make_pair(first - names.begin(), last - names.begin());
+}
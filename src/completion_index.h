@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <utility>
+#include <vector>
+
+
+using std::pair;
+using std::string;
+using std::vector;
+
+
+// Adds a name that is always offered as a command, wherever $PATH points
+// (used for the built-ins).
+void completion_index_add(const string& name);
+
+
+// Brings the index up to date with $PATH. Only directories that are new or
+// whose modification time changed since they were last read are read again.
+void completion_index_refresh();
+
+
+// Returns the sorted, duplicate free list of every command name.
+const vector<string>& completion_index();
+
+
+// Returns the range [first, last) of positions in completion_index() holding
+// the names that start with the given prefix.
+pair<size_t, size_t> completion_index_range(const string& prefix);
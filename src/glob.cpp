@@ -0,0 +1,342 @@
+#include "glob.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Size of the buffer directory entries are read into, thousands at a time
+const size_t GLOB_DIRENT_BUFFER_SIZE = 256 * 1024;
+
+
+// Reads the [...] class starting at pattern[start] into set. Returns the
+// index just past the closing ], or npos if there isn't one, in which case
+// the [ is an ordinary character.
+static size_t parse_class(string_view pattern, size_t start,
+                          bitset<256>& set) {
+  size_t i = start + 1;
+  bool negated = i < pattern.size() &&
+                 (pattern[i] == '!' || pattern[i] == '^');
+  if (negated) i++;
+  set.reset();
+  // A ] straight after the [ is part of the class
+  bool first = true;
+  while (i < pattern.size() && (pattern[i] != ']' || first)) {
+    first = false;
+    unsigned char low = pattern[i];
+    if (low == '\\' && i + 1 < pattern.size()) low = pattern[++i];
+    i++;
+    unsigned char high = low;
+    // A range, unless the - is last
+    if (i + 1 < pattern.size() && pattern[i] == '-' && pattern[i + 1] != ']') {
+      high = pattern[i + 1];
+      if (high == '\\' && i + 2 < pattern.size()) {
+        high = pattern[i + 2];
+        i++;
+      }
+      i += 2;
+    }
+    for (unsigned c = low; c <= high; c++) set.set(c);
+  }
+  if (i >= pattern.size()) return string_view::npos;
+  if (negated) set.flip();
+  return i + 1;
+}
+
+
+bool glob_has_magic(string_view pattern) {
+  bitset<256> set;
+  for (size_t i = 0; i < pattern.size(); i++) {
+    char c = pattern[i];
+    if (c == '\\') {
+      i++;
+    }
+    else if (c == '*' || c == '?') {
+      return true;
+    }
+    else if (c == '[' && parse_class(pattern, i, set) != string_view::npos) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void glob_compile(string_view pattern, glob_pattern& compiled) {
+  compiled.segments.clear();
+  compiled.literals.clear();
+  compiled.classes.clear();
+  compiled.leading_star = false;
+  compiled.trailing_star = false;
+  compiled.leading_dot = false;
+
+  vector<glob_pattern::element> current;
+  bool literal = true;
+  bool after_star = false;
+  // Moves the elements gathered so far into a segment of their own
+  auto end_segment = [&]() {
+    compiled.literals.push_back("");
+    for (size_t k = 0; literal && k < current.size(); k++) {
+      compiled.literals.back() += current[k].c;
+    }
+    compiled.segments.push_back(current);
+    current.clear();
+    literal = true;
+  };
+  for (size_t i = 0; i < pattern.size(); i++) {
+    glob_pattern::element e = { glob_pattern::element::LITERAL,
+                                (unsigned char) pattern[i], 0 };
+    if (pattern[i] == '*') {
+      if (compiled.segments.empty() && current.empty()) {
+        compiled.leading_star = true;
+      }
+      // A run of *s is the same as one
+      if (!current.empty()) end_segment();
+      after_star = true;
+      continue;
+    }
+    if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+      e.c = pattern[++i];
+    }
+    else if (pattern[i] == '?') {
+      e.kind = glob_pattern::element::ANY;
+    }
+    else if (pattern[i] == '[') {
+      bitset<256> set;
+      size_t end = parse_class(pattern, i, set);
+      if (end != string_view::npos) {
+        e.kind = glob_pattern::element::CLASS;
+        e.set = compiled.classes.size();
+        compiled.classes.push_back(set);
+        i = end - 1;
+      }
+    }
+    if (e.kind != glob_pattern::element::LITERAL) literal = false;
+    if (compiled.segments.empty() && current.empty() && !after_star) {
+      compiled.leading_dot = e.kind == glob_pattern::element::LITERAL &&
+                             e.c == '.';
+    }
+    current.push_back(e);
+    after_star = false;
+  }
+  if (!current.empty()) end_segment();
+  compiled.trailing_star = after_star;
+}
+
+
+// Whether the segment matches the name at position at, which must leave room
+// for the whole segment
+static bool segment_matches(const glob_pattern& compiled,
+                            const vector<glob_pattern::element>& segment,
+                            string_view name, size_t at) {
+  for (size_t k = 0; k < segment.size(); k++) {
+    unsigned char c = name[at + k];
+    const glob_pattern::element& e = segment[k];
+    if (e.kind == glob_pattern::element::LITERAL) {
+      if (c != e.c) return false;
+    }
+    else if (e.kind == glob_pattern::element::CLASS) {
+      if (!compiled.classes[e.set][c]) return false;
+    }
+  }
+  return true;
+}
+
+
+// Returns the first position at or after from where the segment matches the
+// name, or npos
+static size_t find_segment(const glob_pattern& compiled, size_t s,
+                           string_view name, size_t from) {
+  if (!compiled.literals[s].empty()) {
+    return name.find(compiled.literals[s], from);
+  }
+  const vector<glob_pattern::element>& segment = compiled.segments[s];
+  if (segment.size() > name.size()) return string_view::npos;
+  for (size_t at = from; at <= name.size() - segment.size(); at++) {
+    if (segment_matches(compiled, segment, name, at)) return at;
+  }
+  return string_view::npos;
+}
+
+
+bool glob_match(const glob_pattern& compiled, string_view name) {
+  // Hidden names have to be asked for with a literal dot
+  if (!name.empty() && name[0] == '.' && !compiled.leading_dot) return false;
+
+  const vector<vector<glob_pattern::element>>& segments = compiled.segments;
+  size_t first = 0;
+  size_t last = segments.size();
+  size_t pos = 0;
+
+  // Without a * in front, the first segment has to start the name
+  if (!compiled.leading_star) {
+    if (segments.empty()) return name.empty();
+    if (segments[0].size() > name.size() ||
+        !segment_matches(compiled, segments[0], name, 0)) {
+      return false;
+    }
+    pos = segments[0].size();
+    first = 1;
+    if (segments.size() == 1 && !compiled.trailing_star) {
+      return pos == name.size();
+    }
+  }
+
+  // Without a * after it, the last segment has to end the name
+  if (!compiled.trailing_star && last > first) {
+    const vector<glob_pattern::element>& tail = segments[last - 1];
+    if (tail.size() > name.size() - pos) return false;
+    size_t end = name.size() - tail.size();
+    if (!segment_matches(compiled, tail, name, end)) return false;
+    name = name.substr(0, end);
+    last--;
+  }
+
+  // Whatever each * takes, taking the least leaves the most room for the
+  // segments after it, so the first place each segment fits is the one
+  for (size_t s = first; s < last; s++) {
+    size_t at = find_segment(compiled, s, name, pos);
+    if (at == string_view::npos) return false;
+    pos = at + segments[s].size();
+  }
+  return true;
+}
+
+
+string_view glob_unescape(string_view pattern, arena& mem) {
+  if (pattern.find('\\') == string_view::npos) return mem.copy(pattern);
+  string text;
+  text.reserve(pattern.size());
+  for (size_t i = 0; i < pattern.size(); i++) {
+    if (pattern[i] == '\\' && i + 1 < pattern.size()) i++;
+    text += pattern[i];
+  }
+  return mem.copy(text);
+}
+
+
+// Returns the entries of the directory, other than . and .., reading it the
+// first time it is asked for. A directory that can't be read has none.
+static const vector<glob_entry>& list_directory(const string& path,
+                                                glob_cache& cache,
+                                                arena& mem) {
+  unordered_map<string, vector<glob_entry>>::iterator found =
+      cache.directories.find(path);
+  if (found != cache.directories.end()) return found->second;
+
+  vector<glob_entry>& entries = cache.directories[path];
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) return entries;
+  vector<char> buffer(GLOB_DIRENT_BUFFER_SIZE);
+  while (true) {
+    ssize_t got = getdents64(fd, buffer.data(), buffer.size());
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) break;
+    for (ssize_t at = 0; at < got; ) {
+      struct dirent64* entry = (struct dirent64*) (buffer.data() + at);
+      at += entry->d_reclen;
+      const char* name = entry->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      glob_entry e = { mem.copy(string_view(name, strlen(name))),
+                       entry->d_type };
+      entries.push_back(e);
+    }
+  }
+  close(fd);
+  return entries;
+}
+
+
+// Whether the entry of the directory at path is a directory, or a link to one
+static bool is_directory(const string& path, const glob_entry& entry) {
+  if (entry.type == DT_DIR) return true;
+  if (entry.type != DT_UNKNOWN && entry.type != DT_LNK) return false;
+  string full = path + string(entry.name);
+  struct stat info;
+  return stat(full.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+
+// Matches the components from index on, below path, which is empty or ends
+// in a /, adding every path that matches them all.
+static void expand_components(const vector<string_view>& components,
+                              size_t index, string& path, glob_cache& cache,
+                              arena& mem, vector<string_view>& matches) {
+  // Components without glob characters are taken as they are
+  while (index < components.size() && !components[index].empty() &&
+         !glob_has_magic(components[index])) {
+    string_view literal = components[index];
+    for (size_t i = 0; i < literal.size(); i++) {
+      if (literal[i] == '\\' && i + 1 < literal.size()) i++;
+      path += literal[i];
+    }
+    if (++index < components.size()) path += '/';
+  }
+  // Nothing to match, but what was spelled out has to exist
+  if (index == components.size() || components[index].empty()) {
+    struct stat info;
+    if (!path.empty() && lstat(path.c_str(), &info) == 0) {
+      matches.push_back(mem.copy(path));
+    }
+    return;
+  }
+
+  glob_pattern compiled;
+  glob_compile(components[index], compiled);
+  const vector<glob_entry>& entries =
+      list_directory(path.empty() ? "." : path, cache, mem);
+  bool last = index + 1 == components.size();
+  size_t length = path.size();
+  for (size_t e = 0; e < entries.size(); e++) {
+    if (!glob_match(compiled, entries[e].name)) continue;
+    if (last) {
+      // Names in the working directory are already in the arena
+      string_view name = entries[e].name;
+      matches.push_back(path.empty() ? name : mem.copy(path + string(name)));
+    }
+    else if (is_directory(path, entries[e])) {
+      path.append(entries[e].name);
+      path += '/';
+      expand_components(components, index + 1, path, cache, mem, matches);
+      path.resize(length);
+    }
+  }
+}
+
+
+size_t glob_expand(string_view pattern, glob_cache& cache, arena& mem,
+                   vector<string_view>& matches) {
+  size_t before = matches.size();
+
+  // Match one path component at a time. A leading / starts at the root, and
+  // a trailing one leaves an empty last component, so only directories match.
+  string path;
+  size_t start = 0;
+  if (!pattern.empty() && pattern[0] == '/') {
+    path = "/";
+    start = 1;
+  }
+  vector<string_view> components;
+  while (true) {
+    size_t slash = pattern.find('/', start);
+    string_view component = pattern.substr(start, slash - start);
+    if (slash == string_view::npos) {
+      components.push_back(component);
+      break;
+    }
+    if (!component.empty()) components.push_back(component);
+    start = slash + 1;
+  }
+
+  expand_components(components, 0, path, cache, mem, matches);
+  sort(matches.begin() + before, matches.end());
+  return matches.size() - before;
+}
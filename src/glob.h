@@ -0,0 +1,86 @@
+#pragma once
+#include <bitset>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "parser.h"
+
+
+using std::bitset;
+using std::string;
+using std::string_view;
+using std::unordered_map;
+using std::vector;
+
+
+// Patterns are words with the glob characters *, ? and [...] in them. A
+// backslash makes the character after it literal, which is how quoted parts
+// of a word are passed in.
+
+
+// One entry of a directory listing
+struct glob_entry {
+  string_view name;
+  // The d_type from getdents64, which may be DT_UNKNOWN
+  unsigned char type;
+};
+
+
+// The directories read while expanding one line, so that several patterns
+// in the same directory only read it once. The names are kept in the line's
+// arena, and the cache must not outlive it.
+struct glob_cache {
+  unordered_map<string, vector<glob_entry>> directories;
+};
+
+
+// A pattern for one path component, compiled so that matching a name never
+// has to parse the pattern or back up over it
+struct glob_pattern {
+  // The pattern split at its *s. Each segment matches exactly one character
+  // of the name per element.
+  struct element {
+    // A literal character, any character (?), or a [...] class
+    enum { LITERAL, ANY, CLASS } kind;
+    unsigned char c;
+    // Index into classes
+    unsigned short set;
+  };
+  vector<vector<element>> segments;
+  // The text of each segment made only of literal characters, which can be
+  // searched for directly, or empty for one that isn't
+  vector<string> literals;
+  vector<bitset<256>> classes;
+  // Whether the pattern has a * before its first segment, and after its last
+  bool leading_star;
+  bool trailing_star;
+  // Whether the pattern starts with a literal ., the only way to match a
+  // name starting with one
+  bool leading_dot;
+};
+
+
+// Whether the pattern has an unescaped *, ? or [...] in it.
+bool glob_has_magic(string_view pattern);
+
+
+// Compiles the pattern for one path component, which must not contain a /.
+void glob_compile(string_view pattern, glob_pattern& compiled);
+
+
+// Whether the name matches the compiled pattern. Segments are found left to
+// right without backtracking, so this takes time linear in the length of the
+// name for each segment of the pattern.
+bool glob_match(const glob_pattern& compiled, string_view name);
+
+
+// Returns the pattern with its escaping backslashes removed, in mem.
+string_view glob_unescape(string_view pattern, arena& mem);
+
+
+// Appends the paths matching the pattern to matches, sorted, reading each
+// directory through the cache. Returns the number of paths added.
+size_t glob_expand(string_view pattern, glob_cache& cache, arena& mem,
+                   vector<string_view>& matches);
@@ -0,0 +1,495 @@
+#include "history_store.h"
+#include "parser.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Address space reserved for a mapping, so the file can grow (as this and
+// other shells append) without moving the mapping
+const size_t MIN_RESERVATION = (size_t) 1 << 32;
+
+// Marks the start of a line in the n-gram index, so prefixes can be found
+const char LINE_START = '\x02';
+
+// How many entries history_index_build indexes at a time, before letting a
+// search or an append in
+const size_t INDEX_CHUNK = 8192;
+
+// A file mapped read-only, with room to grow
+struct mapped_file {
+  int fd;
+  const char* base;
+  size_t reserved;
+  size_t size;
+};
+
+static mapped_file history_data = { -1, NULL, 0, 0 };
+static mapped_file history_offsets = { -1, NULL, 0, 0 };
+
+// One distinct line of the history
+struct history_line {
+  // A copy of the line, so lines are close together when searched
+  string_view text;
+  // How many entries have this line
+  uint32_t count;
+};
+
+// What ranks a line, kept apart from its text so that ranking many lines
+// reads little memory
+struct line_rank {
+  // The newest entry with this line
+  uint32_t last;
+  // What the line's frequency adds to its rank, 1 + log2(count)
+  float weight;
+};
+
+// Single characters and pairs have a list each, from SHORT_NGRAMS on
+// trigrams are looked up by hash
+const uint32_t SHORT_NGRAMS = 256 + 65536;
+
+// The search index, covering entries 1 to indexed
+static vector<history_line> lines;
+static vector<line_rank> ranks;
+static arena line_text;
+static unordered_map<string_view, uint32_t> line_ids;
+// For each n-gram, the ids of the lines containing it, in ascending order
+static vector<vector<uint32_t> > short_ngrams(SHORT_NGRAMS);
+static unordered_map<uint32_t, vector<uint32_t> > trigrams;
+static size_t indexed = 0;
+// Set once history_index_build has caught up, from when each append is
+// indexed as it is made
+static bool index_ready = false;
+
+// Held around everything that reads or changes the mappings or the index, as
+// the index is built on a thread of its own
+static mutex index_lock;
+
+
+static bool index_update(size_t most = SIZE_MAX);
+
+// The last ranked search, which the next one narrows if it extends the term.
+// Its matches are the lines that may contain the term.
+static string ranked_term;
+static vector<uint32_t> ranked_matches;
+static size_t ranked_indexed = 0;
+
+
+string history_default_path() {
+  const char* histfile = getenv("HISTFILE");
+  if (histfile && histfile[0]) return histfile;
+  const char* home = getenv("HOME");
+  if (!home) return "";
+  return string(home) + "/.myshell_history";
+}
+
+
+// Brings the mapping up to date with the size of the file. Returns true if it
+// had to be moved, which invalidates views into the old one.
+static bool remap(mapped_file& file) {
+  struct stat info;
+  if (fstat(file.fd, &info) != 0) return false;
+  file.size = info.st_size;
+  if (file.base && file.size <= file.reserved) return false;
+
+  if (file.base) munmap((void*) file.base, file.reserved);
+  file.reserved = max(MIN_RESERVATION, file.size * 2);
+  void* base = mmap(NULL, file.reserved, PROT_READ, MAP_SHARED, file.fd, 0);
+  if (base == MAP_FAILED) {
+    file.base = NULL;
+    file.reserved = 0;
+    file.size = 0;
+    return true;
+  }
+  file.base = (const char*) base;
+  return true;
+}
+
+
+// Catches up with appends from any shell
+static void history_sync() {
+  if (history_data.fd == -1) return;
+  remap(history_data);
+  remap(history_offsets);
+}
+
+
+bool history_open(const string& path) {
+  if (path.empty()) return false;
+  history_data.fd = open(path.c_str(),
+                         O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (history_data.fd == -1) return false;
+  history_offsets.fd = open((path + ".idx").c_str(),
+                            O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (history_offsets.fd == -1) {
+    close(history_data.fd);
+    history_data.fd = -1;
+    return false;
+  }
+  history_sync();
+  return history_data.base && history_offsets.base;
+}
+
+
+void history_append(string_view line) {
+  if (history_data.fd == -1) return;
+  // The data and its offset must go in together and in the same order
+  flock(history_data.fd, LOCK_EX);
+  struct stat info;
+  if (fstat(history_data.fd, &info) == 0) {
+    uint64_t offset = info.st_size;
+    string record(line);
+    record += '\n';
+    if (write(history_data.fd, record.data(), record.size()) ==
+        (ssize_t) record.size()) {
+      write(history_offsets.fd, &offset, sizeof(offset));
+    }
+  }
+  flock(history_data.fd, LOCK_UN);
+
+  // Once the index is built, it is kept up to date as lines are entered,
+  // along with anything other shells appended
+  lock_guard<mutex> guard(index_lock);
+  if (index_ready) index_update();
+}
+
+
+// Returns the number of entries, once caught up with appends from any shell
+static size_t entry_count() {
+  history_sync();
+  return history_offsets.size / sizeof(uint64_t);
+}
+
+
+// Returns entry n as history_entry does, with the lock held
+static string_view entry_at(size_t n) {
+  if (n == 0 || n > history_offsets.size / sizeof(uint64_t)) {
+    return string_view();
+  }
+  uint64_t offset = ((const uint64_t*) history_offsets.base)[n - 1];
+  if (offset >= history_data.size) return string_view();
+  const char* start = history_data.base + offset;
+  const char* end = (const char*) memchr(start, '\n',
+                                         history_data.size - offset);
+  return string_view(start, end ? end - start : history_data.size - offset);
+}
+
+
+size_t history_count() {
+  lock_guard<mutex> guard(index_lock);
+  return entry_count();
+}
+
+
+string_view history_entry(size_t n) {
+  lock_guard<mutex> guard(index_lock);
+  return entry_at(n);
+}
+
+
+// Packs n characters (at most three) into an n-gram key
+static uint32_t ngram_key(const char* text, size_t n) {
+  const unsigned char* c = (const unsigned char*) text;
+  if (n == 1) return c[0];
+  if (n == 2) return 256 + (c[0] << 8 | c[1]);
+  return SHORT_NGRAMS + (c[0] << 16 | c[1] << 8 | c[2]);
+}
+
+
+// Lists the distinct n-grams of the text for each n in the range. The text is
+// taken to start with two LINE_START characters if anchored is set.
+static void ngrams_of(string_view text, bool anchored, size_t shortest,
+                      size_t longest, vector<uint32_t>& keys) {
+  static string padded;
+  padded.clear();
+  if (anchored) padded.assign(2, LINE_START);
+  padded.append(text);
+  keys.clear();
+  for (size_t n = shortest; n <= longest; n++) {
+    for (size_t i = 0; i + n <= padded.size(); i++) {
+      keys.push_back(ngram_key(padded.data() + i, n));
+    }
+  }
+  sort(keys.begin(), keys.end());
+  keys.erase(unique(keys.begin(), keys.end()), keys.end());
+}
+
+
+// Returns the list of lines containing the n-gram, or NULL if none do and
+// create isn't set
+static vector<uint32_t>* postings(uint32_t key, bool create) {
+  if (key < SHORT_NGRAMS) return &short_ngrams[key];
+  if (create) return &trigrams[key];
+  unordered_map<uint32_t, vector<uint32_t> >::iterator found =
+    trigrams.find(key);
+  return found == trigrams.end() ? NULL : &found->second;
+}
+
+
+// Adds the entries appended since the index was last brought up to date, at
+// most the given number of them. Returns true once it has caught up.
+static bool index_update(size_t most) {
+  size_t count = entry_count();
+  if (count == indexed) return true;
+  line_ids.reserve(count);
+  size_t until = count - indexed > most ? indexed + most : count;
+  vector<uint32_t> keys;
+  for (size_t n = indexed + 1; n <= until; n++) {
+    string_view text = entry_at(n);
+    unordered_map<string_view, uint32_t>::iterator found =
+      line_ids.find(text);
+    if (found != line_ids.end()) {
+      history_line& line = lines[found->second];
+      line.count++;
+      ranks[found->second].last = n;
+      ranks[found->second].weight = 1 + log2((float) line.count);
+      continue;
+    }
+
+    // Every 1, 2 and 3-gram is indexed, so a term of up to three characters
+    // is answered by a single list
+    uint32_t id = lines.size();
+    history_line line = { line_text.copy(text), 1 };
+    lines.push_back(line);
+    line_rank rank = { (uint32_t) n, 1 };
+    ranks.push_back(rank);
+    line_ids[line.text] = id;
+    ngrams_of(text, true, 1, 3, keys);
+    for (int k = 0; k < keys.size(); k++) {
+      postings(keys[k], true)->push_back(id);
+    }
+  }
+  indexed = until;
+  return indexed == count;
+}
+
+
+// Keeps history_index_build from touching the index once the shell is
+// exiting and its statics are being destroyed. The lock is never given back.
+static void index_stop() {
+  index_lock.lock();
+}
+
+
+// Around a fork, so the child doesn't get the lock held by a thread it
+// doesn't have
+static void index_fork_prepare() {
+  index_lock.lock();
+}
+
+static void index_fork_done() {
+  index_lock.unlock();
+}
+
+
+void history_index_build() {
+  {
+    lock_guard<mutex> guard(index_lock);
+    static bool registered = false;
+    if (!registered) {
+      pthread_atfork(index_fork_prepare, index_fork_done, index_fork_done);
+      atexit(index_stop);
+      registered = true;
+    }
+  }
+  while (true) {
+    lock_guard<mutex> guard(index_lock);
+    if (index_update(INDEX_CHUNK)) {
+      index_ready = true;
+      return;
+    }
+  }
+}
+
+
+// Narrows the sorted list to the ids also in the other one. When the other
+// list is much longer, each id is looked for by binary search instead of
+// walking the whole of it.
+static void intersect(vector<uint32_t>& result, const vector<uint32_t>& other) {
+  vector<uint32_t> narrowed;
+  if (other.size() > result.size() * 16) {
+    vector<uint32_t>::const_iterator from = other.begin();
+    for (size_t i = 0; i < result.size(); i++) {
+      from = lower_bound(from, other.end(), result[i]);
+      if (from == other.end()) break;
+      if (*from == result[i]) narrowed.push_back(result[i]);
+    }
+  } else {
+    set_intersection(result.begin(), result.end(), other.begin(), other.end(),
+                     back_inserter(narrowed));
+  }
+  result.swap(narrowed);
+}
+
+
+// Returns the ids of the lines holding every one of the n-grams, which is
+// everything that can contain the text they came from
+static vector<uint32_t> candidates(const vector<uint32_t>& keys) {
+  vector<const vector<uint32_t>*> lists;
+  for (int k = 0; k < keys.size(); k++) {
+    const vector<uint32_t>* list = postings(keys[k], false);
+    if (!list || list->empty()) return vector<uint32_t>();
+    lists.push_back(list);
+  }
+  if (lists.empty()) return vector<uint32_t>();
+
+  // Intersect starting from the shortest list
+  sort(lists.begin(), lists.end(),
+       [](const vector<uint32_t>* a, const vector<uint32_t>* b) {
+         return a->size() < b->size();
+       });
+  vector<uint32_t> result = *lists[0];
+  for (int l = 1; l < lists.size() && !result.empty(); l++) {
+    intersect(result, *lists[l]);
+  }
+  return result;
+}
+
+
+// Returns the ids of the lines that may contain term, in ascending order,
+// and sets exact if they all do. If within is given, only lines in it can.
+static vector<uint32_t> candidate_lines(string_view term,
+                                        const vector<uint32_t>* within,
+                                        bool& exact) {
+  exact = true;
+  if (term.empty()) return vector<uint32_t>();
+  size_t n = min(term.size(), (size_t) 3);
+  vector<uint32_t> keys;
+  ngrams_of(term, false, n, n, keys);
+
+  // Checking each line of a short enough within list beats the index
+  bool scan = within != NULL;
+  for (int k = 0; k < keys.size() && scan; k++) {
+    const vector<uint32_t>* list = postings(keys[k], false);
+    if (list && list->size() <= within->size()) scan = false;
+  }
+  // Up to three characters the n-gram is the term, so there's nothing to check
+  exact = !scan && term.size() <= 3;
+  return scan ? *within : candidates(keys);
+}
+
+
+// Returns whether the line contains term
+static bool contains(uint32_t id, string_view term) {
+  return lines[id].text.find(term) != string_view::npos;
+}
+
+
+// Orders lines with the most recently entered first
+static bool more_recent(uint32_t a, uint32_t b) {
+  return ranks[a].last > ranks[b].last;
+}
+
+
+vector<size_t> history_search(string_view term, size_t limit) {
+  lock_guard<mutex> guard(index_lock);
+  index_update();
+  bool exact;
+  vector<uint32_t> found = candidate_lines(term, NULL, exact);
+  vector<uint32_t> matches;
+  for (size_t i = 0; i < found.size(); i++) {
+    if (exact || contains(found[i], term)) matches.push_back(found[i]);
+  }
+
+  sort(matches.begin(), matches.end(), more_recent);
+  vector<size_t> entries;
+  for (int i = 0; i < matches.size() && entries.size() < limit; i++) {
+    entries.push_back(ranks[matches[i]].last);
+  }
+  return entries;
+}
+
+
+size_t history_find_prefix(string_view prefix) {
+  lock_guard<mutex> guard(index_lock);
+  index_update();
+  if (prefix.empty()) return indexed;
+
+  // The anchored trigrams only match at the start of a line
+  vector<uint32_t> keys;
+  ngrams_of(prefix, true, 3, 3, keys);
+  vector<uint32_t> found = candidates(keys);
+  size_t newest = 0;
+  for (int i = 0; i < found.size(); i++) {
+    uint32_t last = ranks[found[i]].last;
+    if (last > newest && lines[found[i]].text.substr(0, prefix.size()) ==
+        prefix) {
+      newest = last;
+    }
+  }
+  return newest;
+}
+
+
+// Scores a line by how recently and how often it was entered, packed with
+// its newest entry so that comparing keys ranks lines, the more recent first
+// on a tie. Recency counts in steps, so a command used all the time outranks
+// one typed just once a little more recently.
+static uint64_t rank_key(const line_rank& line) {
+  size_t age = indexed - line.last;
+  float recency = age < 10 ? 8 : age < 100 ? 4 : age < 1000 ? 2 :
+                  age < 10000 ? 1 : 0.5;
+  float score = recency * line.weight;
+  // A positive float's bits order the same way as its value
+  uint32_t bits;
+  memcpy(&bits, &score, sizeof(bits));
+  return (uint64_t) bits << 32 | line.last;
+}
+
+
+vector<size_t> history_rank(string_view term, size_t limit) {
+  lock_guard<mutex> guard(index_lock);
+  index_update();
+
+  // Each keystroke usually adds to the term, and then only the lines that
+  // matched before can still match
+  const vector<uint32_t>* within = NULL;
+  if (ranked_indexed == indexed && !ranked_term.empty() &&
+      term.substr(0, ranked_term.size()) == ranked_term) {
+    within = &ranked_matches;
+  }
+  bool exact;
+  vector<uint32_t> matches = candidate_lines(term, within, exact);
+
+  // Keep the best keys in a heap with the worst of them on top, so most
+  // lines are turned away by one comparison. Only a line that would make it
+  // in needs its text checked.
+  vector<uint64_t> best;
+  for (size_t i = 0; i < matches.size(); i++) {
+    uint64_t key = rank_key(ranks[matches[i]]);
+    if (best.size() == limit && key <= best.front()) continue;
+    if (!exact && !contains(matches[i], term)) continue;
+    if (best.size() < limit) {
+      best.push_back(key);
+      push_heap(best.begin(), best.end(), greater<uint64_t>());
+    } else {
+      pop_heap(best.begin(), best.end(), greater<uint64_t>());
+      best.back() = key;
+      push_heap(best.begin(), best.end(), greater<uint64_t>());
+    }
+  }
+  sort(best.begin(), best.end(), greater<uint64_t>());
+  vector<size_t> entries;
+  for (size_t i = 0; i < best.size(); i++) {
+    entries.push_back((uint32_t) best[i]);
+  }
+
+  ranked_term = term;
+  ranked_indexed = indexed;
+  ranked_matches.swap(matches);
+  return entries;
+}
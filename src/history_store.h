@@ -0,0 +1,63 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+
+// Returns where this user's history is kept: $HISTFILE, or
+// ~/.myshell_history.
+string history_default_path();
+
+
+// Opens the history file at path, creating it if needed, along with the
+// index file next to it ("path.idx", one 8 byte offset per entry). Both are
+// memory-mapped, so opening costs nothing however long the history is.
+// Returns false if the history can't be used.
+bool history_open(const string& path);
+
+
+// Appends a line to the history. The line goes on the end of the history
+// file and its offset on the end of the index, both under an exclusive lock,
+// so several shells can append at once. Once history_index_build has run,
+// the line goes straight into the search index too.
+void history_append(string_view line);
+
+
+// Builds the search index over every entry, a chunk at a time so searches
+// and appends are only held up briefly. Meant to run on a thread of its own
+// once the history is open, so the first search or !prefix doesn't pay for
+// it; one that comes first finishes the index itself.
+void history_index_build();
+
+
+// Returns the number of entries, including those other shells appended.
+size_t history_count();
+
+
+// Returns entry n, counting from 1, or an empty view if there is no such
+// entry. The view stays valid while the history is open.
+string_view history_entry(size_t n);
+
+
+// Returns the entries that contain term, newest first and at most limit of
+// them. A line entered several times is only returned for its most recent
+// entry.
+vector<size_t> history_search(string_view term, size_t limit);
+
+
+// Returns the most recent entry that starts with prefix, or 0 if none does.
+// It is looked up in the search index, by the prefix's anchored trigrams, so
+// it costs nothing like a scan once history_index_build has run.
+size_t history_find_prefix(string_view prefix);
+
+
+// Returns the entries that contain term, best first and at most limit of
+// them, ranked by how recently and how often each line was entered. Meant to
+// be called once per keystroke as the term grows: each call narrows the
+// matches of the one before.
+vector<size_t> history_rank(string_view term, size_t limit);
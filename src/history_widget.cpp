@@ -0,0 +1,73 @@
+#include "history_widget.h"
+
+#include <string>
+#include <vector>
+
+#include <readline/readline.h>
+
+#include "history_store.h"
+
+using namespace std;
+
+// How many matches Ctrl-R can step through
+const size_t SEARCH_RESULTS = 100;
+
+// Keys the widget handles itself
+const int KEY_BACKSPACE = 127;
+
+
+void history_widget_init() {
+  rl_bind_key(CTRL('R'), history_widget);
+}
+
+
+int history_widget(int count, int key) {
+  // What was typed before the search, for when it's cancelled
+  string saved(rl_line_buffer);
+  int saved_point = rl_point;
+  // The search shows in place of the prompt
+  string prompt(rl_prompt ? rl_prompt : "");
+
+  string term;
+  vector<size_t> results;
+  size_t choice = 0;
+  while (true) {
+    // Show the chosen match, with the cursor on the term
+    string_view match;
+    if (choice < results.size()) match = history_entry(results[choice]);
+    bool failed = !term.empty() && results.empty();
+    string message = string(failed ? "(failed search)`" : "(search)`") +
+                     term + "': ";
+    rl_set_prompt(message.c_str());
+    if (!match.empty()) {
+      rl_replace_line(string(match).c_str(), 0);
+      rl_point = match.find(term);
+    }
+    rl_redisplay();
+
+    int c = rl_read_key();
+    if (c == CTRL('G')) {
+      rl_replace_line(saved.c_str(), 0);
+      rl_point = saved_point;
+      break;
+    } else if (c == CTRL('R')) {
+      if (choice + 1 < results.size()) choice++;
+      continue;
+    } else if (c == KEY_BACKSPACE || c == CTRL('H')) {
+      if (term.empty()) continue;
+      term.pop_back();
+    } else if (c >= ' ' && c < KEY_BACKSPACE) {
+      term.push_back(c);
+    } else {
+      // Leave the match in the line and let readline handle the key
+      rl_execute_next(c);
+      break;
+    }
+    results = history_rank(term, SEARCH_RESULTS);
+    choice = 0;
+  }
+
+  rl_set_prompt(prompt.c_str());
+  rl_redisplay();
+  return 0;
+}
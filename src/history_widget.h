@@ -0,0 +1,12 @@
+#pragma once
+
+
+// Binds Ctrl-R to the history search widget.
+void history_widget_init();
+
+
+// Searches the history store as the user types, showing the best match in
+// the line. Ctrl-R again moves to the next match, backspace shortens the
+// search and Ctrl-G puts the line back as it was. Any other key keeps the
+// match and then does what it normally does, so Enter runs it.
+int history_widget(int count, int key);
@@ -0,0 +1,291 @@
+#include "interpreter.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+
+#include "shell.h"
+#include "variables.h"
+
+using namespace std;
+
+// How deeply functions may call each other before a call fails, rather than
+// running the shell out of stack
+const int FUNCTION_NESTING_LIMIT = 1000;
+
+int last_status = 0;
+string shell_name = "myshell";
+vector<string> positional_parameters;
+int breaking = 0;
+int continuing = 0;
+bool returning = false;
+int loop_depth = 0;
+int function_depth = 0;
+
+// Set when a command is killed by Ctrl-C, which stops the rest of the line
+static bool interrupted = false;
+
+// How many conditions are running: the left of && or ||, or what if, while
+// or until tests. A command failing in one doesn't stop a script under
+// errexit.
+static int condition_depth = 0;
+
+// The shell's options and mode, from shell.cpp
+extern bool errexit;
+extern bool interactive;
+
+// A defined function: its body, copied out of the line that defined it into
+// memory of its own, so it outlives that line
+struct shell_function {
+  arena mem;
+  program code;
+  node* body;
+};
+
+// The defined functions by name. A function being called is held on to by
+// the call, so redefining it meanwhile is safe.
+static map<string, shared_ptr<shell_function> > functions;
+
+
+static int execute_node(node* n, arena& mem);
+
+
+// Runs a node whose status is tested rather than checked by errexit
+static int execute_condition(node* n, arena& mem) {
+  condition_depth++;
+  int status = execute_node(n, mem);
+  condition_depth--;
+  return status;
+}
+
+
+// Whether the commands left in a list or loop should be skipped, on the way
+// out to whatever a break, continue or return is leaving, or after Ctrl-C
+static bool unwinding() {
+  return breaking || continuing || returning || interrupted;
+}
+
+
+// Called after each pass through a loop. Returns false if the loop should
+// stop, for a break that reaches it, a return or Ctrl-C. A continue that
+// reaches it is used up, and one for an outer loop stops it.
+static bool loop_continues() {
+  if (interrupted || returning) return false;
+  if (breaking) {
+    breaking--;
+    return false;
+  }
+  if (continuing) {
+    continuing--;
+    return continuing == 0;
+  }
+  return true;
+}
+
+
+// Runs a while or until loop. The memory each pass expands its commands into
+// is released before the next, so a long loop runs in the same memory.
+static int run_loop(node* n, arena& mem) {
+  int status = 0;
+  loop_depth++;
+  arena::position start = mem.mark();
+  while (true) {
+    mem.rewind(start);
+    int condition = execute_condition(n->children[0], mem);
+    if (unwinding() && !loop_continues()) break;
+    if ((condition == 0) != (n->type == NODE_WHILE)) break;
+    status = execute_node(n->children[1], mem);
+    if (!loop_continues()) break;
+  }
+  loop_depth--;
+  mem.rewind(start);
+  return status;
+}
+
+
+// Runs a for loop, expanding its words once, before the first pass, as a
+// command's would be
+static int run_for(node* n, arena& mem) {
+  pipeline words;
+  words.background = false;
+  words.timed = false;
+  words.commands.resize(1);
+  words.commands[0].words = n->words;
+  variable_substitution(words, mem);
+  string error;
+  if (!glob_expansion(words, mem, error)) {
+    cerr << error << endl;
+    return 1;
+  }
+  vector<string> values(words.commands[0].argv.begin(),
+                        words.commands[0].argv.end());
+
+  int status = 0;
+  loop_depth++;
+  arena::position start = mem.mark();
+  for (int i = 0; i < values.size(); i++) {
+    mem.rewind(start);
+    variable_set(n->name, values[i], false);
+    status = execute_node(n->children[0], mem);
+    if (!loop_continues()) break;
+  }
+  loop_depth--;
+  mem.rewind(start);
+  return status;
+}
+
+
+// Copies a word into the function's memory
+static word copy_word(const word& w, arena& mem) {
+  word copy = { mem.copy(w.text), w.flags };
+  return copy;
+}
+
+
+// Copies a node, and everything under it, into the function
+static node* copy_node(const node* n, shell_function& f) {
+  if (!n) return NULL;
+  f.code.nodes.push_back(node());
+  node* copy = &f.code.nodes.back();
+  copy->type = n->type;
+  copy->line = NULL;
+  copy->name = f.mem.copy(n->name);
+  for (int i = 0; i < n->words.size(); i++) {
+    copy->words.push_back(copy_word(n->words[i], f.mem));
+  }
+  for (int i = 0; i < n->children.size(); i++) {
+    copy->children.push_back(copy_node(n->children[i], f));
+  }
+  if (!n->line) return copy;
+
+  f.code.pipelines.push_back(pipeline());
+  pipeline& line = f.code.pipelines.back();
+  line.background = n->line->background;
+  line.timed = n->line->timed;
+  for (int c = 0; c < n->line->commands.size(); c++) {
+    const simple_command& from = n->line->commands[c];
+    line.commands.push_back(simple_command());
+    simple_command& to = line.commands.back();
+    for (int i = 0; i < from.assignments.size(); i++) {
+      to.assignments.push_back(copy_word(from.assignments[i], f.mem));
+    }
+    for (int i = 0; i < from.words.size(); i++) {
+      to.words.push_back(copy_word(from.words[i], f.mem));
+    }
+    for (int i = 0; i < from.redirections.size(); i++) {
+      redirection r;
+      r.type = from.redirections[i].type;
+      r.fd = from.redirections[i].fd;
+      r.target = copy_word(from.redirections[i].target, f.mem);
+      to.redirections.push_back(r);
+    }
+  }
+  copy->line = &line;
+  return copy;
+}
+
+
+// Defines, or redefines, the function
+static void define_function(node* n) {
+  shared_ptr<shell_function> f = make_shared<shell_function>();
+  f->body = copy_node(n->children[0], *f);
+  f->code.root = f->body;
+  f->code.incomplete = false;
+  f->code.pipelines_used = f->code.pipelines.size();
+  functions[string(n->name)] = f;
+}
+
+
+// Runs a node of the tree, and returns its exit status
+static int execute_node(node* n, arena& mem) {
+  int status = 0;
+  switch (n->type) {
+    case NODE_PIPELINE:
+      status = run_pipeline(*n->line, mem);
+      if (status == 128 + SIGINT) interrupted = true;
+      // With errexit, a script ends at the first pipeline that fails outside
+      // of a condition, wherever it is in the line
+      if (status != 0 && errexit && !interactive && condition_depth == 0) {
+        cout.flush();
+        exit(status);
+      }
+      break;
+    case NODE_AND:
+    case NODE_OR:
+      status = execute_condition(n->children[0], mem);
+      if (!unwinding() && (status == 0) == (n->type == NODE_AND)) {
+        status = execute_node(n->children[1], mem);
+      }
+      break;
+    case NODE_LIST:
+      for (int i = 0; i < n->children.size(); i++) {
+        status = execute_node(n->children[i], mem);
+        if (unwinding()) break;
+      }
+      break;
+    case NODE_IF:
+      status = execute_condition(n->children[0], mem);
+      if (unwinding()) break;
+      if (status == 0) {
+        status = execute_node(n->children[1], mem);
+      } else if (n->children[2]) {
+        status = execute_node(n->children[2], mem);
+      } else {
+        status = 0;
+      }
+      break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+      status = run_loop(n, mem);
+      break;
+    case NODE_FOR:
+      status = run_for(n, mem);
+      break;
+    case NODE_FUNCTION:
+      define_function(n);
+      break;
+  }
+  last_status = status;
+  return status;
+}
+
+
+int execute_program(program& code, arena& mem) {
+  interrupted = false;
+  breaking = 0;
+  continuing = 0;
+  returning = false;
+  if (!code.root) return last_status;
+  return execute_node(code.root, mem);
+}
+
+
+bool function_defined(string_view name) {
+  return !functions.empty() && functions.count(string(name)) > 0;
+}
+
+
+int call_function(const vector<string_view>& argv, arena& mem) {
+  if (function_depth >= FUNCTION_NESTING_LIMIT) {
+    cerr << argv[0] << ": maximum function nesting level exceeded" << endl;
+    return 1;
+  }
+  shared_ptr<shell_function> f = functions[string(argv[0])];
+
+  // The function gets its own arguments, and loops of its own
+  vector<string> saved(argv.begin() + 1, argv.end());
+  saved.swap(positional_parameters);
+  int saved_loops = loop_depth;
+  loop_depth = 0;
+  function_depth++;
+
+  int status = execute_node(f->body, mem);
+  returning = false;
+
+  function_depth--;
+  loop_depth = saved_loops;
+  saved.swap(positional_parameters);
+  return status;
+}
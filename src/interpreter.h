@@ -0,0 +1,52 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "parser.h"
+
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+
+// The exit status of the last command run, for $?
+extern int last_status;
+
+// The name of the shell or script, for $0, and the arguments of the running
+// function or script, for $1 and on, $#, $@ and $*
+extern string shell_name;
+extern vector<string> positional_parameters;
+
+// How many enclosing loops a break or continue still has to leave; the
+// innermost loop it reaches carries on instead, for a continue
+extern int breaking;
+extern int continuing;
+
+// Set by return, until the function it was called in has returned
+extern bool returning;
+
+// How many loops and function calls are running, so break, continue and
+// return can tell whether they are in one
+extern int loop_depth;
+extern int function_depth;
+
+
+// Runs a parsed command line: its pipelines in the order, and under the
+// conditions, that its lists, &&s, ||s, ifs and loops give. The tree is only
+// walked; every pipeline in it is expanded afresh each time it runs, using
+// mem, and what a loop body expands is released after each pass. A command
+// killed by Ctrl-C stops the whole line. Returns the exit status of the last
+// command run.
+int execute_program(program& code, arena& mem);
+
+
+// Whether a function by the name has been defined
+bool function_defined(string_view name);
+
+
+// Calls the function named by argv[0], with the rest as its positional
+// parameters. Returns the status of the last command it ran, or the one
+// return gave.
+int call_function(const vector<string_view>& argv, arena& mem);
@@ -0,0 +1,370 @@
+#include "jobs.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+using namespace std;
+
+map<int, job> jobs;
+bool job_control = false;
+
+// Set by the SIGCHLD handler whenever a child changes state
+static volatile sig_atomic_t child_changed = 0;
+
+// The process group the shell itself runs in
+static int shell_pgid;
+
+
+// Only notes that there is something to reap; the reaping happens between
+// commands, where it is safe to touch the job table.
+static void sigchld_handler(int signum) {
+  child_changed = 1;
+}
+
+
+int exit_code(int status) {
+  if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+  if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+  return WEXITSTATUS(status);
+}
+
+
+void jobs_init(bool interactive) {
+  // Restart interrupted system calls, so readline never sees EINTR
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = sigchld_handler;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGCHLD, &action, NULL);
+
+  // Built-ins write to pipes from inside the shell, where SIGPIPE would kill
+  // it, so they get EPIPE instead. Children put the default back.
+  signal(SIGPIPE, SIG_IGN);
+
+  shell_pgid = getpgrp();
+  job_control = interactive && isatty(STDIN_FILENO);
+  if (!job_control) return;
+
+  // Wait until we have been put in the foreground
+  while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+    kill(-shell_pgid, SIGTTIN);
+  }
+
+  // Ctrl-Z and background terminal access are for the jobs, not the shell
+  signal(SIGTSTP, SIG_IGN);
+  signal(SIGTTIN, SIG_IGN);
+  signal(SIGTTOU, SIG_IGN);
+
+  // Lead our own process group (a session leader already does) and take
+  // the terminal
+  setpgid(0, 0);
+  shell_pgid = getpgrp();
+  tcsetpgrp(STDIN_FILENO, shell_pgid);
+}
+
+
+void job_child_setup(int pgid) {
+  if (job_control && pgid != -1) {
+    setpgid(0, pgid);
+  }
+  signal(SIGTSTP, SIG_DFL);
+  signal(SIGTTIN, SIG_DFL);
+  signal(SIGTTOU, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  // A child forked from a thread has the thread's mask, with SIGCHLD blocked
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+
+thread job_thread_start(function<void()> work) {
+  // The thread takes the mask of the one starting it
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  thread started(work);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return started;
+}
+
+
+int job_add(int pgid, const vector<int>& pids, const string& text,
+            job_state state) {
+  // Number after the highest job still around
+  int number = 1;
+  for (map<int, job>::iterator i = jobs.begin(); i != jobs.end(); i++) {
+    number = max(number, i->second.number + 1);
+  }
+
+  job& j = jobs[pgid];
+  j.number = number;
+  j.pgid = pgid;
+  j.pids = pids;
+  j.statuses.assign(pids.size(), 0);
+  j.finished.assign(pids.size(), false);
+  struct rusage unused;
+  memset(&unused, 0, sizeof(unused));
+  j.usages.assign(pids.size(), unused);
+  // Stages that never started are already finished
+  for (int i = 0; i < pids.size(); i++) {
+    if (pids[i] == -1) j.finished[i] = true;
+  }
+  j.text = text;
+  j.state = state;
+  j.changed = false;
+  return number;
+}
+
+
+job* job_find(const string& spec) {
+  job* found = NULL;
+  // The most recent job
+  if (spec.empty() || spec == "%%" || spec == "%+") {
+    for (map<int, job>::iterator i = jobs.begin(); i != jobs.end(); i++) {
+      if (!found || i->second.number > found->number) found = &i->second;
+    }
+    return found;
+  }
+  // %n picks by job number, anything else is a pid
+  bool by_number = spec[0] == '%';
+  int wanted = atoi(spec.c_str() + (by_number ? 1 : 0));
+  for (map<int, job>::iterator i = jobs.begin(); i != jobs.end(); i++) {
+    job& j = i->second;
+    if (by_number && j.number == wanted) return &j;
+    if (!by_number && find(j.pids.begin(), j.pids.end(), wanted) !=
+                      j.pids.end()) {
+      return &j;
+    }
+  }
+  return NULL;
+}
+
+
+// Records a wait status, and what the process has used, for one process of a
+// job and updates the job's state
+static void record_status(job& j, int index, int status,
+                          const struct rusage& usage) {
+  j.usages[index] = usage;
+  if (WIFSTOPPED(status)) {
+    j.statuses[index] = status;
+    j.state = JOB_STOPPED;
+    j.changed = true;
+    return;
+  }
+  if (WIFCONTINUED(status)) {
+    j.state = JOB_RUNNING;
+    return;
+  }
+  j.statuses[index] = status;
+  j.finished[index] = true;
+  if (find(j.finished.begin(), j.finished.end(), false) == j.finished.end()) {
+    j.state = JOB_DONE;
+    j.changed = true;
+  }
+}
+
+
+// Polls every unfinished process in the table
+static void reap_all() {
+  child_changed = 0;
+  for (map<int, job>::iterator i = jobs.begin(); i != jobs.end(); i++) {
+    job& j = i->second;
+    for (int p = 0; p < j.pids.size(); p++) {
+      if (j.finished[p]) continue;
+      int status;
+      struct rusage usage;
+      int pid = wait4(j.pids[p], &status, WNOHANG | WUNTRACED | WCONTINUED,
+                      &usage);
+      if (pid == j.pids[p]) {
+        record_status(j, p, status, usage);
+      } else if (pid == -1 && errno == ECHILD) {
+        // Someone else collected it; treat it as done
+        record_status(j, p, 0, j.usages[p]);
+      }
+    }
+  }
+}
+
+
+void jobs_reap() {
+  if (child_changed) reap_all();
+}
+
+
+// Orders jobs by job number
+static bool lower_number(const job* a, const job* b) {
+  return a->number < b->number;
+}
+
+
+// Returns the jobs sorted by job number
+static vector<job*> jobs_by_number() {
+  vector<job*> sorted;
+  for (map<int, job>::iterator i = jobs.begin(); i != jobs.end(); i++) {
+    sorted.push_back(&i->second);
+  }
+  sort(sorted.begin(), sorted.end(), lower_number);
+  return sorted;
+}
+
+
+void jobs_notify() {
+  jobs_reap();
+  vector<job*> sorted = jobs_by_number();
+  for (int i = 0; i < sorted.size(); i++) {
+    job& j = *sorted[i];
+    if (!j.changed) continue;
+    j.changed = false;
+    cout << "[" << j.number << "]  "
+         << (j.state == JOB_DONE ? "Done" : "Stopped") << "\t\t" << j.text
+         << endl;
+    if (j.state == JOB_DONE) jobs.erase(j.pgid);
+  }
+}
+
+
+// Waits for every unfinished process of a job, with the terminal handed to
+// it. Returns false if the job stopped instead of finishing.
+static bool wait_in_foreground(job& j) {
+  if (job_control) tcsetpgrp(STDIN_FILENO, j.pgid);
+
+  for (int p = 0; p < j.pids.size(); p++) {
+    if (j.finished[p]) continue;
+    int status;
+    struct rusage usage = j.usages[p];
+    int pid;
+    trace_span span("wait", tracing ? to_string(j.pids[p]) : "");
+    while ((pid = wait4(j.pids[p], &status, WUNTRACED, &usage)) == -1 &&
+           errno == EINTR);
+    if (pid == -1) {
+      perror("wait");
+      status = -1;
+    }
+    record_status(j, p, status, usage);
+  }
+
+  // Take the terminal back
+  if (job_control) tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+  if (j.state == JOB_STOPPED) {
+    cout << endl << "[" << j.number << "]  Stopped\t\t" << j.text << endl;
+    j.changed = false;
+    return false;
+  }
+  return true;
+}
+
+
+bool wait_for_foreground(int pgid, const vector<int>& pids,
+                         vector<int>& statuses, const string& text,
+                         vector<struct rusage>* usages) {
+  // Nothing was started
+  if (pgid <= 0) return true;
+
+  // It goes in the table straight away, so it isn't lost if it stops
+  job_add(pgid, pids, text, JOB_RUNNING);
+  job& j = jobs[pgid];
+  for (int i = 0; i < pids.size(); i++) {
+    if (pids[i] == -1) j.statuses[i] = statuses[i];
+  }
+
+  bool done = wait_in_foreground(j);
+  statuses = j.statuses;
+  if (usages) *usages = j.usages;
+  if (done) jobs.erase(pgid);
+  return done;
+}
+
+
+int job_foreground(job& j) {
+  cout << j.text << endl;
+  if (j.state == JOB_STOPPED) {
+    if (job_control) {
+      kill(-j.pgid, SIGCONT);
+    } else {
+      for (int p = 0; p < j.pids.size(); p++) {
+        if (!j.finished[p]) kill(j.pids[p], SIGCONT);
+      }
+    }
+  }
+  j.state = JOB_RUNNING;
+
+  wait_in_foreground(j);
+  int status = j.statuses.back();
+  if (j.state == JOB_DONE) jobs.erase(j.pgid);
+  return status;
+}
+
+
+void job_background(job& j) {
+  if (j.state == JOB_STOPPED) {
+    if (job_control) {
+      kill(-j.pgid, SIGCONT);
+    } else {
+      for (int p = 0; p < j.pids.size(); p++) {
+        if (!j.finished[p]) kill(j.pids[p], SIGCONT);
+      }
+    }
+  }
+  j.state = JOB_RUNNING;
+  cout << "[" << j.number << "]  " << j.text << " &" << endl;
+}
+
+
+int job_wait(job* j, bool any) {
+  int wanted = j ? j->pgid : 0;
+  int status = 0;
+
+  // Block SIGCHLD while checking, so one can't slip by before we sleep
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &old);
+
+  while (true) {
+    reap_all();
+
+    bool waiting = false;
+    bool found = false;
+    vector<job*> sorted = jobs_by_number();
+    for (int i = 0; i < sorted.size(); i++) {
+      job& current = *sorted[i];
+      if (wanted && current.pgid != wanted) continue;
+      if (current.state == JOB_RUNNING) {
+        waiting = true;
+        continue;
+      }
+      // A finished job is collected now and never reported as done
+      if (current.state == JOB_DONE) {
+        status = current.statuses.back();
+        found = true;
+        jobs.erase(current.pgid);
+        if (any) break;
+      }
+      // A stopped job won't finish by waiting, give up on it
+      else if (wanted) {
+        status = current.statuses.back();
+        found = true;
+      }
+    }
+    if ((any && found) || !waiting) break;
+
+    // Sleep until the next child changes state
+    sigsuspend(&old);
+  }
+
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  return status;
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+
+
+using std::function;
+using std::map;
+using std::string;
+using std::thread;
+using std::vector;
+
+
+// The states a job can be in
+enum job_state { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+// A pipeline started by the shell, either in the background or stopped while
+// in the foreground
+struct job {
+  // The job number shown to the user
+  int number;
+  // The process group every stage belongs to (the first stage's pid)
+  int pgid;
+  // The processes of the stages, and their wait statuses once they finish
+  vector<int> pids;
+  vector<int> statuses;
+  vector<bool> finished;
+  // What each process used, as of its last wait
+  vector<struct rusage> usages;
+  // The command line, for listings
+  string text;
+  job_state state;
+  // Whether the state changed since the user was last told
+  bool changed;
+};
+
+// Every job the shell knows about, keyed by process group
+extern map<int, job> jobs;
+
+// Whether the shell is interactive and gives each pipeline its own process
+// group and the terminal while it is in the foreground
+extern bool job_control;
+
+
+// Converts a wait status into an exit status, the way the shell reports it:
+// the exit code of a process that exited, or 128 plus the signal number of
+// one that was killed or stopped.
+int exit_code(int status);
+
+
+// Sets up job control: installs the SIGCHLD handler and, when the shell is
+// interactive and runs on a terminal, puts the shell in its own process group
+// and ignores the terminal stop signals.
+void jobs_init(bool interactive);
+
+
+// Run in a forked child before anything else: joins the process group
+// (0 makes a new one, -1 stays in the shell's), restores the signals the
+// shell ignores and unblocks every signal.
+void job_child_setup(int pgid);
+
+
+// Starts a thread for the shell, with SIGCHLD blocked in it, so the signal
+// always goes to the main thread, which is the one job_wait sleeps in until
+// it arrives. A child the thread starts gets a clear mask back from
+// job_child_setup or spawn_command.
+thread job_thread_start(function<void()> work);
+
+
+// Adds started processes to the job table and returns the new job number.
+int job_add(int pgid, const vector<int>& pids, const string& text,
+            job_state state);
+
+
+// Finds a job from a "%n" job spec, or the most recent job for an empty spec.
+// Returns NULL if there is no such job.
+job* job_find(const string& spec);
+
+
+// Collects the status of any finished or stopped job processes without
+// blocking. Only the job table's pids are waited on, so foreground children
+// are never taken.
+void jobs_reap();
+
+
+// Prints the jobs that finished or changed since the last notice and drops
+// the finished ones. Called before a prompt is shown.
+void jobs_notify();
+
+
+// Waits for the processes of a foreground pipeline, giving it the terminal
+// while it runs. A stopped pipeline is turned into a job. Fills in the wait
+// status of each pid, and what each used if usages is given, and returns
+// false if it stopped.
+bool wait_for_foreground(int pgid, const vector<int>& pids,
+                         vector<int>& statuses, const string& text,
+                         vector<struct rusage>* usages = NULL);
+
+
+// Continues a stopped job in the foreground and waits for it. Returns the
+// status of its last process.
+int job_foreground(job& j);
+
+
+// Continues a stopped job in the background.
+void job_background(job& j);
+
+
+// Blocks until a job finishes and returns its last status; with any set, the
+// first job to finish, otherwise the given job, or every job when it is NULL.
+int job_wait(job* j, bool any);
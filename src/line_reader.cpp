@@ -0,0 +1,111 @@
+#include "line_reader.h"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std;
+
+// How much is read from the file descriptor at once
+const size_t READ_SIZE = 64 * 1024;
+
+
+void line_reader_init(line_reader& reader, int fd) {
+  reader.fd = fd;
+  reader.buffer.resize(READ_SIZE);
+  reader.start = 0;
+  reader.end = 0;
+  reader.eof = false;
+  reader.error = 0;
+  reader.interrupted = NULL;
+}
+
+
+void line_reader_init(line_reader& reader, const string& text) {
+  reader.fd = -1;
+  // room for the NUL after a last line without a newline
+  reader.buffer.assign(text.begin(), text.end());
+  reader.buffer.push_back('\0');
+  reader.start = 0;
+  reader.end = text.size();
+  reader.eof = true;
+  reader.error = 0;
+  reader.interrupted = NULL;
+}
+
+
+// Moves the unfinished line to the front of the buffer and reads more after
+// it, growing the buffer if it is getting full. A read interrupted by a signal
+// only sets error to EINTR, for the caller to try again or give up.
+static void read_more(line_reader& reader) {
+  reader.error = 0;
+  if (reader.interrupted && *reader.interrupted) {
+    reader.error = EINTR;
+    return;
+  }
+  memmove(&reader.buffer[0], &reader.buffer[0] + reader.start,
+          reader.end - reader.start);
+  reader.end -= reader.start;
+  reader.start = 0;
+  if (reader.buffer.size() - reader.end < READ_SIZE) {
+    reader.buffer.resize(reader.buffer.size() * 2);
+  }
+
+  ssize_t got = read(reader.fd, &reader.buffer[reader.end],
+                     reader.buffer.size() - reader.end - 1);
+  if (got == -1 && errno == EINTR) {
+    reader.error = EINTR;
+  }
+  else if (got <= 0) {
+    reader.eof = true;
+    if (got == -1) reader.error = errno;
+  } else {
+    reader.end += got;
+  }
+}
+
+
+char* read_line(line_reader& reader) {
+  while (true) {
+    char* first = &reader.buffer[0] + reader.start;
+    char* newline = (char*) memchr(first, '\n', reader.end - reader.start);
+    if (newline) {
+      *newline = '\0';
+      reader.start = newline - &reader.buffer[0] + 1;
+      return first;
+    }
+
+    if (reader.eof) {
+      // A last line without a newline still counts
+      if (reader.start == reader.end) return NULL;
+      reader.buffer[reader.end] = '\0';
+      reader.start = reader.end;
+      return first;
+    }
+
+    read_more(reader);
+  }
+}
+
+
+bool read_block(line_reader& reader, const char*& data, size_t& size) {
+  // How much of a long line has already been searched for a newline
+  size_t searched = 0;
+  while (true) {
+    char* first = &reader.buffer[0] + reader.start;
+    size_t waiting = reader.end - reader.start;
+    // Everything up to the last newline is whole lines
+    char* newline = (char*) memrchr(first + searched, '\n',
+                                    waiting - searched);
+    if (newline || (reader.eof && waiting > 0)) {
+      data = first;
+      size = newline ? newline + 1 - first : waiting;
+      reader.start += size;
+      return true;
+    }
+    if (reader.eof) return false;
+    searched = waiting;
+    read_more(reader);
+    if (reader.error == EINTR) return false;
+  }
+}
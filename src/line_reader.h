@@ -0,0 +1,49 @@
+#pragma once
+#include <csignal>
+#include <string>
+#include <vector>
+
+
+using std::string;
+using std::vector;
+
+
+// Reads lines from a file descriptor through a large buffer, so a line costs
+// a memchr rather than a system call
+struct line_reader {
+  int fd;
+  vector<char> buffer;
+  // The unread part of the buffer is [start, end)
+  size_t start;
+  size_t end;
+  bool eof;
+  // errno of the last read if it failed, or 0
+  int error;
+  // A flag that, once set, makes reads fail as if interrupted, so a signal
+  // that arrives between reads still stops a long line, or NULL
+  const volatile sig_atomic_t* interrupted;
+};
+
+
+// Sets up a reader for the file descriptor.
+void line_reader_init(line_reader& reader, int fd);
+
+
+// Sets up a reader over text that is already in memory.
+void line_reader_init(line_reader& reader, const string& text);
+
+
+// Returns the next line without its newline, or NULL at the end of input. The
+// line lives in the reader's buffer, may be modified, and is valid until the
+// next call.
+char* read_line(line_reader& reader);
+
+
+// Points data at the next block of whole lines, newlines included, and
+// returns true, or returns false at the end of input or when a signal
+// interrupts the read (error is then EINTR, and calling again carries on).
+// Only a last line may be missing its newline. The block lives in the
+// reader's buffer and is valid until the next call. A block is whatever one
+// read brought in, rather than a line, so scanning a stream costs one call
+// per buffer.
+bool read_block(line_reader& reader, const char*& data, size_t& size);
@@ -0,0 +1,584 @@
+#include "builtins.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <thread>
+
+#include "jobs.h"
+#include "shell.h"
+
+using namespace std;
+
+// Size of the buffer directory entries are read into, thousands at a time
+const size_t DIRENT_BUFFER_SIZE = 1 << 20;
+
+// How much output is gathered before it is written
+const size_t LS_OUTPUT_FLUSH = 1 << 20;
+
+// With -l, directories with at least this many entries have them looked up
+// by several threads, which mostly pays off on network file systems
+const size_t PARALLEL_STAT_MIN = 4096;
+
+// Most threads that look entries up
+const long MAX_STAT_THREADS = 8;
+
+// Entries a thread claims at a time
+const size_t STAT_BATCH = 256;
+
+// Width assumed for a terminal that can't be asked
+const int DEFAULT_WIDTH = 80;
+
+// Entries older than this, or in the future, show their year, not their time
+const time_t SIX_MONTHS = 31556952 / 2;
+
+// What ls was asked for
+struct ls_options {
+  // -a shows every entry, -A all but . and ..
+  bool all;
+  bool almost_all;
+  bool long_format;
+  // -p marks directories with a /
+  bool mark_dirs;
+  // Columns to fill, for a terminal without -1, or 0 for one entry per line
+  int width;
+};
+
+// An entry as it is sorted: the first bytes of its name, big-endian so they
+// compare as one number and most comparisons never touch the names, and
+// where the whole name is kept
+struct ls_key {
+  uint64_t prefix;
+  uint32_t offset;
+  uint16_t length;
+  uint8_t type;
+};
+
+// The entries of a directory, or the files named on the command line. The
+// names are back to back in one buffer, each followed by a NUL.
+struct ls_listing {
+  string names;
+  vector<ls_key> keys;
+};
+
+// Output gathered to be written in large pieces
+struct ls_output {
+  string text;
+  // Where the text goes, and where problems with entries are reported
+  int fd;
+  ostream* err;
+  // Set once a write has failed, after which nothing more is written
+  bool failed;
+};
+
+// What -l shows of an entry
+struct ls_stat {
+  bool found;
+  // Why it couldn't be looked up
+  int error;
+  mode_t mode;
+  uint64_t nlink;
+  uid_t uid;
+  gid_t gid;
+  uint64_t size;
+  uint64_t blocks;
+  unsigned int rdev_major;
+  unsigned int rdev_minor;
+  time_t mtime;
+};
+
+
+// Returns the name of an entry
+static inline const char* key_name(const ls_listing& listing,
+                                   const ls_key& key) {
+  return listing.names.data() + key.offset;
+}
+
+
+// Adds an entry to the listing
+static void add_entry(ls_listing& listing, const char* name, size_t length,
+                      uint8_t type) {
+  ls_key key;
+  key.prefix = 0;
+  for (size_t i = 0; i < 8 && i < length; i++) {
+    key.prefix |= (uint64_t) (unsigned char) name[i] << (56 - 8 * i);
+  }
+  key.offset = listing.names.size();
+  key.length = length;
+  key.type = type;
+  listing.names.append(name, length + 1);
+  listing.keys.push_back(key);
+}
+
+
+// Sorts the entries by name, byte by byte
+static void sort_listing(ls_listing& listing) {
+  const char* names = listing.names.data();
+  sort(listing.keys.begin(), listing.keys.end(),
+       [names](const ls_key& a, const ls_key& b) {
+    if (a.prefix != b.prefix) return a.prefix < b.prefix;
+    return strcmp(names + a.offset, names + b.offset) < 0;
+  });
+}
+
+
+// Reads every entry of the open directory into the listing, in large
+// getdents64 batches. Returns 0, or -1 with errno set.
+static int read_directory(int fd, const ls_options& options,
+                          ls_listing& listing) {
+  vector<char> buffer(DIRENT_BUFFER_SIZE);
+  while (true) {
+    ssize_t got = getdents64(fd, buffer.data(), buffer.size());
+    if (got == -1 && errno == EINTR && !builtin_interrupted) continue;
+    if (got <= 0) return got;
+    for (ssize_t at = 0; at < got; ) {
+      struct dirent64* entry = (struct dirent64*) (buffer.data() + at);
+      at += entry->d_reclen;
+      const char* name = entry->d_name;
+      if (name[0] == '.') {
+        bool dots = name[1] == '\0' || (name[1] == '.' && name[2] == '\0');
+        if (!options.all && !(options.almost_all && !dots)) continue;
+      }
+      add_entry(listing, name, strlen(name), entry->d_type);
+    }
+  }
+}
+
+
+// Looks an entry up without following a symbolic link
+static void stat_entry(int dirfd, const char* name, ls_stat& info) {
+  struct statx found;
+  unsigned int mask = STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+                      STATX_SIZE | STATX_BLOCKS | STATX_MTIME;
+  info.found = statx(dirfd, name, AT_SYMLINK_NOFOLLOW, mask, &found) == 0;
+  if (!info.found) {
+    info.error = errno;
+    return;
+  }
+  info.mode = found.stx_mode;
+  info.nlink = found.stx_nlink;
+  info.uid = found.stx_uid;
+  info.gid = found.stx_gid;
+  info.size = found.stx_size;
+  info.blocks = found.stx_blocks;
+  info.rdev_major = found.stx_rdev_major;
+  info.rdev_minor = found.stx_rdev_minor;
+  info.mtime = found.stx_mtime.tv_sec;
+}
+
+
+// Looks up every entry of the listing, relative to dirfd. Large directories
+// are shared out between threads, each claiming a batch at a time.
+static void stat_entries(int dirfd, const ls_listing& listing,
+                         vector<ls_stat>& infos) {
+  size_t count = listing.keys.size();
+  infos.resize(count);
+  long threads = min(sysconf(_SC_NPROCESSORS_ONLN), MAX_STAT_THREADS);
+  if (count < PARALLEL_STAT_MIN || threads < 2) {
+    for (size_t i = 0; i < count; i++) {
+      stat_entry(dirfd, key_name(listing, listing.keys[i]), infos[i]);
+    }
+    return;
+  }
+
+  atomic<size_t> next(0);
+  auto work = [&]() {
+    size_t first;
+    while ((first = next.fetch_add(STAT_BATCH)) < count) {
+      size_t last = min(first + STAT_BATCH, count);
+      for (size_t i = first; i < last; i++) {
+        stat_entry(dirfd, key_name(listing, listing.keys[i]), infos[i]);
+      }
+    }
+  };
+  vector<thread> pool;
+  for (long t = 1; t < threads; t++) pool.push_back(job_thread_start(work));
+  work();
+  for (int t = 0; t < pool.size(); t++) pool[t].join();
+}
+
+
+// Writes out the gathered output once there is enough of it, or all of it
+// when forced. Returns false if this or an earlier write failed.
+static bool flush_output(ls_output& out, bool force) {
+  if (out.failed) return false;
+  if (out.text.empty() || (!force && out.text.size() < LS_OUTPUT_FLUSH)) {
+    return true;
+  }
+  out.failed = write_all(out.fd, out.text.data(),
+                         out.text.size()) == -1;
+  out.text.clear();
+  return !out.failed;
+}
+
+
+// Appends a number, right-aligned in the given width
+static void append_number(string& out, uint64_t n, int width) {
+  char digits[24];
+  char* end = to_chars(digits, digits + sizeof(digits), n).ptr;
+  if (end - digits < width) out.append(width - (end - digits), ' ');
+  out.append(digits, end);
+}
+
+
+// Returns the number of digits in n
+static int number_width(uint64_t n) {
+  char digits[24];
+  return to_chars(digits, digits + sizeof(digits), n).ptr - digits;
+}
+
+
+// Returns the number of characters (not bytes) in a UTF-8 name
+static int display_width(const char* name, size_t length) {
+  int width = 0;
+  for (size_t i = 0; i < length; i++) {
+    width += ((unsigned char) name[i] & 0xC0) != 0x80;
+  }
+  return width;
+}
+
+
+// Whether an entry is a directory, looking it up if its type is unknown
+static bool is_directory(int dirfd, const char* name, uint8_t type) {
+  if (type != DT_UNKNOWN) return type == DT_DIR;
+  struct stat info;
+  return fstatat(dirfd, name, &info, 0) == 0 && S_ISDIR(info.st_mode);
+}
+
+
+// Appends an entry's name, with a / after a directory for -p. Returns the
+// characters added.
+static int append_name(string& out, const ls_listing& listing,
+                       const ls_key& key, int dirfd,
+                       const ls_options& options) {
+  const char* name = key_name(listing, key);
+  out.append(name, key.length);
+  int width = display_width(name, key.length);
+  if (options.mark_dirs && is_directory(dirfd, name, key.type)) {
+    out += '/';
+    width++;
+  }
+  return width;
+}
+
+
+// Returns the name of a user or group id, or the id itself, remembering the
+// ones already seen
+static const string& owner_name(map<unsigned int, string>& cache,
+                                unsigned int id, bool group) {
+  map<unsigned int, string>::iterator found = cache.find(id);
+  if (found != cache.end()) return found->second;
+  const char* name = NULL;
+  if (group) {
+    struct group* entry = getgrgid(id);
+    if (entry) name = entry->gr_name;
+  } else {
+    struct passwd* entry = getpwuid(id);
+    if (entry) name = entry->pw_name;
+  }
+  return cache[id] = name ? string(name) : to_string(id);
+}
+
+
+// Appends the ten characters of type and permissions, as in drwxr-xr-x
+static void append_mode(string& out, mode_t mode) {
+  char text[10];
+  text[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' :
+            S_ISBLK(mode) ? 'b' : S_ISFIFO(mode) ? 'p' :
+            S_ISSOCK(mode) ? 's' : '-';
+  const char* letters = "rwxrwxrwx";
+  for (int i = 0; i < 9; i++) {
+    text[i + 1] = (mode & (0400 >> i)) ? letters[i] : '-';
+  }
+  // setuid, setgid and sticky replace the execute bits they go with
+  if (mode & S_ISUID) text[3] = (mode & S_IXUSR) ? 's' : 'S';
+  if (mode & S_ISGID) text[6] = (mode & S_IXGRP) ? 's' : 'S';
+  if (mode & S_ISVTX) text[9] = (mode & S_IXOTH) ? 't' : 'T';
+  out.append(text, 10);
+}
+
+
+// Lists the entries one per line with their details, after the total of
+// their blocks for a directory
+static void format_long(ls_output& output, const ls_listing& listing, int dirfd,
+                        const ls_options& options, bool directory) {
+  string& out = output.text;
+  vector<ls_stat> infos;
+  stat_entries(dirfd, listing, infos);
+
+  // Every column is as wide as its widest entry
+  map<unsigned int, string> users;
+  map<unsigned int, string> groups;
+  int link_width = 1, user_width = 1, group_width = 1, size_width = 1;
+  uint64_t blocks = 0;
+  for (size_t i = 0; i < infos.size(); i++) {
+    const ls_stat& info = infos[i];
+    if (!info.found) continue;
+    link_width = max(link_width, number_width(info.nlink));
+    user_width = max(user_width,
+                     (int) owner_name(users, info.uid, false).size());
+    group_width = max(group_width,
+                      (int) owner_name(groups, info.gid, true).size());
+    int size = (S_ISCHR(info.mode) || S_ISBLK(info.mode))
+               ? number_width(info.rdev_major) + 2 +
+                 number_width(info.rdev_minor)
+               : number_width(info.size);
+    size_width = max(size_width, size);
+    // Totals are in 1 KiB blocks, where statx counts 512 byte ones
+    blocks += (info.blocks + 1) / 2;
+  }
+  if (directory) {
+    out += "total ";
+    append_number(out, blocks, 0);
+    out += '\n';
+  }
+
+  time_t now = time(NULL);
+  for (size_t i = 0; i < listing.keys.size(); i++) {
+    const ls_key& key = listing.keys[i];
+    const ls_stat& info = infos[i];
+    const char* name = key_name(listing, key);
+    if (!info.found) {
+      *output.err << "ls: cannot access '" << name << "': "
+                  << strerror(info.error) << endl;
+      continue;
+    }
+
+    append_mode(out, info.mode);
+    out += ' ';
+    append_number(out, info.nlink, link_width);
+    out += ' ';
+    const string& user = owner_name(users, info.uid, false);
+    out += user;
+    out.append(user_width - user.size() + 1, ' ');
+    const string& group = owner_name(groups, info.gid, true);
+    out += group;
+    out.append(group_width - group.size() + 1, ' ');
+    if (S_ISCHR(info.mode) || S_ISBLK(info.mode)) {
+      int width = number_width(info.rdev_major) + 2 +
+                  number_width(info.rdev_minor);
+      out.append(size_width - width, ' ');
+      append_number(out, info.rdev_major, 0);
+      out += ", ";
+      append_number(out, info.rdev_minor, 0);
+    } else {
+      append_number(out, info.size, size_width);
+    }
+
+    char date[32];
+    struct tm local;
+    localtime_r(&info.mtime, &local);
+    bool recent = info.mtime <= now && now - info.mtime < SIX_MONTHS;
+    size_t length = strftime(date, sizeof(date),
+                             recent ? " %b %e %H:%M " : " %b %e  %Y ",
+                             &local);
+    out.append(date, length);
+
+    append_name(out, listing, key, dirfd, options);
+    if (S_ISLNK(info.mode)) {
+      char target[PATH_MAX];
+      ssize_t target_length = readlinkat(dirfd, name, target,
+                                         sizeof(target));
+      if (target_length > 0) {
+        out += " -> ";
+        out.append(target, target_length);
+      }
+    }
+    out += '\n';
+    if (!flush_output(output, false)) return;
+  }
+}
+
+
+// Lists the entries down as many columns as fit in the terminal
+static void format_columns(ls_output& output, const ls_listing& listing,
+                           int dirfd, const ls_options& options) {
+  string& out = output.text;
+  size_t count = listing.keys.size();
+  if (count == 0) return;
+  vector<int> widths(count);
+  for (size_t i = 0; i < count; i++) {
+    const ls_key& key = listing.keys[i];
+    widths[i] = display_width(key_name(listing, key), key.length) +
+                (options.mark_dirs && is_directory(dirfd,
+                     key_name(listing, key), key.type));
+  }
+
+  // Try every number of columns a name of at least one character allows,
+  // working out each one's column widths in the same pass. Columns are
+  // separated by two spaces.
+  size_t most = max((size_t) 1, min(count, (size_t) options.width / 3));
+  vector<vector<int> > column_widths(most + 1);
+  for (size_t columns = 1; columns <= most; columns++) {
+    column_widths[columns].assign(columns, 0);
+  }
+  for (size_t i = 0; i < count; i++) {
+    for (size_t columns = 1; columns <= most; columns++) {
+      size_t rows = (count + columns - 1) / columns;
+      int& width = column_widths[columns][i / rows];
+      width = max(width, widths[i]);
+    }
+  }
+  size_t columns = 1;
+  for (size_t candidate = most; candidate > 1; candidate--) {
+    int line = 0;
+    for (size_t c = 0; c < candidate; c++) {
+      line += column_widths[candidate][c] + (c + 1 < candidate ? 2 : 0);
+    }
+    // A column can come out empty when rows are rounded up; skip those
+    size_t rows = (count + candidate - 1) / candidate;
+    if (line < options.width && (candidate - 1) * rows < count) {
+      columns = candidate;
+      break;
+    }
+  }
+
+  size_t rows = (count + columns - 1) / columns;
+  for (size_t row = 0; row < rows; row++) {
+    for (size_t i = row; i < count; i += rows) {
+      int width = append_name(out, listing, listing.keys[i], dirfd, options);
+      if (i + rows < count) {
+        out.append(column_widths[columns][i / rows] - width + 2, ' ');
+      }
+    }
+    out += '\n';
+    if (!flush_output(output, false)) return;
+  }
+}
+
+
+// Lists the entries in the format asked for
+static void format_listing(ls_output& output, const ls_listing& listing,
+                           int dirfd, const ls_options& options,
+                           bool directory) {
+  string& out = output.text;
+  if (options.long_format) {
+    format_long(output, listing, dirfd, options, directory);
+  }
+  else if (options.width > 0) {
+    format_columns(output, listing, dirfd, options);
+  }
+  else {
+    for (size_t i = 0; i < listing.keys.size(); i++) {
+      append_name(out, listing, listing.keys[i], dirfd, options);
+      out += '\n';
+      if (!flush_output(output, false)) return;
+    }
+  }
+}
+
+
+// Returns the columns of the terminal fd is, or 0 if it isn't one
+static int terminal_width(int fd) {
+  if (!isatty(fd)) return 0;
+  struct winsize size;
+  if (ioctl(fd, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+    return size.ws_col;
+  }
+  const char* columns = lookup_variable("COLUMNS");
+  return (columns && atoi(columns) > 0) ? atoi(columns) : DEFAULT_WIDTH;
+}
+
+
+int com_ls(vector<string>& tokens, builtin_io& io) {
+  ls_options options;
+  options.all = false;
+  options.almost_all = false;
+  options.long_format = false;
+  options.mark_dirs = false;
+  options.width = terminal_width(io.out_fd);
+  int first = 1;
+  for (; first < tokens.size() && tokens[first].size() > 1 &&
+         tokens[first][0] == '-'; first++) {
+    if (tokens[first] == "--") {
+      first++;
+      break;
+    }
+    for (int c = 1; c < tokens[first].size(); c++) {
+      char flag = tokens[first][c];
+      if (flag == 'a') options.all = true;
+      else if (flag == 'A') options.almost_all = true;
+      else if (flag == 'l') options.long_format = true;
+      else if (flag == 'p') options.mark_dirs = true;
+      else if (flag == '1') options.width = 0;
+      else return run_external_command(tokens, io);
+    }
+  }
+  // if no directory is given, use the local directory
+  vector<string> names(tokens.begin() + first, tokens.end());
+  if (names.empty()) names.push_back(".");
+
+  // Files named on the command line are listed together first, then each
+  // directory. A symbolic link to a directory counts as a file for -l.
+  catch_interrupts(false);
+  int return_value = 0;
+  ls_listing files;
+  vector<string> directories;
+  for (int i = 0; i < names.size(); i++) {
+    struct stat info;
+    const char* name = names[i].c_str();
+    if (stat(name, &info) == -1 && lstat(name, &info) == -1) {
+      io.err << "ls: cannot access '" << names[i] << "': " << strerror(errno)
+             << endl;
+      return_value = 2;
+      continue;
+    }
+    if (S_ISDIR(info.st_mode) && !(options.long_format &&
+        lstat(name, &info) == 0 && S_ISLNK(info.st_mode))) {
+      directories.push_back(names[i]);
+    } else {
+      add_entry(files, name, names[i].size(),
+                S_ISDIR(info.st_mode) ? DT_DIR : DT_UNKNOWN);
+    }
+  }
+  sort(directories.begin(), directories.end());
+
+  ls_output output;
+  output.fd = io.out_fd;
+  output.err = &io.err;
+  output.failed = false;
+  string& out = output.text;
+  if (!files.keys.empty()) {
+    sort_listing(files);
+    format_listing(output, files, AT_FDCWD, options, false);
+  }
+  bool headers = names.size() > 1;
+  for (int i = 0; i < directories.size() && !builtin_interrupted; i++) {
+    if (!files.keys.empty() || i > 0) out += '\n';
+    if (headers) out += directories[i] + ":\n";
+
+    int fd = open(directories[i].c_str(),
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ls_listing listing;
+    if (fd == -1 || read_directory(fd, options, listing) == -1) {
+      flush_output(output, true);
+      io.err << "ls: cannot open directory '" << directories[i] << "': "
+             << strerror(errno) << endl;
+      return_value = 2;
+    } else {
+      sort_listing(listing);
+      format_listing(output, listing, fd, options, true);
+    }
+    if (fd != -1) close(fd);
+  }
+  if (!flush_output(output, true)) {
+    if (errno != EPIPE) {
+      io.err << "ls: write error: " << strerror(errno) << endl;
+    }
+    return_value = 2;
+  }
+
+  if (builtin_interrupted) return_value = 128 + SIGINT;
+  release_interrupts(false);
+  return return_value;
+}
@@ -0,0 +1,16 @@
+// A client for myshell --server on its own, for callers that run commands
+// often enough for the shell's own startup to matter.
+// usage: myshell-client socket commands
+
+#include <cstdio>
+
+#include "client.h"
+
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fputs("usage: myshell-client socket commands\n", stderr);
+    return 2;
+  }
+  return run_client(argv[1], argv[2]);
+}
@@ -0,0 +1,295 @@
+#include "builtins.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "jobs.h"
+#include "line_reader.h"
+#include "path_search.h"
+#include "shell.h"
+#include "variables.h"
+
+using namespace std;
+
+// Separates the command from its arguments
+const string ARGS_MARKER = ":::";
+
+// Replaced by the argument in each command
+const string ARG_PLACEHOLDER = "{}";
+
+// The exit status is the number of failed jobs, up to this many
+const int MAX_FAILURE_STATUS = 101;
+
+// One command run by the parallel built-in
+struct parallel_job {
+  // Position of the argument in the input, from 1
+  int seq;
+  // The command's words with the argument filled in
+  vector<string> argv;
+  // The words joined up, for the summary
+  string line;
+  int pid;
+  // Read ends of the job's stdout and stderr, -1 once they reach EOF
+  int out_fd;
+  int err_fd;
+  // Everything the job has written so far
+  string out;
+  string err;
+  struct timespec start;
+  double seconds;
+  int status;
+};
+
+// Returns the seconds elapsed since start
+static double seconds_since(const struct timespec& start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+
+// Fills the argument into the command template, in place of every {} in
+// each word, or as a word of its own after the command if it has no {}. The
+// words were expanded when the parallel command was, and the argument is
+// used as it is, so neither is split, unquoted or expanded again.
+static void build_job(parallel_job& job, const vector<string>& templ,
+                      const string& arg) {
+  bool placed = false;
+  for (int i = 0; i < templ.size(); i++) {
+    string word = templ[i];
+    size_t pos = 0;
+    while ((pos = word.find(ARG_PLACEHOLDER, pos)) != string::npos) {
+      word.replace(pos, ARG_PLACEHOLDER.size(), arg);
+      pos += arg.size();
+      placed = true;
+    }
+    job.argv.push_back(word);
+  }
+  if (!placed) job.argv.push_back(arg);
+
+  for (int i = 0; i < job.argv.size(); i++) {
+    if (i > 0) job.line += " ";
+    job.line += job.argv[i];
+  }
+}
+
+
+// Starts a job in a child process with its output going to pipes. Problems
+// are reported on the built-in's stderr.
+static void start_job(parallel_job& job, builtin_io& io) {
+  clock_gettime(CLOCK_MONOTONIC, &job.start);
+  job.pid = -1;
+  job.out_fd = -1;
+  job.err_fd = -1;
+  job.status = 1;
+
+  int out[2], err[2];
+  if (pipe2(out, O_CLOEXEC) == -1) {
+    io.err << "parallel: " << strerror(errno) << endl;
+    return;
+  }
+  if (pipe2(err, O_CLOEXEC) == -1) {
+    io.err << "parallel: " << strerror(errno) << endl;
+    close(out[0]);
+    close(out[1]);
+    return;
+  }
+
+  // The job is a single command with the words as they are. Every view is
+  // NUL terminated, as the words are strings.
+  pipeline line;
+  line.commands.resize(1);
+  line.background = false;
+  line.timed = false;
+  simple_command& first = line.commands[0];
+  first.argv.assign(job.argv.begin(), job.argv.end());
+
+  // An external command can exec straight from the child
+  bool plain = builtins.find(job.argv[0]) == builtins.end();
+  string fullpath = plain ? hash_lookup(job.argv[0]) : "";
+
+  // Flush so the child doesn't inherit (and repeat) buffered output
+  cout.flush();
+  io.out.flush();
+  job.pid = fork();
+  if (job.pid == -1) {
+    io.err << "parallel: " << strerror(errno) << endl;
+  }
+  if (job.pid == 0) {
+    // child, capture output and keep it off the arguments on our stdin
+    job_child_setup(-1);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd != -1) dup2(null_fd, STDIN_FILENO);
+    if (plain) {
+      vector<char*> envp = command_environment(first.environment);
+      exec_external_command(first.argv, fullpath, &envp[0]);
+    }
+    int return_value = execute_line(line);
+    cout.flush();
+    exit(return_value);
+  }
+
+  close(out[1]);
+  close(err[1]);
+  if (job.pid == -1) {
+    close(out[0]);
+    close(err[0]);
+    return;
+  }
+  job.out_fd = out[0];
+  job.err_fd = err[0];
+}
+
+
+// Reads whatever is available from one of a job's pipes. Closes it at EOF.
+static void drain(int& fd, string& into) {
+  char chunk[65536];
+  ssize_t got = read(fd, chunk, sizeof(chunk));
+  if (got == -1 && errno == EINTR) return;
+  if (got <= 0) {
+    close(fd);
+    fd = -1;
+  } else {
+    into.append(chunk, got);
+  }
+}
+
+
+// Orders finished jobs by their position in the input
+static bool earlier_seq(const parallel_job& a, const parallel_job& b) {
+  return a.seq < b.seq;
+}
+
+
+int com_parallel(vector<string>& tokens, builtin_io& io) {
+  // Default to one job per processor
+  long slots = sysconf(_SC_NPROCESSORS_ONLN);
+  bool quiet = false;
+
+  // Read the options
+  int pos = 1;
+  for (; pos < tokens.size() && tokens[pos][0] == '-'; pos++) {
+    if (tokens[pos] == "-q") {
+      quiet = true;
+    } else if (tokens[pos] == "-j" && pos + 1 < tokens.size()) {
+      slots = atol(tokens[++pos].c_str());
+    } else {
+      break;
+    }
+  }
+
+  // Split the command template from the arguments
+  vector<string> templ;
+  for (; pos < tokens.size() && tokens[pos] != ARGS_MARKER; pos++) {
+    templ.push_back(tokens[pos]);
+  }
+  if (templ.empty() || slots < 1) {
+    io.err << "usage: parallel [-j N] [-q] command [{}] [::: args...]" << endl;
+    return 1;
+  }
+
+  // Arguments come after ::: or, without one, a line at a time from stdin
+  bool from_stdin = pos == tokens.size();
+  int next_arg = pos + 1;
+  line_reader reader;
+  if (from_stdin) line_reader_init(reader, io.in_fd);
+
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  vector<parallel_job> running;
+  vector<parallel_job> finished;
+  int seq = 1;
+  bool more = true;
+  while (true) {
+    // Top up the free slots
+    while (more && running.size() < slots) {
+      string arg;
+      if (from_stdin) {
+        const char* line = read_line(reader);
+        more = line != NULL;
+        if (more) arg = line;
+      } else {
+        more = next_arg < tokens.size();
+        if (more) arg = tokens[next_arg++];
+      }
+      if (!more) break;
+
+      parallel_job job;
+      job.seq = seq++;
+      build_job(job, templ, arg);
+      start_job(job, io);
+      if (job.pid == -1) {
+        job.seconds = 0;
+        finished.push_back(job);
+      } else {
+        running.push_back(job);
+      }
+    }
+    if (running.empty()) break;
+
+    // Wait for output from any of the running jobs
+    vector<pollfd> fds;
+    for (int i = 0; i < running.size(); i++) {
+      pollfd out = { running[i].out_fd, POLLIN, 0 };
+      pollfd err = { running[i].err_fd, POLLIN, 0 };
+      fds.push_back(out);
+      fds.push_back(err);
+    }
+    if (poll(&fds[0], fds.size(), -1) == -1 && errno != EINTR) {
+      io.err << "parallel: " << strerror(errno) << endl;
+      break;
+    }
+
+    for (int i = 0; i < running.size(); i++) {
+      parallel_job& job = running[i];
+      if (fds[2 * i].revents) drain(job.out_fd, job.out);
+      if (fds[2 * i + 1].revents) drain(job.err_fd, job.err);
+      if (job.out_fd != -1 || job.err_fd != -1) continue;
+
+      // Both pipes are closed, so the job is done: print its output in one
+      // piece and free the slot
+      int status;
+      while (waitpid(job.pid, &status, 0) == -1 && errno == EINTR);
+      job.status = exit_code(status);
+      job.seconds = seconds_since(job.start);
+      io.out << job.out << flush;
+      io.err << job.err << flush;
+      job.out.clear();
+      job.err.clear();
+      finished.push_back(job);
+      running.erase(running.begin() + i);
+      fds.erase(fds.begin() + 2 * i, fds.begin() + 2 * i + 2);
+      i--;
+    }
+  }
+
+  // Sum up how every job went
+  int failures = 0;
+  for (int i = 0; i < finished.size(); i++) {
+    if (finished[i].status != 0) failures++;
+  }
+  if (!quiet) {
+    sort(finished.begin(), finished.end(), earlier_seq);
+    io.err << "seq\texit\tseconds\tcommand" << endl;
+    for (int i = 0; i < finished.size(); i++) {
+      char seconds[32];
+      snprintf(seconds, sizeof(seconds), "%.3f", finished[i].seconds);
+      io.err << finished[i].seq << "\t" << finished[i].status << "\t"
+           << seconds << "\t" << finished[i].line << endl;
+    }
+    char total[32];
+    snprintf(total, sizeof(total), "%.3f", seconds_since(started));
+    io.err << "parallel: " << finished.size() << " jobs, " << failures
+         << " failed, " << total << "s" << endl;
+  }
+
+  return min(failures, MAX_FAILURE_STATUS);
+}
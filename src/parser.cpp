@@ -0,0 +1,995 @@
+#include "parser.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+// The smallest block the arena allocates at once
+const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+
+arena::arena() : used(0), capacity(0), first_capacity(0) {
+}
+
+
+arena::~arena() {
+  for (int i = 0; i < blocks.size(); i++) {
+    delete[] blocks[i];
+  }
+}
+
+
+char* arena::allocate(size_t size) {
+  // Start a new block when the current one is full
+  if (blocks.empty() || capacity - used < size) {
+    size_t block_size = max(ARENA_BLOCK_SIZE, size);
+    blocks.push_back(new char[block_size]);
+    if (blocks.size() == 1) first_capacity = block_size;
+    used = 0;
+    capacity = block_size;
+  }
+  char* memory = blocks.back() + used;
+  used += size;
+  return memory;
+}
+
+
+string_view arena::copy(string_view text) {
+  char* memory = allocate(text.size() + 1);
+  memcpy(memory, text.data(), text.size());
+  memory[text.size()] = '\0';
+  return string_view(memory, text.size());
+}
+
+
+void arena::reset() {
+  if (blocks.empty()) return;
+  for (int i = 1; i < blocks.size(); i++) {
+    delete[] blocks[i];
+  }
+  blocks.resize(1);
+  used = 0;
+  capacity = first_capacity;
+}
+
+
+arena::position arena::mark() const {
+  position where = { blocks.size(), used, capacity };
+  return where;
+}
+
+
+void arena::rewind(const position& where) {
+  for (size_t i = where.blocks; i < blocks.size(); i++) {
+    delete[] blocks[i];
+  }
+  blocks.resize(where.blocks);
+  used = where.used;
+  capacity = where.capacity;
+}
+
+
+bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\n';
+}
+
+
+// Whether the character ends a word and starts an operator
+static bool is_operator(char c) {
+  return c == '|' || c == '&' || c == '<' || c == '>' || c == ';' ||
+         c == '(' || c == ')';
+}
+
+
+size_t assignment_length(string_view text) {
+  if (text.empty() || !(isalpha(text[0]) || text[0] == '_')) return 0;
+  for (size_t i = 1; i < text.size(); i++) {
+    if (text[i] == '=') return i + 1;
+    if (!(isalnum(text[i]) || text[i] == '_')) return 0;
+  }
+  return 0;
+}
+
+
+size_t substitution_end(string_view text, size_t start) {
+  int depth = 0;
+  size_t i = start + 1;
+  while (i < text.size()) {
+    char c = text[i];
+    if (c == '\\') {
+      i += 2;
+    }
+    else if (c == '\'') {
+      size_t close = text.find('\'', i + 1);
+      if (close == string_view::npos) return string_view::npos;
+      i = close + 1;
+    }
+    else if (c == '"') {
+      for (i++; i < text.size() && text[i] != '"'; i++) {
+        if (text[i] == '\\') {
+          i++;
+        }
+        else if (text[i] == '$' && i + 1 < text.size() && text[i + 1] == '(') {
+          size_t end = substitution_end(text, i);
+          if (end == string_view::npos) return end;
+          i = end - 1;
+        }
+      }
+      if (i >= text.size()) return string_view::npos;
+      i++;
+    }
+    else {
+      if (c == '(') depth++;
+      else if (c == ')' && --depth == 0) return i + 1;
+      i++;
+    }
+  }
+  return string_view::npos;
+}
+
+
+// Finds the end of the word starting at line[start], stepping over quoted
+// sections and command substitutions, and notes what the word will need
+// done to it. Returns the index just past the word, or 0 with error set if a
+// quote or substitution is never closed.
+static size_t scan_word(const char* line, size_t start, unsigned& flags,
+                        string& error) {
+  size_t i = start;
+  flags = 0;
+  while (line[i] && !is_blank(line[i]) && !is_operator(line[i])) {
+    char c = line[i];
+    if (c == '\\') {
+      flags |= WORD_QUOTED;
+      i += line[i + 1] ? 2 : 1;
+    }
+    else if (c == '\'') {
+      flags |= WORD_QUOTED;
+      const char* close = strchr(line + i + 1, '\'');
+      if (!close) {
+        error = "unterminated ' quote";
+        return 0;
+      }
+      i = close - line + 1;
+    }
+    else if (c == '"') {
+      flags |= WORD_QUOTED;
+      for (i++; line[i] && line[i] != '"'; i++) {
+        if (line[i] == '\\' && line[i + 1]) {
+          i++;
+        }
+        else if (line[i] == '$') {
+          flags |= WORD_DOLLAR;
+          if (line[i + 1] == '(') {
+            size_t end = substitution_end(line + i, 0);
+            if (end == string_view::npos) {
+              error = "unterminated $( substitution";
+              return 0;
+            }
+            i += end - 1;
+          }
+        }
+      }
+      if (!line[i]) {
+        error = "unterminated \" quote";
+        return 0;
+      }
+      i++;
+    }
+    else if (c == '$' && line[i + 1] == '(') {
+      flags |= WORD_DOLLAR;
+      size_t end = substitution_end(line + i, 0);
+      if (end == string_view::npos) {
+        error = "unterminated $( substitution";
+        return 0;
+      }
+      i += end;
+    }
+    else {
+      if (c == '$') flags |= WORD_DOLLAR;
+      if (c == '*' || c == '?' || c == '[') flags |= WORD_GLOB;
+      i++;
+    }
+  }
+  return i;
+}
+
+
+
+
+// The kinds of token a command line is made of
+enum token_type {
+  TOKEN_WORD,
+  TOKEN_PIPE,
+  TOKEN_AND,
+  TOKEN_OR,
+  TOKEN_SEMICOLON,
+  TOKEN_AMPERSAND,
+  TOKEN_NEWLINE,
+  TOKEN_IN,
+  TOKEN_OUT,
+  TOKEN_APPEND,
+  // <& and >&, which copy a descriptor
+  TOKEN_DUP_IN,
+  TOKEN_DUP_OUT,
+  // &> and &>>, which send stdout and stderr to the same file
+  TOKEN_BOTH,
+  TOKEN_BOTH_APPEND,
+  TOKEN_OPEN,
+  TOKEN_CLOSE,
+  TOKEN_END
+};
+
+struct token {
+  token_type type;
+  // The word, for TOKEN_WORD
+  word w;
+  // For a redirection, the descriptor written in front of it, or -1
+  int fd;
+  // Set on a token spliced in from an alias, which isn't looked up again
+  bool spliced;
+  // Set on the last token of an alias ending in a blank, so the word after
+  // it is looked up as well
+  bool check_next;
+};
+
+// Where the parser is in the text, and what it is building
+struct parse_state {
+  char* text;
+  size_t pos;
+  arena& mem;
+  program& result;
+  string& error;
+  // Set once something is wrong; only the first error is kept
+  bool failed;
+  // Set when a word was ended in place over the newline after it, which is
+  // still owed as a token
+  bool newline_pending;
+  // The token looked at but not yet taken, if peeked is set
+  bool peeked;
+  token next;
+  // The tokens of an alias being spliced in, read before any more text
+  vector<token> spliced;
+  size_t spliced_next;
+};
+
+
+// Notes the first thing wrong with the text. Returns NULL, for the parse
+// functions to return.
+static node* fail(parse_state& ps, const string& message) {
+  if (!ps.failed) {
+    ps.failed = true;
+    ps.error = message;
+  }
+  return NULL;
+}
+
+
+// Notes that the text ended partway through a command, so reading more may
+// complete it
+static node* fail_incomplete(parse_state& ps, const string& message) {
+  if (!ps.failed) ps.result.incomplete = true;
+  return fail(ps, message);
+}
+
+
+// Reads the token at the parser's position and moves past it. A word is
+// ended in place where it can be, as tokenize always has. A failed scan
+// gives TOKEN_END, with the error noted.
+static void read_token(parse_state& ps, token& t) {
+  if (ps.spliced_next < ps.spliced.size()) {
+    t = ps.spliced[ps.spliced_next++];
+    return;
+  }
+  t.spliced = false;
+  t.check_next = false;
+  char* text = ps.text;
+  size_t& i = ps.pos;
+  if (ps.newline_pending) {
+    ps.newline_pending = false;
+    t.type = TOKEN_NEWLINE;
+    return;
+  }
+  while (text[i] == ' ' || text[i] == '\t') i++;
+  // A # at the start of a word begins a comment, to the end of the line
+  if (text[i] == '#') {
+    while (text[i] && text[i] != '\n') i++;
+  }
+
+  // Digits run straight into a < or > are the descriptor it redirects
+  t.fd = -1;
+  if (isdigit(text[i])) {
+    size_t digits = i;
+    while (isdigit(text[digits])) digits++;
+    if ((text[digits] == '<' || text[digits] == '>') && digits - i < 4) {
+      t.fd = atoi(text + i);
+      i = digits;
+    }
+  }
+
+  char c = text[i];
+  if (!c) {
+    t.type = TOKEN_END;
+    return;
+  }
+  size_t length = 1;
+  char next = text[i + 1];
+  switch (c) {
+    case '\n': t.type = TOKEN_NEWLINE; break;
+    case ';': t.type = TOKEN_SEMICOLON; break;
+    case '(': t.type = TOKEN_OPEN; break;
+    case ')': t.type = TOKEN_CLOSE; break;
+    case '|':
+      length = next == '|' ? 2 : 1;
+      t.type = length == 2 ? TOKEN_OR : TOKEN_PIPE;
+      break;
+    case '<':
+      length = next == '&' ? 2 : 1;
+      t.type = length == 2 ? TOKEN_DUP_IN : TOKEN_IN;
+      break;
+    case '>':
+      length = next == '>' || next == '&' ? 2 : 1;
+      t.type = next == '>' ? TOKEN_APPEND
+             : next == '&' ? TOKEN_DUP_OUT : TOKEN_OUT;
+      break;
+    case '&':
+      if (next == '>') {
+        length = text[i + 2] == '>' ? 3 : 2;
+        t.type = length == 3 ? TOKEN_BOTH_APPEND : TOKEN_BOTH;
+      } else {
+        length = next == '&' ? 2 : 1;
+        t.type = length == 2 ? TOKEN_AND : TOKEN_AMPERSAND;
+      }
+      break;
+    default:
+      t.type = TOKEN_WORD;
+      length = 0;
+  }
+  if (length > 0) {
+    i += length;
+    return;
+  }
+
+  // A word. Only an unclosed quote or substitution stops its scan, which the
+  // next line may close.
+  size_t end = scan_word(text, i, t.w.flags, ps.error);
+  if (end == 0) {
+    fail_incomplete(ps, ps.error);
+    t.type = TOKEN_END;
+    return;
+  }
+  if (!text[end] || is_blank(text[end])) {
+    // End the word in place, so it can be used without copying
+    bool last = !text[end];
+    if (text[end] == '\n') ps.newline_pending = true;
+    text[end] = '\0';
+    t.w.text = string_view(text + i, end - i);
+    i = last ? end : end + 1;
+  } else {
+    // Followed straight by an operator, which must be kept
+    t.w.text = ps.mem.copy(string_view(text + i, end - i));
+    i = end;
+  }
+}
+
+
+// Returns the next token without taking it
+static token& peek(parse_state& ps) {
+  if (!ps.peeked) {
+    read_token(ps, ps.next);
+    ps.peeked = true;
+  }
+  return ps.next;
+}
+
+
+// Takes the next token, which stays valid until the one after is looked at
+static token& take(parse_state& ps) {
+  peek(ps);
+  ps.peeked = false;
+  return ps.next;
+}
+
+
+// Takes any newlines, which may come between parts of a compound command
+static void skip_newlines(parse_state& ps) {
+  while (peek(ps).type == TOKEN_NEWLINE) take(ps);
+}
+
+
+// Whether the token is the given reserved word, typed without quotes
+static bool is_keyword(const token& t, const char* keyword) {
+  return t.type == TOKEN_WORD && t.w.flags == 0 && t.w.text == keyword;
+}
+
+
+// Whether the token ends the list of commands it follows, as the reserved
+// words closing a compound command do
+static bool ends_list(const token& t) {
+  static const char* const closers[] = { "then", "elif", "else", "fi", "do",
+                                         "done", "}" };
+  if (t.type == TOKEN_END || t.type == TOKEN_CLOSE) return true;
+  if (t.type != TOKEN_WORD || t.w.flags || t.w.text.size() > 4) return false;
+  for (int i = 0; i < sizeof(closers) / sizeof(closers[0]); i++) {
+    if (is_keyword(t, closers[i])) return true;
+  }
+  return false;
+}
+
+
+// Describes a token for an error message
+static string describe(const token& t) {
+  static const char* const names[] = { "", "|", "&&", "||", ";", "&",
+                                       "newline", "<", ">", ">>", "<&", ">&",
+                                       "&>", "&>>", "(", ")",
+                                       "end of input" };
+  if (t.type == TOKEN_WORD) return string(t.w.text);
+  return names[t.type];
+}
+
+
+// Fails on the token the parser has stopped at, which doesn't belong there
+static node* fail_unexpected(parse_state& ps) {
+  token& t = peek(ps);
+  if (t.type == TOKEN_END) {
+    return fail_incomplete(ps, "syntax error: unexpected end of input");
+  }
+  return fail(ps, "syntax error near unexpected " + describe(t));
+}
+
+
+// Takes the reserved word, or fails if something else comes next
+static bool expect(parse_state& ps, const char* keyword) {
+  if (is_keyword(peek(ps), keyword)) {
+    take(ps);
+    return true;
+  }
+  fail_unexpected(ps);
+  return false;
+}
+
+
+// An alias, with its value broken into tokens once, when it was defined
+struct alias_entry {
+  string value;
+  // A copy of the value, which the tokens' words point into, and the memory
+  // for the words that couldn't be ended in place
+  string text;
+  arena mem;
+  vector<token> tokens;
+  // Set when the value ends in a blank, so the word after it is looked up too
+  bool blank_after;
+  // The value with the aliases in it expanded as well, as of the table's
+  // generation when it was worked out
+  vector<token> expansion;
+  unsigned long expansion_generation;
+};
+
+// The aliases by name, and a count of the changes to them, which throws out
+// every expansion worked out before. Parsing may be going on in more than one
+// thread, so they are only used under the lock.
+static map<string, shared_ptr<alias_entry>, less<> > aliases;
+static unsigned long alias_generation = 1;
+static mutex alias_lock;
+
+
+// Whether the token ends a command, so the word after it starts another
+static bool ends_command(const token& t) {
+  return t.type == TOKEN_PIPE || t.type == TOKEN_AND || t.type == TOKEN_OR ||
+         t.type == TOKEN_SEMICOLON || t.type == TOKEN_AMPERSAND ||
+         t.type == TOKEN_NEWLINE;
+}
+
+
+// Whether the token is a word that may name an alias, which a quoted one
+// never does
+static alias_entry* find_alias(const token& t) {
+  if (t.type != TOKEN_WORD || t.w.flags) return NULL;
+  auto found = aliases.find(t.w.text);
+  return found == aliases.end() ? NULL : found->second.get();
+}
+
+
+// Appends the alias's tokens to out, with each word in them that starts a
+// command, or follows an alias ending in a blank, replaced by its own alias.
+// An alias already being expanded, in active, is left as it is, so aliases
+// naming each other stop rather than going round forever. Returns whether
+// the word after the alias should be looked up too.
+static bool expand_alias(alias_entry& a, vector<alias_entry*>& active,
+                         vector<token>& out) {
+  active.push_back(&a);
+  bool blank_after = a.blank_after;
+  bool check = true;
+  for (size_t i = 0; i < a.tokens.size(); i++) {
+    const token& t = a.tokens[i];
+    alias_entry* inner = check ? find_alias(t) : NULL;
+    if (inner && find(active.begin(), active.end(), inner) == active.end()) {
+      check = expand_alias(*inner, active, out);
+      if (i + 1 == a.tokens.size()) blank_after = blank_after || check;
+      continue;
+    }
+    out.push_back(t);
+    // The command word may come after assignments
+    check = ends_command(t) ||
+            (check && t.type == TOKEN_WORD && assignment_length(t.w.text));
+  }
+  active.pop_back();
+  return blank_after;
+}
+
+
+// Replaces the word the parser is at, if it is an alias, with the alias's
+// tokens, expanded through any aliases they use. The expansion is worked out
+// once and kept until the aliases change, and its words are copied into the
+// line's memory, so they outlive any change made while the line runs.
+static void splice_alias(parse_state& ps) {
+  while (true) {
+    token& t = peek(ps);
+    if (t.spliced) return;
+    lock_guard<mutex> guard(alias_lock);
+    if (aliases.empty()) return;
+    alias_entry* a = find_alias(t);
+    if (!a) return;
+
+    if (a->expansion_generation != alias_generation) {
+      a->expansion.clear();
+      vector<alias_entry*> active;
+      bool blank_after = expand_alias(*a, active, a->expansion);
+      if (!a->expansion.empty()) a->expansion.back().check_next = blank_after;
+      a->expansion_generation = alias_generation;
+    }
+
+    ps.peeked = false;
+    ps.spliced.clear();
+    ps.spliced_next = 0;
+    for (size_t i = 0; i < a->expansion.size(); i++) {
+      token copy = a->expansion[i];
+      copy.spliced = true;
+      if (copy.type == TOKEN_WORD) copy.w.text = ps.mem.copy(copy.w.text);
+      ps.spliced.push_back(copy);
+    }
+    // An alias for nothing leaves the word after it in its place
+    if (!ps.spliced.empty()) return;
+  }
+}
+
+
+bool alias_define(const string& name, const string& value, string& error) {
+  if (name.empty() ||
+      name.find_first_of(" \t\n|&;<>()$`\\\"'=/") != string::npos) {
+    error = name + ": invalid alias name";
+    return false;
+  }
+
+  shared_ptr<alias_entry> a = make_shared<alias_entry>();
+  a->value = value;
+  a->text = value;
+  a->blank_after = !value.empty() && is_blank(value.back());
+  a->expansion_generation = 0;
+  // Break the value up as a line would be, keeping every token
+  program scratch;
+  parse_state ps = { &a->text[0], 0, a->mem, scratch, error, false, false,
+                     false };
+  while (true) {
+    token t;
+    read_token(ps, t);
+    if (ps.failed) {
+      error = name + ": " + error;
+      return false;
+    }
+    if (t.type == TOKEN_END) break;
+    a->tokens.push_back(t);
+  }
+
+  lock_guard<mutex> guard(alias_lock);
+  aliases[name] = a;
+  alias_generation++;
+  return true;
+}
+
+
+bool alias_remove(string_view name) {
+  lock_guard<mutex> guard(alias_lock);
+  auto found = aliases.find(name);
+  if (found == aliases.end()) return false;
+  aliases.erase(found);
+  alias_generation++;
+  return true;
+}
+
+
+void alias_clear() {
+  lock_guard<mutex> guard(alias_lock);
+  aliases.clear();
+  alias_generation++;
+}
+
+
+bool alias_value(string_view name, string& value) {
+  lock_guard<mutex> guard(alias_lock);
+  auto found = aliases.find(name);
+  if (found == aliases.end()) return false;
+  value = found->second->value;
+  return true;
+}
+
+
+vector<string> alias_names() {
+  lock_guard<mutex> guard(alias_lock);
+  vector<string> names;
+  for (auto i = aliases.begin(); i != aliases.end(); i++) {
+    names.push_back(i->first);
+  }
+  return names;
+}
+
+
+// Adds a node of the given type to the program
+static node* add_node(parse_state& ps, node_type type) {
+  ps.result.nodes.push_back(node());
+  node* n = &ps.result.nodes.back();
+  n->type = type;
+  n->line = NULL;
+  return n;
+}
+
+
+static node* parse_list(parse_state& ps);
+static node* parse_command(parse_state& ps);
+
+
+// Parses the commands making up part of a compound command, which may not be
+// empty
+static node* parse_body(parse_state& ps) {
+  node* body = parse_list(ps);
+  if (!body && !ps.failed) fail_unexpected(ps);
+  return body;
+}
+
+
+// Parses an if after its "if" or "elif": the condition, then part and any
+// elif or else parts, through the fi
+static node* parse_if(parse_state& ps) {
+  node* n = add_node(ps, NODE_IF);
+  node* condition = parse_body(ps);
+  if (!condition || !expect(ps, "then")) return NULL;
+  node* then_part = parse_body(ps);
+  if (!then_part) return NULL;
+  node* else_part = NULL;
+  if (is_keyword(peek(ps), "elif")) {
+    take(ps);
+    // An elif is an if of its own that shares the fi
+    if (!(else_part = parse_if(ps))) return NULL;
+  } else {
+    if (is_keyword(peek(ps), "else")) {
+      take(ps);
+      if (!(else_part = parse_body(ps))) return NULL;
+    }
+    if (!expect(ps, "fi")) return NULL;
+  }
+  n->children.push_back(condition);
+  n->children.push_back(then_part);
+  n->children.push_back(else_part);
+  return n;
+}
+
+
+// Parses a while or until loop after its first word
+static node* parse_loop(parse_state& ps, node_type type) {
+  node* n = add_node(ps, type);
+  node* condition = parse_body(ps);
+  if (!condition || !expect(ps, "do")) return NULL;
+  node* body = parse_body(ps);
+  if (!body || !expect(ps, "done")) return NULL;
+  n->children.push_back(condition);
+  n->children.push_back(body);
+  return n;
+}
+
+
+// Whether the text can name a variable or function
+static bool is_name(string_view text) {
+  if (text.empty() || !(isalpha(text[0]) || text[0] == '_')) return false;
+  for (size_t i = 1; i < text.size(); i++) {
+    if (!(isalnum(text[i]) || text[i] == '_')) return false;
+  }
+  return true;
+}
+
+
+// Parses a for loop after its "for": the variable, the words to loop over
+// and the body. Without "in", it loops over the positional parameters.
+static node* parse_for(parse_state& ps) {
+  node* n = add_node(ps, NODE_FOR);
+  token name = take(ps);
+  if (name.type != TOKEN_WORD || name.w.flags || !is_name(name.w.text)) {
+    ps.peeked = true;
+    ps.next = name;
+    return fail_unexpected(ps);
+  }
+  n->name = name.w.text;
+
+  skip_newlines(ps);
+  if (is_keyword(peek(ps), "in")) {
+    take(ps);
+    while (peek(ps).type == TOKEN_WORD) n->words.push_back(take(ps).w);
+    if (peek(ps).type != TOKEN_SEMICOLON && peek(ps).type != TOKEN_NEWLINE) {
+      return fail_unexpected(ps);
+    }
+    take(ps);
+  } else {
+    word all = { "\"$@\"", WORD_QUOTED | WORD_DOLLAR };
+    n->words.push_back(all);
+    if (peek(ps).type == TOKEN_SEMICOLON) take(ps);
+  }
+
+  skip_newlines(ps);
+  if (!expect(ps, "do")) return NULL;
+  node* body = parse_body(ps);
+  if (!body || !expect(ps, "done")) return NULL;
+  n->children.push_back(body);
+  return n;
+}
+
+
+// Parses a pipeline, or the definition of a function, which starts out
+// looking like a command until its "()"
+static node* parse_pipeline(parse_state& ps) {
+  program& code = ps.result;
+  if (code.pipelines_used == code.pipelines.size()) {
+    code.pipelines.push_back(pipeline());
+  }
+  pipeline& result = code.pipelines[code.pipelines_used++];
+  result.commands.clear();
+  result.background = false;
+  result.timed = false;
+
+  // The command words are being added to, NULL after a pipe
+  simple_command* current = NULL;
+  // Set while the next word is the file of a redirection
+  bool want_target = false;
+  redirection_type target_type = REDIRECT_IN;
+  int target_fd = 0;
+
+  while (true) {
+    token& t = peek(ps);
+    if (want_target && t.type != TOKEN_WORD) {
+      if (t.type == TOKEN_END && ps.failed) return NULL;
+      return fail(ps, "Invalid file redirection");
+    }
+
+    if (t.type == TOKEN_PIPE) {
+      if (!current || current->words.empty()) {
+        return fail(ps, "Invalid pipes");
+      }
+      take(ps);
+      current = NULL;
+      // The pipeline carries on over newlines
+      skip_newlines(ps);
+      if (peek(ps).type == TOKEN_END) {
+        return fail_incomplete(ps, "Invalid pipes");
+      }
+      splice_alias(ps);
+      continue;
+    }
+    if (t.type >= TOKEN_IN && t.type <= TOKEN_BOTH_APPEND) {
+      static const redirection_type types[] = {
+        REDIRECT_IN, REDIRECT_OUT, REDIRECT_APPEND, REDIRECT_DUP,
+        REDIRECT_DUP, REDIRECT_BOTH, REDIRECT_BOTH_APPEND
+      };
+      target_type = types[t.type - TOKEN_IN];
+      // Input goes to stdin and the rest to stdout, unless a descriptor is
+      // given
+      target_fd = t.fd != -1 ? t.fd
+                : t.type == TOKEN_IN || t.type == TOKEN_DUP_IN ? 0 : 1;
+      take(ps);
+      want_target = true;
+      if (!current) {
+        result.commands.push_back(simple_command());
+        current = &result.commands.back();
+      }
+      continue;
+    }
+    if (t.type == TOKEN_OPEN) {
+      // name() starts a function definition
+      if (!current || result.commands.size() > 1 || result.timed ||
+          current->words.size() != 1 || !current->assignments.empty() ||
+          !current->redirections.empty() || current->words[0].flags ||
+          !is_name(current->words[0].text)) {
+        return fail_unexpected(ps);
+      }
+      take(ps);
+      if (peek(ps).type != TOKEN_CLOSE) return fail_unexpected(ps);
+      take(ps);
+      skip_newlines(ps);
+      // The body must be a compound command
+      token& first = peek(ps);
+      if (!is_keyword(first, "{") && !is_keyword(first, "if") &&
+          !is_keyword(first, "while") && !is_keyword(first, "until") &&
+          !is_keyword(first, "for")) {
+        return fail_unexpected(ps);
+      }
+      node* n = add_node(ps, NODE_FUNCTION);
+      n->name = current->words[0].text;
+      node* body = parse_command(ps);
+      if (!body) return NULL;
+      n->children.push_back(body);
+      return n;
+    }
+    if (t.type != TOKEN_WORD) break;
+
+    token& taken = take(ps);
+    word w = taken.w;
+    bool check_next = taken.check_next;
+    // A time at the very start times the pipeline rather than running
+    if (!current && result.commands.empty() && !result.timed && !w.flags &&
+        w.text == "time") {
+      result.timed = true;
+      splice_alias(ps);
+      continue;
+    }
+
+    if (!current) {
+      result.commands.push_back(simple_command());
+      current = &result.commands.back();
+    }
+    if (want_target) {
+      redirection r;
+      r.type = target_type;
+      r.fd = target_fd;
+      r.target = w;
+      current->redirections.push_back(r);
+      want_target = false;
+    }
+    else if (current->words.empty() && assignment_length(w.text) > 0) {
+      current->assignments.push_back(w);
+      // The command word may still be an alias
+      check_next = true;
+    }
+    else {
+      current->words.push_back(w);
+    }
+    if (check_next) splice_alias(ps);
+  }
+  if (ps.failed) return NULL;
+
+  // Nothing at all where a command should be
+  if (result.commands.empty() && !result.timed) {
+    if (peek(ps).type == TOKEN_AMPERSAND) {
+      return fail(ps, "& needs a command before it");
+    }
+    return fail_unexpected(ps);
+  }
+  // A pipe with nothing after it
+  if (!current && !result.commands.empty()) {
+    return fail(ps, "Invalid pipes");
+  }
+  // Every command needs a name, unless the line only assigns variables
+  for (int c = 0; c < result.commands.size(); c++) {
+    simple_command& command = result.commands[c];
+    if (command.words.empty() &&
+        (result.commands.size() > 1 || !command.redirections.empty())) {
+      return fail(ps, result.commands.size() > 1 ? "Invalid pipes"
+                                                 : "Invalid file redirection");
+    }
+  }
+
+  node* n = add_node(ps, NODE_PIPELINE);
+  n->line = &result;
+  return n;
+}
+
+
+// Parses one command: a compound command, or a pipeline
+static node* parse_command(parse_state& ps) {
+  splice_alias(ps);
+  token& t = peek(ps);
+  if (is_keyword(t, "if")) {
+    take(ps);
+    return parse_if(ps);
+  }
+  if (is_keyword(t, "while") || is_keyword(t, "until")) {
+    node_type type = t.w.text == "while" ? NODE_WHILE : NODE_UNTIL;
+    take(ps);
+    return parse_loop(ps, type);
+  }
+  if (is_keyword(t, "for")) {
+    take(ps);
+    return parse_for(ps);
+  }
+  if (is_keyword(t, "{")) {
+    take(ps);
+    node* body = parse_body(ps);
+    if (!body || !expect(ps, "}")) return NULL;
+    return body;
+  }
+  return parse_pipeline(ps);
+}
+
+
+// Parses commands joined by && and ||, which bind left to right
+static node* parse_and_or(parse_state& ps) {
+  node* left = parse_command(ps);
+  while (left && (peek(ps).type == TOKEN_AND || peek(ps).type == TOKEN_OR)) {
+    node* n = add_node(ps, take(ps).type == TOKEN_AND ? NODE_AND : NODE_OR);
+    skip_newlines(ps);
+    node* right = parse_command(ps);
+    if (!right) return NULL;
+    n->children.push_back(left);
+    n->children.push_back(right);
+    left = n;
+  }
+  return left;
+}
+
+
+// Parses commands separated by ;, & and newlines, up to the end of the text
+// or a word that closes a compound command. Returns NULL if there are none.
+static node* parse_list(parse_state& ps) {
+  vector<node*> commands;
+  while (true) {
+    skip_newlines(ps);
+    if (ends_list(peek(ps))) break;
+    node* command = parse_and_or(ps);
+    if (!command) return NULL;
+    commands.push_back(command);
+
+    token_type separator = peek(ps).type;
+    if (separator == TOKEN_AMPERSAND) {
+      // Only a pipeline can go in the background
+      if (command->type != NODE_PIPELINE) {
+        return fail(ps, "& can only put a pipeline in the background");
+      }
+      command->line->background = true;
+    }
+    else if (separator != TOKEN_SEMICOLON && separator != TOKEN_NEWLINE) {
+      break;
+    }
+    take(ps);
+  }
+  if (commands.size() <= 1) return commands.empty() ? NULL : commands[0];
+  node* n = add_node(ps, NODE_LIST);
+  n->children.swap(commands);
+  return n;
+}
+
+
+bool parse(char* text, arena& mem, program& result, string& error) {
+  result.nodes.clear();
+  result.pipelines_used = 0;
+  result.root = NULL;
+  result.incomplete = false;
+  parse_state ps = { text, 0, mem, result, error, false, false, false };
+
+  node* root = parse_list(ps);
+  if (!ps.failed && peek(ps).type != TOKEN_END) fail_unexpected(ps);
+  if (ps.failed) return false;
+  result.root = root;
+  return true;
+}
+
+
+bool tokenize(char* line, arena& mem, pipeline& result, string& error) {
+  // The pipeline is parsed into the result's own memory, as it was the last
+  // time
+  program parsed;
+  parsed.pipelines.resize(1);
+  parsed.pipelines[0].commands.swap(result.commands);
+  if (!parse(line, mem, parsed, error)) return false;
+  if (!parsed.root) {
+    result.commands.clear();
+    result.background = false;
+    result.timed = false;
+    return true;
+  }
+  if (parsed.root->type != NODE_PIPELINE) {
+    error = "only a single pipeline can be run here";
+    return false;
+  }
+  result = move(*parsed.root->line);
+  return true;
+}
@@ -0,0 +1,234 @@
+#pragma once
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+using std::deque;
+using std::string;
+using std::string_view;
+using std::vector;
+
+
+// Hands out memory for everything built while handling one line, in large
+// blocks that are all released together. Strings copied into it are always
+// NUL terminated, so their views can be handed straight to exec.
+class arena {
+ public:
+  arena();
+  ~arena();
+
+  // Returns size bytes that stay valid until the arena is reset
+  char* allocate(size_t size);
+
+  // Copies the text into the arena, followed by a NUL
+  string_view copy(string_view text);
+
+  // Releases everything, keeping the first block for the next line
+  void reset();
+
+  // How much of the arena is in use, to go back to with rewind
+  struct position {
+    size_t blocks;
+    size_t used;
+    size_t capacity;
+  };
+
+  // Returns how much of the arena is in use now
+  position mark() const;
+
+  // Releases everything allocated since the position was marked, so a loop
+  // can expand its body over and over in the same memory
+  void rewind(const position& where);
+
+ private:
+  arena(const arena&);
+  arena& operator=(const arena&);
+
+  vector<char*> blocks;
+  // Bytes handed out from, and the size of, the newest block
+  size_t used;
+  size_t capacity;
+  // The size of the first block, which is kept by reset
+  size_t first_capacity;
+};
+
+
+// Set on a word that has quotes or backslashes to remove
+const unsigned WORD_QUOTED = 1;
+// Set on a word that has a $ to expand
+const unsigned WORD_DOLLAR = 2;
+// Set on a word with an unquoted *, ? or [ that may make it a glob pattern
+const unsigned WORD_GLOB = 4;
+
+// A word as it was typed, quotes and all. The text is NUL terminated.
+struct word {
+  string_view text;
+  unsigned flags;
+};
+
+
+// The kinds of file redirection
+enum redirection_type {
+  // n< file, n> file and n>> file
+  REDIRECT_IN,
+  REDIRECT_OUT,
+  REDIRECT_APPEND,
+  // n>&m or n<&m, making n a copy of m, or closing it if m is -
+  REDIRECT_DUP,
+  // &> file and &>> file, for both stdout and stderr
+  REDIRECT_BOTH,
+  REDIRECT_BOTH_APPEND
+};
+
+// A redirection on a command, such as "< file", "2>> file" or "2>&1"
+struct redirection {
+  redirection_type type;
+  // The descriptor redirected: 0 by default for input and 1 for output
+  int fd;
+  // The file, or for REDIRECT_DUP the descriptor copied
+  word target;
+  // The target file name after expansion
+  string_view path;
+};
+
+
+// One command of a pipeline
+struct simple_command {
+  // Leading name=value words
+  vector<word> assignments;
+  // The command and its arguments, as typed
+  vector<word> words;
+  vector<redirection> redirections;
+  // The words after expansion, ready to execute. Every view is NUL
+  // terminated.
+  vector<string_view> argv;
+  // The leading assignments after expansion, as name=value, for this
+  // command's environment only. Every view is NUL terminated.
+  vector<string_view> environment;
+  // Where argv still has glob patterns, which have a backslash in front of
+  // every character that came from quotes or an expansion
+  vector<int> patterns;
+};
+
+
+// Commands joined by pipes, possibly run in the background
+struct pipeline {
+  vector<simple_command> commands;
+  bool background;
+  // Set by a leading "time", to report what the pipeline used
+  bool timed;
+};
+
+
+// The kinds of node a command line is compiled into
+enum node_type {
+  // A pipeline, run as it is
+  NODE_PIPELINE,
+  // Two commands joined by && or ||
+  NODE_AND,
+  NODE_OR,
+  // Commands run one after another, separated by ; or newlines
+  NODE_LIST,
+  // if ... then ... [elif ... then ...] [else ...] fi
+  NODE_IF,
+  // while/until ... do ... done
+  NODE_WHILE,
+  NODE_UNTIL,
+  // for name [in words] do ... done
+  NODE_FOR,
+  // name() compound-command, which defines the function when run
+  NODE_FUNCTION
+};
+
+// One node of a compiled command line
+struct node {
+  node_type type;
+  // NODE_PIPELINE: the pipeline
+  pipeline* line;
+  // NODE_AND and NODE_OR: the two sides. NODE_LIST: the commands in order.
+  // NODE_IF: the condition, the then part and the else part, which is NULL
+  // without an else (an elif is an if in the else part). NODE_WHILE and
+  // NODE_UNTIL: the condition and the body. NODE_FOR and NODE_FUNCTION: the
+  // body.
+  vector<node*> children;
+  // NODE_FOR: the loop variable. NODE_FUNCTION: the function's name.
+  string_view name;
+  // NODE_FOR: the words looped over, as typed
+  vector<word> words;
+};
+
+// A parsed command line, which may span several lines of input: a tree of
+// nodes, with pipelines at the leaves. It owns the nodes and pipelines,
+// whose words point into the text and arena it was parsed from. Parsing
+// into it again reuses the pipelines' memory.
+struct program {
+  deque<node> nodes;
+  deque<pipeline> pipelines;
+  // How many of the pipelines are in use; the rest are left from before
+  size_t pipelines_used;
+  node* root;
+  // Set when the text ended in the middle of a command, like an if without
+  // its fi or a line ending in &&, so more input should be read onto it
+  bool incomplete;
+};
+
+
+// Breaks the raw input line into words and operators and builds the pipeline
+// from them in the same pass. Words are views into the line itself, which is
+// NUL terminated in place after each word; only a word run straight into an
+// operator is copied, into the arena. A word starting with # begins a comment
+// that runs to the end of the line. Returns false and sets error if the
+// line can't be parsed, or isn't a single pipeline.
+bool tokenize(char* line, arena& mem, pipeline& result, string& error);
+
+
+// Parses text that may hold several commands, joined by ;, &&, || and
+// newlines, and the compound commands if, while, until, for, { } and
+// function definitions, into a tree that can be run any number of times
+// without looking at the text again. The text is broken up in place as
+// tokenize does, and aliases are expanded as it is read, so a tree already
+// built keeps the aliases it was parsed with. Returns false and sets error if
+// it can't be parsed, with result.incomplete set if it only needs more lines.
+bool parse(char* text, arena& mem, program& result, string& error);
+
+
+// Defines an alias, or redefines it. The value is broken into tokens here,
+// once, and those are spliced in by parse wherever the name is the first word
+// of a command, or follows an alias whose value ends in a blank. Returns false
+// with error set if the name can't be an alias or the value has an unclosed
+// quote.
+bool alias_define(const string& name, const string& value, string& error);
+
+
+// Removes an alias. Returns false if there is none by the name.
+bool alias_remove(string_view name);
+
+
+// Removes every alias
+void alias_clear();
+
+
+// Sets value to the alias's value as it was defined. Returns false if there
+// is no alias by the name.
+bool alias_value(string_view name, string& value);
+
+
+// Returns the names of the aliases, sorted
+vector<string> alias_names();
+
+
+// Returns the length of the "name=" part of a word that assigns a variable,
+// or 0 if the word isn't an assignment.
+size_t assignment_length(string_view text);
+
+
+// Whether the character separates words
+bool is_blank(char c);
+
+
+// Returns the index just past the ")" that closes the command substitution
+// starting at text[start] (the $ of a "$("), skipping over quotes and nested
+// parentheses, or string_view::npos if it is never closed.
+size_t substitution_end(string_view text, size_t start);
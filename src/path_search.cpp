@@ -0,0 +1,115 @@
+#include "path_search.h"
+
+#include <cstdlib>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "variables.h"
+
+using namespace std;
+
+// Commands found on $PATH so far, by name, and how many lookups were
+// answered from it and how many searched $PATH
+static map<string, hash_entry> command_hash;
+static unsigned long hash_hits = 0;
+static unsigned long hash_misses = 0;
+
+// The value of $PATH the hash was filled from
+static string hashed_path;
+
+// Built-ins running on threads look commands up too
+static mutex hash_mutex;
+
+
+vector<string> split_path(const string& path) {
+  vector<string> dirs;
+  size_t start = 0;
+  while (true) {
+    size_t end = path.find(':', start);
+    // the segment after the final ':' counts too
+    string dir = path.substr(start, end == string::npos ? string::npos
+                                                        : end - start);
+    dirs.push_back(dir.empty() ? "." : dir);
+    if (end == string::npos) break;
+    start = end + 1;
+  }
+  return dirs;
+}
+
+
+string path_search(const string& name) {
+  // The shell's own $PATH, which environ only catches up with when a
+  // command's environment is next built
+  const char* path = variable_get("PATH");
+  if (!path) return "";
+
+  vector<string> dirs = split_path(path);
+  for (int i = 0; i < dirs.size(); i++) {
+    string candidate = dirs[i] + "/" + name;
+    // Must be a regular file we are allowed to execute
+    struct stat info;
+    if (stat(candidate.c_str(), &info) == 0 && S_ISREG(info.st_mode) &&
+        access(candidate.c_str(), X_OK) == 0) {
+      return candidate;
+    }
+  }
+  return "";
+}
+
+
+string hash_lookup(const string& name) {
+  // Paths are used as they are, like execvp does
+  if (name.find('/') != string::npos) return name;
+  lock_guard<mutex> lock(hash_mutex);
+
+  // Anything found under an old $PATH may no longer be right. It is
+  // compared itself rather than the exported variables' generation, as it
+  // needn't be exported to be searched.
+  const char* path = variable_get("PATH");
+  if (hashed_path != (path ? path : "")) {
+    command_hash.clear();
+    hashed_path = path ? path : "";
+  }
+
+  map<string, hash_entry>::iterator found = command_hash.find(name);
+  if (found != command_hash.end()) {
+    hash_hits++;
+    found->second.hits++;
+    return found->second.path;
+  }
+
+  // Not seen yet, search for it and remember where it was
+  hash_misses++;
+  string fullpath = path_search(name);
+  if (!fullpath.empty()) {
+    hash_entry entry = { fullpath, 1 };
+    command_hash[name] = entry;
+  }
+  return fullpath;
+}
+
+
+bool hash_forget(const string& name) {
+  lock_guard<mutex> lock(hash_mutex);
+  return command_hash.erase(name) == 1;
+}
+
+
+void hash_clear() {
+  lock_guard<mutex> lock(hash_mutex);
+  command_hash.clear();
+}
+
+
+map<string, hash_entry> hash_snapshot() {
+  lock_guard<mutex> lock(hash_mutex);
+  return command_hash;
+}
+
+
+void hash_stats(unsigned long& hits, unsigned long& misses) {
+  lock_guard<mutex> lock(hash_mutex);
+  hits = hash_hits;
+  misses = hash_misses;
+}
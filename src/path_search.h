@@ -0,0 +1,52 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+
+
+using std::map;
+using std::string;
+using std::vector;
+
+
+// A remembered location of a command, and how many times it has been used
+struct hash_entry {
+  string path;
+  unsigned long hits;
+};
+
+
+
+// Splits a $PATH style list into its directories. An empty entry stands for
+// the current directory.
+vector<string> split_path(const string& path);
+
+
+// Searches each $PATH directory in order for an executable with the given
+// name. Returns the full path, or an empty string if there is none.
+string path_search(const string& name);
+
+
+// Returns the full path of a command. The first lookup of a name searches
+// $PATH and remembers the result; later lookups come from the command hash.
+// The hash is emptied whenever $PATH changes. Names containing a '/' are
+// returned unchanged, and an empty string is returned if nothing is found.
+string hash_lookup(const string& name);
+
+
+// Removes a single command from the hash. Returns false if it wasn't there.
+bool hash_forget(const string& name);
+
+
+// Removes every command from the hash.
+void hash_clear();
+
+
+// Returns a copy of the hash, the commands found on $PATH so far by name,
+// taken under its lock as built-ins on threads may be looking commands up.
+map<string, hash_entry> hash_snapshot();
+
+
+// Sets hits to the number of lookups answered from the hash, and misses to
+// the number that searched $PATH.
+void hash_stats(unsigned long& hits, unsigned long& misses);
@@ -0,0 +1,245 @@
+#include "prompt.h"
+
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <readline/readline.h>
+
+#include "builtins.h"
+#include "jobs.h"
+
+using namespace std;
+
+// How long a prompt waits for a segment from the background thread before
+// it is shown without it
+const chrono::milliseconds SEGMENT_DEADLINE(20);
+
+// Shown for a segment that isn't ready yet
+const char* const SEGMENT_PLACEHOLDER = "...";
+
+// How much of a commit id is shown when no branch is checked out
+const size_t SHORT_COMMIT = 7;
+
+// The background thread's work, under segment_lock: the directory whose git
+// branch is wanted, and the answer to the latest request it has finished
+static mutex segment_lock;
+static condition_variable segment_changed;
+static bool worker_started = false;
+static string wanted_directory;
+static unsigned long wanted_request = 0;
+static string branch_directory;
+static string branch;
+static unsigned long answered_request = 0;
+// Set while the prompt on screen is waiting for the answer
+static bool waiting = false;
+
+// What the prompt on screen was built from, to build it again when the branch
+// arrives. Only used on the main thread.
+static string shown_format;
+static int shown_status;
+static double shown_seconds;
+static string shown_prompt;
+
+
+// Returns the first line of a small file, or "" if it can't be read
+static string first_line(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return "";
+  char buffer[4096];
+  ssize_t length = read(fd, buffer, sizeof(buffer));
+  close(fd);
+  if (length <= 0) return "";
+  string line(buffer, length);
+  return line.substr(0, line.find('\n'));
+}
+
+
+// Returns the branch checked out in the git work tree the directory is in,
+// the start of the commit if it isn't on a branch, or "" outside of one.
+// Only files are read, so it doesn't cost a git process.
+static string git_branch(string directory) {
+  while (!directory.empty()) {
+    string dot_git = (directory == "/" ? "" : directory) + "/.git";
+    struct stat info;
+    if (stat(dot_git.c_str(), &info) == 0) {
+      // A worktree or submodule has a file naming where the repository is
+      string git_dir = dot_git;
+      if (S_ISREG(info.st_mode)) {
+        string line = first_line(dot_git);
+        if (line.compare(0, 8, "gitdir: ") != 0) return "";
+        git_dir = line.substr(8);
+        if (git_dir[0] != '/') git_dir = directory + "/" + git_dir;
+      }
+      string head = first_line(git_dir + "/HEAD");
+      if (head.compare(0, 16, "ref: refs/heads/") == 0) return head.substr(16);
+      if (head.compare(0, 5, "ref: ") == 0) return head.substr(5);
+      return head.substr(0, SHORT_COMMIT);
+    }
+    if (directory == "/") break;
+    size_t slash = directory.rfind('/');
+    if (slash == 0 || slash == string::npos) directory = "/";
+    else directory = directory.substr(0, slash);
+  }
+  return "";
+}
+
+
+// Answers the requests for git branches, the latest one first, for as long
+// as the shell runs
+static void segment_worker() {
+  unique_lock<mutex> lock(segment_lock);
+  while (true) {
+    segment_changed.wait(lock, [] {
+      return answered_request != wanted_request;
+    });
+    string directory = wanted_directory;
+    unsigned long request = wanted_request;
+    lock.unlock();
+    string answer = git_branch(directory);
+    lock.lock();
+    branch_directory = directory;
+    branch = answer;
+    answered_request = request;
+    segment_changed.notify_all();
+  }
+}
+
+
+// Asks the background thread for the directory's git branch, and waits a
+// little for it. Returns the branch, or what to show until it arrives.
+static string request_branch(const string& directory) {
+  unique_lock<mutex> lock(segment_lock);
+  if (!worker_started) {
+    job_thread_start(segment_worker).detach();
+    worker_started = true;
+  }
+  unsigned long request = ++wanted_request;
+  wanted_directory = directory;
+  segment_changed.notify_all();
+  bool ready = segment_changed.wait_for(lock, SEGMENT_DEADLINE, [request] {
+    return answered_request == request;
+  });
+  waiting = !ready;
+  if (ready || branch_directory == directory) return branch;
+  return SEGMENT_PLACEHOLDER;
+}
+
+
+// Formats how long a command ran, in the largest units that fit
+static string format_duration(double seconds) {
+  char text[32];
+  if (seconds < 1) {
+    snprintf(text, sizeof(text), "%dms", (int) (seconds * 1000));
+  } else if (seconds < 60) {
+    snprintf(text, sizeof(text), "%.1fs", seconds);
+  } else {
+    snprintf(text, sizeof(text), "%dm%02ds", (int) seconds / 60,
+             (int) seconds % 60);
+  }
+  return text;
+}
+
+
+// Returns the user's name, or their id if it has none
+static const string& user_name() {
+  static string name;
+  if (name.empty()) {
+    struct passwd* entry = getpwuid(geteuid());
+    name = entry ? entry->pw_name : to_string(geteuid());
+  }
+  return name;
+}
+
+
+// Returns the host's name up to its first dot
+static const string& host_name() {
+  static string name;
+  if (name.empty()) {
+    char text[HOST_NAME_MAX + 1] = "";
+    gethostname(text, sizeof(text));
+    name = string(text).substr(0, string(text).find('.'));
+  }
+  return name;
+}
+
+
+// Builds the prompt from the format, with the git branch already known
+static string build(const string& format, int status, double seconds,
+                    const string& git) {
+  const string& directory = pwd();
+  string result;
+  for (size_t i = 0; i < format.size(); i++) {
+    if (format[i] != '\\' || i + 1 == format.size()) {
+      result += format[i];
+      continue;
+    }
+    char c = format[++i];
+    if (c == 'w') result += directory;
+    else if (c == 'W') {
+      size_t slash = directory.rfind('/');
+      bool root = directory == "/" || slash == string::npos;
+      result += root ? directory : directory.substr(slash + 1);
+    }
+    else if (c == 'u') result += user_name();
+    else if (c == 'h') result += host_name();
+    else if (c == '$') result += geteuid() == 0 ? '#' : '$';
+    else if (c == '?') result += to_string(status);
+    else if (c == 'S') result += status == 0 ? ":)" : ":(";
+    else if (c == 'r') result += format_duration(seconds);
+    else if (c == 'g') result += git;
+    else if (c == 'n') result += '\n';
+    else if (c == 'e') result += '\033';
+    else if (c == '[') result += RL_PROMPT_START_IGNORE;
+    else if (c == ']') result += RL_PROMPT_END_IGNORE;
+    else if (c == '\\') result += '\\';
+    else {
+      result += '\\';
+      result += c;
+    }
+  }
+  return result;
+}
+
+
+// Called by readline now and then while it waits for a key. Puts the branch
+// into the prompt if it has arrived since the prompt was shown, and the
+// prompt is still on screen rather than a search.
+static int prompt_event() {
+  string git;
+  {
+    lock_guard<mutex> guard(segment_lock);
+    if (!waiting || answered_request != wanted_request) return 0;
+    waiting = false;
+    git = branch;
+  }
+  if (!rl_prompt || shown_prompt != rl_prompt) return 0;
+  string prompt = build(shown_format, shown_status, shown_seconds, git);
+  if (prompt == shown_prompt) return 0;
+  shown_prompt = prompt;
+  rl_set_prompt(prompt.c_str());
+  rl_forced_update_display();
+  return 0;
+}
+
+
+void prompt_init() {
+  rl_event_hook = prompt_event;
+}
+
+
+string prompt_expand(const string& format, int status, double seconds) {
+  string git;
+  if (format.find("\\g") != string::npos) git = request_branch(pwd());
+  shown_format = format;
+  shown_status = status;
+  shown_seconds = seconds;
+  shown_prompt = build(format, status, seconds, git);
+  return shown_prompt;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+
+
+using std::string;
+
+
+// Makes readline redraw the prompt when a segment that wasn't ready in time
+// for it arrives. Called once, before the first prompt.
+void prompt_init();
+
+
+// Builds the prompt from a format, as set in $PS1, where
+//   \w is the current directory, and \W its last part
+//   \u is the user, \h the host up to its first dot, and \$ # for root or $
+//   \? is the last command's exit status, and \S :) if it succeeded or :(
+//   \r is how long the last command ran, and \g the git branch checked out
+//   \n is a newline, \e an escape, \\ a backslash, and \[ and \] go around
+//   characters that take no room, like colors
+// status and seconds are the last command's. The git branch is read on a
+// background thread; if it takes longer than a few milliseconds, the prompt
+// shows the branch from before in the same directory, or "...", and is
+// redrawn once it arrives.
+string prompt_expand(const string& format, int status, double seconds);
@@ -0,0 +1,216 @@
+#include "redirect.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Files are opened at or above this descriptor, and above any a command's
+// redirections name, so none of them is one a command is redirected to, and
+// a step can't overwrite a file a later step copies
+const int OPENED_FD_MIN = 10;
+
+// The permissions of a file created by a redirection
+const mode_t CREATE_MODE = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+
+
+// Opens the file close-on-exec, moved up out of the way if it got a
+// descriptor below lowest. Returns -1 with errno set if it can't be opened.
+static int open_high(const char* path, int flags, int lowest) {
+  int fd = open(path, flags | O_CLOEXEC, CREATE_MODE);
+  if (fd == -1 || fd >= lowest) return fd;
+  int high = fcntl(fd, F_DUPFD_CLOEXEC, lowest);
+  int saved = errno;
+  close(fd);
+  errno = saved;
+  return high;
+}
+
+
+// Reads the descriptor a n>&m copies. Returns false if the text isn't one.
+static bool descriptor_number(string_view text, int& fd) {
+  if (text.empty() || text.size() > 4) return false;
+  fd = 0;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (!isdigit(text[i])) return false;
+    fd = fd * 10 + (text[i] - '0');
+  }
+  return true;
+}
+
+
+// Returns the lowest descriptor that is out of the way of the steps: at
+// least OPENED_FD_MIN, and above every descriptor one of them replaces
+static int lowest_free(const vector<redirection>& redirections) {
+  int lowest = OPENED_FD_MIN;
+  for (int r = 0; r < redirections.size(); r++) {
+    lowest = max(lowest, redirections[r].fd + 1);
+  }
+  return lowest;
+}
+
+
+// Whether the descriptor is open for the command after the steps so far
+static bool is_open(const redirect_plan& plan, int fd) {
+  for (size_t i = plan.actions.size(); i-- > 0;) {
+    if (plan.actions[i].fd == fd) return plan.actions[i].source != -1;
+  }
+  return fcntl(fd, F_GETFD) != -1;
+}
+
+
+bool redirect_open(simple_command& command, redirect_plan& plan,
+                   string& error) {
+  plan.actions.clear();
+  plan.opened.clear();
+  vector<redirection>& redirections = command.redirections;
+  int lowest = lowest_free(redirections);
+  for (int r = 0; r < redirections.size(); r++) {
+    const redirection& redirect = redirections[r];
+    string_view path = redirect.path;
+
+    if (redirect.type == REDIRECT_DUP) {
+      int source = -1;
+      if (path != "-" && !descriptor_number(path, source)) {
+        error = string(path) + ": ambiguous redirect";
+        redirect_close(plan);
+        return false;
+      }
+      if (source != -1 && !is_open(plan, source)) {
+        error = string(path) + ": Bad file descriptor";
+        redirect_close(plan);
+        return false;
+      }
+      fd_action copy = { redirect.fd, source };
+      plan.actions.push_back(copy);
+      continue;
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (redirect.type == REDIRECT_IN) flags = O_RDONLY;
+    if (redirect.type == REDIRECT_APPEND ||
+        redirect.type == REDIRECT_BOTH_APPEND) {
+      flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+    int fd = open_high(path.data(), flags, lowest);
+    if (fd == -1) {
+      error = string(path) + ": " + strerror(errno);
+      redirect_close(plan);
+      return false;
+    }
+    plan.opened.push_back(fd);
+    fd_action to_file = { redirect.fd, fd };
+    plan.actions.push_back(to_file);
+    if (redirect.type == REDIRECT_BOTH ||
+        redirect.type == REDIRECT_BOTH_APPEND) {
+      fd_action errors = { STDERR_FILENO, fd };
+      plan.actions.push_back(errors);
+    }
+  }
+  return true;
+}
+
+
+void redirect_close(redirect_plan& plan) {
+  for (int i = 0; i < plan.opened.size(); i++) close(plan.opened[i]);
+  plan.opened.clear();
+}
+
+
+// Takes one step in the calling process
+static void take_step(const fd_action& action) {
+  if (action.source == -1) {
+    close(action.fd);
+  } else if (action.source != action.fd) {
+    dup2(action.source, action.fd);
+  } else {
+    // A copy of itself is kept across an exec
+    fcntl(action.fd, F_SETFD, 0);
+  }
+}
+
+
+void redirect_apply(const redirect_plan& plan) {
+  for (int i = 0; i < plan.actions.size(); i++) take_step(plan.actions[i]);
+}
+
+
+void redirect_spawn_actions(const redirect_plan& plan,
+                            posix_spawn_file_actions_t* actions) {
+  for (int i = 0; i < plan.actions.size(); i++) {
+    const fd_action& action = plan.actions[i];
+    if (action.source == -1) {
+      posix_spawn_file_actions_addclose(actions, action.fd);
+    } else {
+      posix_spawn_file_actions_adddup2(actions, action.source, action.fd);
+    }
+  }
+}
+
+
+void redirect_builtin(const redirect_plan& plan, int& in, int& out,
+                      int& err) {
+  int* standard[] = { &in, &out, &err };
+  // What the steps so far made of the descriptors above stderr
+  vector<fd_action> made;
+  for (int i = 0; i < plan.actions.size(); i++) {
+    const fd_action& action = plan.actions[i];
+    int value = action.source;
+    if (value >= 0 && value <= STDERR_FILENO) {
+      value = *standard[value];
+    } else if (value != -1) {
+      for (size_t m = made.size(); m-- > 0;) {
+        if (made[m].fd == value) {
+          value = made[m].source;
+          break;
+        }
+      }
+    }
+    if (action.fd <= STDERR_FILENO) {
+      *standard[action.fd] = value;
+    } else {
+      fd_action now = { action.fd, value };
+      made.push_back(now);
+    }
+  }
+}
+
+
+void redirect_shell(const redirect_plan& plan, vector<fd_action>* saved) {
+  // What was written to stdout so far goes where it was headed
+  cout.flush();
+  // The copies kept are out of the way of the steps, like the files
+  int lowest = OPENED_FD_MIN;
+  for (int i = 0; i < plan.actions.size(); i++) {
+    lowest = max(lowest, plan.actions[i].fd + 1);
+  }
+  for (int i = 0; i < plan.actions.size(); i++) {
+    const fd_action& action = plan.actions[i];
+    if (saved) {
+      fd_action kept = { action.fd,
+                         fcntl(action.fd, F_DUPFD_CLOEXEC, lowest) };
+      saved->push_back(kept);
+    }
+    take_step(action);
+  }
+}
+
+
+void redirect_restore(vector<fd_action>& saved) {
+  cout.flush();
+  for (size_t i = saved.size(); i-- > 0;) {
+    if (saved[i].source == -1) {
+      close(saved[i].fd);
+    } else {
+      dup2(saved[i].source, saved[i].fd);
+      close(saved[i].source);
+    }
+  }
+  saved.clear();
+}
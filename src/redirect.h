@@ -0,0 +1,69 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <spawn.h>
+
+#include "parser.h"
+
+
+using std::string;
+using std::vector;
+
+
+// One step of a command's redirections: fd becomes a copy of source, or is
+// closed if source is -1
+struct fd_action {
+  int fd;
+  int source;
+};
+
+// What a command's redirections do to its descriptors, in order, and the
+// files opened for them
+struct redirect_plan {
+  vector<fd_action> actions;
+  vector<int> opened;
+};
+
+
+// Opens the files the command's expanded redirections name and works out the
+// steps that give it its descriptors. The shell's own descriptors are left as
+// they are: the files are opened close-on-exec, above the low numbers a
+// command is redirected to, and the steps are only taken in the command's
+// process, by redirect_apply or as spawn file actions. Returns false with
+// error set, and nothing left open, if a file can't be opened or a
+// descriptor to copy isn't open.
+bool redirect_open(simple_command& command, redirect_plan& plan,
+                   string& error);
+
+
+// Closes the files opened for the plan, once the command has its copies
+void redirect_close(redirect_plan& plan);
+
+
+// Takes the plan's steps in the calling process, which is the command's own
+// child
+void redirect_apply(const redirect_plan& plan);
+
+
+// Adds the plan's steps to file actions for posix_spawn
+void redirect_spawn_actions(const redirect_plan& plan,
+                            posix_spawn_file_actions_t* actions);
+
+
+// Works out what the command's stdin, stdout and stderr end up as, for a
+// built-in that runs in the shell or on a thread and is handed them rather
+// than having its descriptors moved. They start out as in, out and err. A
+// closed one comes out as -1.
+void redirect_builtin(const redirect_plan& plan, int& in, int& out,
+                      int& err);
+
+
+// Takes the plan's steps in the shell itself. With saved, what they replace
+// is kept there for redirect_restore, as around a function call; without it,
+// as for exec, they last, and a descriptor above stderr stays open in every
+// command started afterwards.
+void redirect_shell(const redirect_plan& plan, vector<fd_action>* saved);
+
+
+// Puts back the descriptors redirect_shell saved
+void redirect_restore(vector<fd_action>& saved);
@@ -0,0 +1,166 @@
+#include "server.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "client.h"
+#include "jobs.h"
+#include "line_reader.h"
+#include "shell.h"
+
+using namespace std;
+
+// Connections the server lets wait before accepting them
+const int SERVER_BACKLOG = 128;
+
+// In a worker, its own pid and the connection it answers on
+static pid_t worker_self = 0;
+static int worker_connection = -1;
+
+// Answers the client with the exit status of its commands, once. Copies of
+// the worker forked for built-ins leave the answer to the worker.
+static void answer(int status) {
+  if (getpid() != worker_self) return;
+  int32_t reply = status;
+  send(worker_connection, &reply, sizeof(reply), MSG_NOSIGNAL);
+  worker_self = 0;
+}
+
+
+// Answers for a worker that exits, whether at the end of the commands or
+// through the exit built-in
+static void answer_on_exit(int status, void* unused) {
+  answer(status & 0xff);
+}
+
+
+// Answers for commands ended by a signal, with the status a shell would
+// report, then dies of the signal
+static void answer_signal(int signum) {
+  answer(128 + signum);
+  signal(signum, SIG_DFL);
+  raise(signum);
+}
+
+
+// Reads a request from the connection, taking the fds passed with it as the
+// worker's stdin, stdout and stderr, and runs it. Only called in a worker
+// process; never returns.
+static void serve_request(int connection) {
+  // Lead a process group, so the client can signal everything the request
+  // starts, and hand it its terminal
+  setpgid(0, 0);
+
+  // The fds come with the first bytes of the header
+  request_header header;
+  char control[CMSG_SPACE(PASSED_FDS * sizeof(int))];
+  struct iovec part = { &header, sizeof(header) };
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t got;
+  do {
+    got = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+  } while (got == -1 && errno == EINTR);
+  struct cmsghdr* passed = got > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+  if (!passed || passed->cmsg_type != SCM_RIGHTS ||
+      passed->cmsg_len != CMSG_LEN(PASSED_FDS * sizeof(int)) ||
+      !read_full(connection, (char*) &header + got, sizeof(header) - got)) {
+    _exit(1);
+  }
+  int fds[PASSED_FDS];
+  memcpy(fds, CMSG_DATA(passed), sizeof(fds));
+  for (int i = 0; i < PASSED_FDS; i++) {
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+
+  string cwd(header.cwd_length, '\0');
+  string commands(header.command_length, '\0');
+  if (!read_full(connection, &cwd[0], cwd.size()) ||
+      !read_full(connection, &commands[0], commands.size())) {
+    _exit(1);
+  }
+
+  worker_self = getpid();
+  worker_connection = connection;
+  int32_t pid = worker_self;
+  send(connection, &pid, sizeof(pid), MSG_NOSIGNAL);
+  on_exit(answer_on_exit, NULL);
+  int signals[] = { SIGINT, SIGQUIT, SIGTERM, SIGHUP };
+  for (int i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+    signal(signals[i], answer_signal);
+  }
+
+  // Run the commands the way -c does, where the client is
+  if (chdir(cwd.c_str()) == -1) {
+    perror(cwd.c_str());
+    exit(1);
+  }
+  directory_init();
+  jobs_init(false);
+  line_reader reader;
+  line_reader_init(reader, commands);
+  exit(run_batch(reader));
+}
+
+
+int run_server(const char* path) {
+  struct sockaddr_un address;
+  if (!socket_address(path, address)) {
+    perror(path);
+    return 1;
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    perror("socket");
+    return 1;
+  }
+  // A socket left behind by an earlier server is replaced
+  unlink(path);
+  if (bind(listener, (struct sockaddr*) &address, sizeof(address)) == -1 ||
+      listen(listener, SERVER_BACKLOG) == -1) {
+    perror(path);
+    close(listener);
+    return 1;
+  }
+
+  // Workers are never waited for, so have them reaped as they finish, and
+  // don't die writing to a client that has gone
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = SIG_DFL;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_NOCLDWAIT;
+  sigaction(SIGCHLD, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  while (true) {
+    int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (connection == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      return 1;
+    }
+    // Everything the request changes stays in its own copy of the shell
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+    }
+    else if (pid == 0) {
+      close(listener);
+      serve_request(connection);
+    }
+    close(connection);
+  }
+}
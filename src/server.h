@@ -0,0 +1,11 @@
+#pragma once
+
+
+// Serves command lines sent by clients over the Unix socket at path, so they
+// run in a shell that has already started up. Each request is run by a
+// forked worker, which gets the client's stdin, stdout and stderr passed over
+// the socket and the client's working directory, and whatever it changes
+// (the directory, variables, aliases) dies with it, so requests are isolated
+// from each other and can run at the same time. Only returns if the socket
+// can't be set up, with an exit status.
+int run_server(const char* path);
@@ -1,8 +1,11 @@
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <map>
-#include <sstream>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <readline/readline.h>
@@ -10,7 +13,25 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 
+#include "shell.h"
+#include "arith.h"
 #include "builtins.h"
+#include "client.h"
+#include "completion_index.h"
+#include "glob.h"
+#include "history_store.h"
+#include "history_widget.h"
+#include "interpreter.h"
+#include "jobs.h"
+#include "line_reader.h"
+#include "path_search.h"
+#include "prompt.h"
+#include "redirect.h"
+#include "server.h"
+#include "spawn.h"
+#include "timing.h"
+#include "trace.h"
+#include "variables.h"
 
 using namespace std;
 
@@ -18,68 +39,165 @@ using namespace std;
 // The characters that readline will use to delimit words
 const char* const WORD_DELIMITERS = " \t\n\"\\'`@><=;|&{(";
 
-// An external reference to the execution environment
-extern char** environ;
+// How much room the buffer for a command substitution's output keeps free for
+// each read
+const size_t CAPTURE_CHUNK = 64 * 1024;
 
-// Define 'command' as a type for built-in commands
-typedef int (*command)(vector<string>&);
+// The prompt shown while a command is continued onto another line
+const char* const CONTINUATION_PROMPT = "> ";
+
+// The format of the prompt when $PS1 isn't set: the directory, and :) or :(
+// for the last command's status
+const char* const DEFAULT_PROMPT = "\\w \\S $ ";
+
+// Number of stored history entries handed to readline at startup
+const size_t HISTORY_PRELOAD = 1000;
+
+// Exit status of a child that couldn't execute its command
+const int EXIT_NOT_FOUND = 127;
+
+// Status reported for a command whose process couldn't be started, as if it
+// had exited with EXIT_NOT_FOUND
+const int STATUS_NOT_STARTED = EXIT_NOT_FOUND << 8;
+
+// The exit status for a line that can't be parsed
+const int EXIT_SYNTAX_ERROR = 2;
 
 // A mapping of internal commands to their corresponding functions
-map<string, command> builtins; 
-// Variables local to the shell
-map<string, string> localvars;
+map<string, builtin> builtins;
+
+
+// Whether the shell is reading commands from a user at a terminal
+bool interactive = false;
+
+// Whether running commands from a script stops at the first one that fails
+bool errexit = false;
+
+// Whether a pipeline fails when any of its stages fails, rather than only
+// when the last one does
+bool pipefail = false;
+
+// Whether external commands are started with posix_spawn rather than fork
+bool use_spawn = true;
 
-// Currently assigned aliases
-map<string, string> aliases;
+// Whether a glob pattern that matches nothing is dropped, or is an error,
+// rather than passed on as it is
+bool nullglob = false;
+bool failglob = false;
 
-// Current job number to assign to a backgrounded command
-int jobnumber = 0;
+// Shell options that can be switched with the set built-in
+map<string, bool*> options;
+
+
+// Replaces the current process with the external command, found at the given
+// full path (from hash_lookup), with the environment envp. If that is missing,
+// $PATH is searched afresh. Only meant to be called in a child process; never
+// returns.
+void exec_external_command(vector<string_view>& words,
+                           const string& fullpath, char** envp) {
+  // point the exec arguments straight at the words
+  vector<char*> argv = build_argv(words);
+  // call the exec syscall, directly on the hashed path if there is one
+  if (!fullpath.empty()) {
+    execve(fullpath.c_str(), &argv[0], envp);
+  }
+  if (fullpath.empty() || errno == ENOENT) {
+    execvpe(argv[0], &argv[0], envp);
+  }
+  // if we get here, there was an error
+  perror(argv[0]);
+  exit(EXIT_NOT_FOUND);
+}
+
+
+// Drops a command from the hash if its child couldn't exec it, so the next
+// run searches $PATH again.
+void check_hashed_command(const string& progname, int status) {
+  if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_NOT_FOUND) {
+    hash_forget(progname);
+  }
+}
 
 
-// Handles external commands, redirects, and pipes.
-int execute_external_command(vector<string> tokens) {
-  // Get the program name
-  string progname = tokens[0];
-  // convert args into a char** structure for the exec call
-  char** argv = new char*[tokens.size() + 1]; // need a null at the end
-  for (int i = 0; i < tokens.size(); i++) {
-    argv[i] = new char[tokens[i].size() + 1];
-    strcpy(argv[i], tokens[i].c_str());
+// Starts an external command in a child process, with its stdin and stdout
+// taken from in_fd and out_fd (or inherited when they are -1) and then its
+// redirections applied, in process group pgid (0 for a new one, -1 for the
+// shell's own), with the environment envp. Uses posix_spawn unless the spawn
+// option is off, in which case it forks and execs. Returns the pid of the
+// child, or -1 if it couldn't be started.
+int start_external_command(vector<string_view>& words, int in_fd, int out_fd,
+                           const redirect_plan& plan, int pgid, char** envp) {
+  // Flush so the child doesn't inherit (and repeat) buffered output
+  cout.flush();
+
+  if (use_spawn) {
+    trace_span span("posix_spawn", words[0]);
+    int cpid = spawn_command(words, in_fd, out_fd, plan,
+                             job_control ? pgid : -1, envp);
+    if (cpid == -1) perror(words[0].data());
+    return cpid;
   }
-  argv[tokens.size()] = NULL;
+
+  // Look the program up here, so the hash outlives the child
+  string fullpath = hash_lookup(string(words[0]));
   // Fork and execute the command in the child
   int cpid;
+  double forked_at = tracing ? trace_now() : 0;
   if ((cpid = fork()) == -1) {
     perror("fork");
     return -1;
   }
   if (cpid == 0) {
-    //child, call the exec syscall
-    execvp(progname.c_str(), argv);
-    // if we get here, there was an error
-    perror("execve");
-    exit(1);
-    return -1;
-  } else {
-    //parent, wait for the child to finish
-    int status;
-    if (wait(&status) == -1) {
-      perror("wait");
-      return -1;
-    }
-    return status;
+    //child, hook up stdin and stdout and call the exec syscall
+    job_child_setup(pgid);
+    if (in_fd != -1) dup2(in_fd, STDIN_FILENO);
+    if (out_fd != -1) dup2(out_fd, STDOUT_FILENO);
+    redirect_apply(plan);
+    trace_instant("execv", words[0]);
+    exec_external_command(words, fullpath, envp);
   }
+  trace_complete("fork", forked_at, trace_now(), words[0]);
+  // set the group from here too, in case the child hasn't yet
+  if (job_control && pgid != -1) setpgid(cpid, pgid ? pgid : cpid);
+  return cpid;
 }
 
 
-// Return a string representing the prompt to display to the user. It needs to
-// include the current working directory and should also use the return value to
-// indicate the result (success or failure) of the last command.
-string get_prompt(int return_value) {
-  if (return_value != 0) {
-      return pwd() + " :( $ ";
+// Runs an external command to completion, with the built-in's stdin and
+// stdout, for built-ins that leave the options they don't support to the
+// real program. Returns its exit status.
+int run_external_command(vector<string>& tokens, builtin_io& io) {
+  vector<string_view> words(tokens.begin(), tokens.end());
+  // Whatever the built-in has written so far comes first
+  io.out.flush();
+  redirect_plan plan;
+  if (io.err_fd != STDERR_FILENO) {
+    fd_action errors = { STDERR_FILENO, io.err_fd };
+    plan.actions.push_back(errors);
+  }
+  // This may be on a thread, so it gets an environment of its own
+  vector<string> text;
+  vector<char*> envp = variables_environment_copy(text);
+  int cpid = start_external_command(words, io.in_fd, io.out_fd, plan, -1,
+                                    &envp[0]);
+  if (cpid == -1) return EXIT_NOT_FOUND;
+  int status;
+  while (waitpid(cpid, &status, 0) == -1) {
+    if (errno != EINTR) return EXIT_NOT_FOUND;
   }
-  return pwd() + " :) $ ";
+  check_hashed_command(tokens[0], status);
+  return exit_code(status);
+}
+
+
+// Return a string representing the prompt to display to the user, built from
+// the format in $PS1. By default it includes the current working directory and
+// uses the return value to indicate the result (success or failure) of the
+// last command.
+string get_prompt(int return_value, double seconds) {
+  const char* format = lookup_variable("PS1");
+  return prompt_expand(format ? format : DEFAULT_PROMPT, return_value,
+                       seconds);
 }
 
 
@@ -147,81 +265,28 @@ char* environment_completion_generator(const char* text, int state) {
 }
 
 
-// Fills the passed vector with programs in the $PATH variable
-void getPathPrograms(vector<string>& matches) {
-  // Get the path string
-  string path;
-  for (int i = 0; environ[i]; i++) {
-    path = environ[i];
-    if (path.substr(0,4) == "PATH") { 
-      break;
-    }
-  }
-  // Check we found it
-  if (path.substr(0,4) != "PATH") return;
-  // Split up the path into the directories
-  path = path.substr(5);
-  vector<string> dirStrings;
-  size_t i;
-  while ((i = path.find(":")) != string::npos) {
-    dirStrings.push_back(path.substr(0,i));
-    path = path.substr(i+1);
-  }
-  // For each directory, add all progs to matches
-  for (int i = 0; i < dirStrings.size(); i++) {
-    DIR* dir = opendir(dirStrings[i].c_str());
-    // dont continue if there was an error
-    if (!dir) continue;
-    // Iterate over progs in the directory
-    for (dirent* cur = readdir(dir); cur; cur = readdir(dir)) {
-      // Dont push . or ..
-      if ((string)cur->d_name != ".." && (string)cur->d_name != ".")
-        matches.push_back(cur->d_name);
-    }
-    closedir(dir);
-  }  
-}
-
-
 // Generates commands for readline completion. This function will be called
 // multiple times by readline and will return a single cstring each time.
 char* command_completion_generator(const char* text, int state) {
-  // A list of all the matches;
+  // The range of the completion index still to be returned;
   // Must be static because this function is called repeatedly
-  static vector<string> matches;
+  static size_t next, last;
 
-  // If this is the first time called, construct the matches list with
-  // all possible matches
+  // If this is the first time called, find the range of names that start
+  // with the text
   if (state == 0) {
-    // Fill with all $PATH progs and commands
-    // Commands...
-    typedef map<string, command>::iterator it;
-    for (it i = builtins.begin(); i != builtins.end(); i++) {
-      matches.push_back(i->first); 
-    }
-    // PATH progs...
-    getPathPrograms(matches);
-
-    // Check for a tab with no text
-    if (text[0] == '\0') {
-      return pop_match(matches);
-    }
-
-    // Iterate over the text, remove all invalid matches
-    int testpos = 0;
-    while (text[testpos] && matches.size() > 0) {
-      for (int i = 0; i < matches.size(); i++) {
-        if (matches[i][testpos] != text[testpos]) {
-          matches.erase(matches.begin() + i);
-          i--; //adjust for the shifting of the vector
-        } 
-      }
-      testpos++;
-    }
+    completion_index_refresh();
+    pair<size_t, size_t> range = completion_index_range(text);
+    next = range.first;
+    last = range.second;
   }
 
   // Return a single match (one for each time the function is called)
-  return pop_match(matches);
+  if (next < last) {
+    // readline deallocates the copy when done
+    return strdup(completion_index()[next++].c_str());
+  }
+  return NULL;
 }
 
 
@@ -245,374 +310,1084 @@ char** word_completion(const char* text, int start, int end) {
 }
 
 
-// Transform a C-style string into a C++ vector of string tokens, delimited by
-// whitespace.
-vector<string> tokenize(const char* line) {
-  vector<string> tokens;
-  string token;
+// Closes every descriptor in the list of pipe ends.
+void close_pipes(vector<int>& fds) {
+  for (int i = 0; i < fds.size(); i++) {
+    if (fds[i] != -1) close(fds[i]);
+  }
+}
 
-  // istringstream allows us to treat the string like a stream
-  istringstream token_stream(line);
 
-  while (token_stream >> token) {
-    tokens.push_back(token);
+// Joins the words of a command back together
+string command_text(simple_command& cmd) {
+  string text;
+  for (int k = 0; k < cmd.argv.size(); k++) {
+    if (k > 0) text += " ";
+    text += cmd.argv[k];
   }
+  return text;
+}
 
-  // Search for quotation marks, which are explicitly disallowed
-  for (size_t i = 0; i < tokens.size(); i++) {
 
-    if (tokens[i].find_first_of("\"'`") != string::npos) {
-      cerr << "\", ', and ` characters are not allowed." << endl;
+// Joins the commands of a pipeline back into a command line, for job
+// listings
+string pipeline_text(pipeline& line) {
+  string text;
+  for (int i = 0; i < line.commands.size(); i++) {
+    if (i > 0) text += " | ";
+    text += command_text(line.commands[i]);
+  }
+  return text;
+}
+
 
-      tokens.clear();
+// Reports what a timed pipeline used, from its processes' usages and, for a
+// built-in run in the shell, what the shell used meanwhile
+void report_pipeline_usage(pipeline& line, double started,
+                           const vector<int>& statuses,
+                           const vector<struct rusage>& usages,
+                           const struct rusage& builtin_usage,
+                           int return_value) {
+  command_usage total;
+  total.text = pipeline_text(line);
+  total.real = monotonic_seconds() - started;
+  memset(&total.usage, 0, sizeof(total.usage));
+  total.status = return_value;
+
+  vector<command_usage> stages(line.commands.size());
+  for (int i = 0; i < stages.size(); i++) {
+    stages[i].text = command_text(line.commands[i]);
+    stages[i].real = total.real;
+    if (i < statuses.size()) {
+      // A stage that never started used nothing
+      memset(&stages[i].usage, 0, sizeof(stages[i].usage));
+      if (i < usages.size()) stages[i].usage = usages[i];
+      stages[i].status = exit_code(statuses[i]);
+    } else {
+      stages[i].usage = builtin_usage;
+      stages[i].status = return_value;
     }
+    add_usage(total.usage, stages[i].usage);
   }
+  report_usage(lookup_variable("TIMEFORMAT"), total, stages);
+}
+
 
-  return tokens;
+// What a built-in running on a thread leaves behind
+struct builtin_result {
+  int status;
+  struct rusage usage;
+};
+
+
+// Finds the built-in a command names, or builtins.end() for external ones
+map<string, builtin>::iterator find_builtin(simple_command& cmd) {
+  if (cmd.argv.empty()) return builtins.end();
+  return builtins.find(string(cmd.argv[0]));
 }
 
 
-// Splits the vector of tokens by pipe characters.
-// Returns of new token vectors without the pipe characters
-// If the location of pipes is not valid, returns an empty structure
-vector< vector<string> > splitByPipes(vector<string> tokens) {
-  // Vector of split portions
-  vector< vector<string> > ret;
-  // search for pipes until all processed
-  while(true) {
-    int pipepos;
-    // Search for a pipe pos
-    for ( pipepos = 0; pipepos < tokens.size(); pipepos++ ) {
-      if (tokens[pipepos] == "|")
-        break;
-    }
+// The streams a built-in writes its output and errors through. Setting them
+// up costs more than a quick built-in like : or [ takes to run, so each
+// thread keeps its own from one built-in to the next.
+struct builtin_streams {
+  fd_buffer out_buffer;
+  fd_buffer err_buffer;
+  ostream out;
+  ostream err;
+  // Set while a built-in is using them
+  bool busy;
 
-    // Check for invalid pipe positions
-    if (pipepos == 0 || pipepos == tokens.size() - 1) {
-      // Clear out to signal an error
-      ret.clear();
-      return ret;
-    } 
-    // if we didn't find another pipe
-    else if (pipepos == tokens.size())
-      break;
+  builtin_streams() : out_buffer(STDOUT_FILENO), err_buffer(STDERR_FILENO),
+                      out(&out_buffer), err(&err_buffer), busy(false) {
+  }
+};
 
-    // Position is good, split off the tokens up to the pipe
-    vector<string> command;
-    for ( int i = 0; i < pipepos; i++ ) {
-      command.push_back(tokens[0]);
-      tokens.erase(tokens.begin());
-    }
-    // Erase the pipe char
-    tokens.erase(tokens.begin());
 
-    // Add the split off command
-    ret.push_back(command);
-  } 
-  // add remaining tokens as last command
-  ret.push_back(tokens);
-  return ret;
+// Puts a stream back as it was made, for the next built-in to use
+static void reset_stream(ostream& stream) {
+  stream.clear();
+  stream.flags(ios_base::dec | ios_base::skipws);
+  stream.width(0);
+  stream.precision(6);
+  stream.fill(' ');
 }
 
 
-// Searches for a redirection token, if found, splits off token and file from vector
-// Sets up the file descriptors appropriately
-// If no token found, returns a -2, if an error occurs, returns -1
-int redirectionScan(vector<string>& tokens) {
-  // Scan from the back end to get the last char
-  int i;
-  for (i = tokens.size() - 1; i >= 0; i--) {
-    if (tokens.at(i) == ">" || tokens.at(i) == "<" || tokens.at(i) == ">>")
-      break;
+// Invokes a built-in on the tokens, reading from in_fd and writing to out_fd
+// and err_fd, and flushes what it wrote before returning its status. text
+// describes the command in a trace.
+int run_builtin(command fn, vector<string>& tokens, string_view text,
+                int in_fd, int out_fd, int err_fd) {
+  trace_span span("builtin", text);
+  // A built-in started while another is running on the thread, as in a
+  // child forked from one, gets streams of its own
+  thread_local builtin_streams kept;
+  unique_ptr<builtin_streams> own;
+  builtin_streams* streams = &kept;
+  if (kept.busy) {
+    own.reset(new builtin_streams());
+    streams = own.get();
   }
-  // If didn't find one
-  if (i == -1) return -2;
-  // Ensure the position of the redirect token makes sense
-  if (i == 0 || i != tokens.size() - 2) {
-    cerr << "Invalid file redirection\n";
-    return -1;
-  } 
-
-  // Set up file descriptor appropriately
-  string redirect = tokens[i];
-  string filestring = tokens[i + 1]; 
-  // Erase both tokens
-  tokens.erase(tokens.begin() + i);
-  tokens.erase(tokens.begin() + i); 
-  
-  int descriptor;
-  // Sets file permissions
-  mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
-  if (redirect == "<") {
-    // Check to make sure not used with a pipe since that doesn't make sense
-    if (splitByPipes(tokens).size() > 1) {
-      cerr << "Invalid combination of pipes and file redirection\n";
+  streams->busy = true;
+  streams->out_buffer.reset(out_fd);
+  streams->err_buffer.reset(err_fd);
+  builtin_io io = { in_fd, out_fd, err_fd, streams->out, streams->err };
+  int return_value = (*fn)(tokens, io);
+  streams->out.flush();
+  streams->err.flush();
+  reset_stream(streams->out);
+  reset_stream(streams->err);
+  streams->busy = false;
+  return return_value;
+}
+
+
+// Invokes a built-in with the command's words as its tokens.
+int run_builtin(command fn, simple_command& cmd, int in_fd, int out_fd,
+                int err_fd) {
+  vector<string> tokens(cmd.argv.begin(), cmd.argv.end());
+  return run_builtin(fn, tokens, tracing ? command_text(cmd) : "", in_fd,
+                     out_fd, err_fd);
+}
+
+
+// Runs every stage of a pipeline at the same time, each connected to the next
+// by its own pipe. All pipes are created before anything is started, and each
+// stage uses only its own ends, so the shell's descriptors are left alone.
+// A stage's redirections are applied after its pipes, in its own process or
+// as spawn file actions; a built-in in the shell or on a thread is handed
+// the descriptors they give instead. A stage whose redirections fail isn't
+// started, and fails.
+// External stages are spawned. Built-ins that use the shell's own state are
+// forked before the last stage, so they can't change it; the others run on
+// threads in the shell, reading and writing their pipes directly. A
+// built-in in the last stage runs in the shell itself, as it would without
+// pipes. A pipeline going in the background forks all of its built-ins, as
+// does one whose first stage would read from the terminal, which Ctrl-C
+// could leave a thread waiting on. All of the processes share a process
+// group and make up one job.
+// The last stage writes to output, or to stdout if that is -1. A pipeline
+// whose output is taken elsewhere runs as a subshell would, so a built-in
+// using the shell's state is forked even in the last stage. stopped is set
+// if the pipeline stops and becomes a job instead of finishing.
+// Returns the exit status of the last stage or, with the pipefail option, of
+// the last stage that failed. Returns -1 if the pipes couldn't be made.
+int execute_pipeline(pipeline& line, int output, bool& stopped) {
+  vector<simple_command>& stages = line.commands;
+  int count = stages.size();
+  // pipe i connects stage i (write end, fds[2i+1]) to stage i+1 (fds[2i]).
+  // They are close-on-exec, so only the ends a child dup2s survive its exec.
+  vector<int> fds(2 * (count - 1), -1);
+  for (int i = 0; i < count - 1; i++) {
+    if (pipe2(&fds[2 * i], O_CLOEXEC) == -1) {
+      perror("pipe");
+      close_pipes(fds);
       return -1;
     }
-    descriptor = open(filestring.c_str(), O_RDONLY, mode);
   }
-  else if (redirect == ">")
-    descriptor = open(filestring.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode); 
-  else if (redirect == ">>")
-    descriptor = open(filestring.c_str(), O_WRONLY | O_APPEND | O_CREAT, mode);
 
-  // Check for error
-  if (descriptor == -1) { 
-    perror("open error");
-    return -1;
+  // A built-in at the end of the line stays in the shell. exec only replaces
+  // the shell on its own; at the end of a pipeline it replaces a copy, or it
+  // would take the other stages' threads down with it.
+  map<string, builtin>::iterator last = find_builtin(stages[count - 1]);
+  stopped = false;
+  bool in_shell = last != builtins.end() && !line.background &&
+                  !(output != -1 && last->second.shell_state) &&
+                  !(count > 1 && last->second.function == &com_exec);
+  int started = in_shell ? count - 1 : count;
+
+  // Flush so no child inherits (and repeats) buffered output
+  cout.flush();
+
+  // A timed pipeline is measured from before anything starts
+  double started_at = line.timed ? monotonic_seconds() : 0;
+
+  // Start every stage that needs its own process. A stage that can't be
+  // started is left as -1 and counts as failed, unless it had no words at
+  // all. The first process started leads the process group. Stages for
+  // threads are left as -1 too, and started once every process has been, so
+  // no child inherits a pipe end a thread has closed and the shell reused.
+  vector<int> pids;
+  vector<int> statuses;
+  vector<int> threaded;
+  vector<redirect_plan> plans(count);
+  int pgid = 0;
+  for (int i = 0; i < started; i++) {
+    int in_fd = (i > 0) ? fds[2 * (i - 1)] : -1;
+    int out_fd = (i < count - 1) ? fds[2 * i + 1] : output;
+
+    string error;
+    bool opened = redirect_open(stages[i], plans[i], error);
+    if (!opened) cerr << error << endl;
+
+    map<string, builtin>::iterator cmd = find_builtin(stages[i]);
+    int cpid = -1;
+    if (stages[i].argv.empty() || !opened) {
+      cpid = -1;
+    }
+    else if (cmd == builtins.end()) {
+      // The shell's environment is shared unless the command has its own
+      // assignments in front
+      vector<char*> envp;
+      if (!stages[i].environment.empty()) {
+        envp = command_environment(stages[i].environment);
+      }
+      cpid = start_external_command(stages[i].argv, in_fd, out_fd, plans[i],
+                                    pgid, envp.empty() ? variables_environment()
+                                                       : &envp[0]);
+    }
+    else if (!cmd->second.shell_state && !line.background &&
+             !(i == 0 && isatty(STDIN_FILENO))) {
+      threaded.push_back(i);
+    }
+    // Any other built-in needs a copy of the shell to run in
+    else {
+      double forked_at = tracing ? trace_now() : 0;
+      if ((cpid = fork()) == -1) {
+        perror("fork");
+      }
+      else if (cpid == 0) {
+        // child, hook stdin and stdout up to the neighbouring pipes
+        job_child_setup(pgid);
+        if (in_fd != -1) dup2(in_fd, STDIN_FILENO);
+        if (out_fd != -1) dup2(out_fd, STDOUT_FILENO);
+        // the other stages' ends must be closed, or readers never see EOF
+        close_pipes(fds);
+        redirect_apply(plans[i]);
+        exit(run_builtin(cmd->second.function, stages[i], STDIN_FILENO,
+                         STDOUT_FILENO, STDERR_FILENO));
+      }
+      else {
+        trace_complete("fork", forked_at, trace_now(), stages[i].argv[0]);
+        if (job_control) setpgid(cpid, pgid ? pgid : cpid);
+      }
+    }
+    if (cpid != -1 && pgid == 0) pgid = cpid;
+    pids.push_back(cpid);
+    // A thread closes its stage's files itself, once it's done
+    bool on_thread = !threaded.empty() && threaded.back() == i;
+    if (!on_thread) redirect_close(plans[i]);
+    bool finished = stages[i].argv.empty() || on_thread;
+    statuses.push_back(!opened ? 1 << 8
+                               : finished ? 0 : STATUS_NOT_STARTED);
   }
 
-  // Swap out the file descriptor for STDIN or STDOUT
-  if (redirect == ">" || redirect == ">>") {
-    dup2(descriptor, STDOUT_FILENO);
+  // Each thread takes its own pipe ends, which it closes when it is done,
+  // and everything it uses is copied, so it can outlive the line if the
+  // rest of the pipeline stops and becomes a job
+  vector<thread> threads;
+  vector<shared_ptr<builtin_result> > results;
+  for (int t = 0; t < threaded.size(); t++) {
+    int i = threaded[t];
+    int in_fd = (i > 0) ? fds[2 * (i - 1)] : -1;
+    int out_fd = fds[2 * i + 1];
+    if (i > 0) fds[2 * (i - 1)] = -1;
+    fds[2 * i + 1] = -1;
+    command fn = find_builtin(stages[i])->second.function;
+    vector<string> tokens(stages[i].argv.begin(), stages[i].argv.end());
+    string text = tracing ? command_text(stages[i]) : "";
+    redirect_plan plan = plans[i];
+    shared_ptr<builtin_result> result = make_shared<builtin_result>();
+    results.push_back(result);
+    threads.push_back(job_thread_start([=]() mutable {
+      int in = in_fd != -1 ? in_fd : STDIN_FILENO;
+      int out = out_fd;
+      int err = STDERR_FILENO;
+      redirect_builtin(plan, in, out, err);
+      struct rusage before = self_usage();
+      result->status = run_builtin(fn, tokens, text, in, out, err);
+      result->usage = usage_since(before, self_usage());
+      if (in_fd != -1) close(in_fd);
+      close(out_fd);
+      redirect_close(plan);
+    }));
   }
-  else if (redirect == "<") {
-    dup2(descriptor, STDIN_FILENO);
+
+  // A background pipeline just goes in the job table
+  if (line.background) {
+    close_pipes(fds);
+    int number = job_add(pgid, pids, pipeline_text(line) + " &", JOB_RUNNING);
+    cout << "[" << number << "] " << pgid << endl;
+    return 0;
   }
 
-  // close it
-  close(descriptor); 
-  return descriptor;
+  int return_value = 0;
+  struct rusage builtin_usage;
+  if (started < count) {
+    // The final built-in reads from the last pipe, and every other end must
+    // be closed first, or it would never see the end of its input
+    int in_fd = STDIN_FILENO;
+    if (count > 1) {
+      in_fd = fds[2 * (count - 2)];
+      fds[2 * (count - 2)] = -1;
+    }
+    close_pipes(fds);
+    // The processes before it get the terminal now rather than once it is
+    // done, or one reading from it would be stopped
+    if (job_control && pgid > 0) tcsetpgrp(STDIN_FILENO, pgid);
+    // Only a timed pipeline needs what the built-in used, which costs two
+    // system calls that a loop of built-ins would notice
+    struct rusage before;
+    if (line.timed) before = self_usage();
+    redirect_plan& plan = plans[count - 1];
+    string error;
+    if (!redirect_open(stages[count - 1], plan, error)) {
+      cerr << error << endl;
+      return_value = 1;
+    } else {
+      int in = in_fd;
+      int out = output != -1 ? output : STDOUT_FILENO;
+      int err = STDERR_FILENO;
+      // exec's redirections are for the shell itself, from now on
+      if (last->second.function == &com_exec) {
+        redirect_shell(plan, NULL);
+      } else {
+        redirect_builtin(plan, in, out, err);
+      }
+      return_value = run_builtin(last->second.function, stages[count - 1],
+                                 in, out, err);
+      redirect_close(plan);
+    }
+    if (line.timed) builtin_usage = usage_since(before, self_usage());
+    if (in_fd != STDIN_FILENO) close(in_fd);
+  }
+  close_pipes(fds);
+
+  // Wait for the whole pipeline, which may stop and become a job instead,
+  // leaving its threads to carry on when it does. A lone built-in started no
+  // process and has nothing to wait for.
+  vector<struct rusage> usages;
+  bool done = pgid <= 0 ||
+              wait_for_foreground(pgid, pids, statuses, pipeline_text(line),
+                                  &usages);
+  stopped = !done;
+  if (done) usages.resize(pids.size());
+  for (int t = 0; t < threads.size(); t++) {
+    if (!done) {
+      threads[t].detach();
+      continue;
+    }
+    threads[t].join();
+    statuses[threaded[t]] = results[t]->status << 8;
+    usages[threaded[t]] = results[t]->usage;
+  }
+
+  int pipefail_value = 0;
+  for (int i = 0; i < pids.size(); i++) {
+    if (pids[i] != -1) {
+      check_hashed_command(string(stages[i].argv[0]), statuses[i]);
+    }
+    int code = exit_code(statuses[i]);
+    if (i == count - 1) return_value = code;
+    if (code != 0) pipefail_value = code;
+  }
+  if (started < count && return_value != 0) {
+    pipefail_value = return_value;
+  }
+  if (pipefail) return_value = pipefail_value;
+
+  if (line.timed) {
+    report_pipeline_usage(line, started_at, statuses, usages, builtin_usage,
+                          return_value);
+  }
+  return return_value;
 }
 
 
-// Executes the command to write to a pipe.  Returns the file descriptor for
-// the read end so it can be fed to another command.
-// Returns -1 if there was an error.
-int piped_execution(vector<string>& tokens) {
-  // Declare pipe
-  int the_pipe[2];
-  int cpid;
+// Whether an expanded pipeline has no command to run, only assignments or
+// words that expanded to nothing
+static bool no_command(const pipeline& line) {
+  return line.commands.empty() ||
+         (line.commands.size() == 1 && line.commands[0].argv.empty());
+}
 
-  // open up the pipe
-  if (pipe(the_pipe) == -1) {
-    perror("pipe");
-    return -1;
-  }
-  
-  // Fork to execute in the child process
-  if ((cpid = fork()) == -1) {
-    perror("fork");
-    // close pipe for good measure
-    close(the_pipe[0]);
-    close(the_pipe[1]);
-    return -1;
+
+// Executes an expanded pipeline as execute_line does, with the last stage
+// writing to output (-1 for stdout) as in execute_pipeline.
+static int execute_line_to(pipeline& line, int output, bool& stopped) {
+  stopped = false;
+  // Nothing to run, e.g. a line that only assigned variables. A time on its
+  // own reports nothing used.
+  if (no_command(line)) {
+    if (line.timed) {
+      vector<int> none;
+      struct rusage unused;
+      memset(&unused, 0, sizeof(unused));
+      line.commands.clear();
+      report_pipeline_usage(line, monotonic_seconds(), none,
+                            vector<struct rusage>(), unused, 0);
+    }
+    return 0;
   }
 
-  if (cpid == 0) {
-    close(the_pipe[0]);
-    // replace stdout with the write end of the pipe, execute the command
-    int backupfd = dup(STDOUT_FILENO);
-    dup2(the_pipe[1], STDOUT_FILENO);
-    //execute
-    map<string, command>::iterator cmd = builtins.find(tokens[0]);
-    int return_value;
-    if (cmd == builtins.end()) {
-      return_value = execute_external_command(tokens);
-    } else {
-      return_value = ((*cmd->second)(tokens));
+  // Run all of the stages concurrently
+  return execute_pipeline(line, output, stopped);
+}
+
+
+// Executes an expanded pipeline, either in the foreground or as a background
+// job. Built-ins are invoked directly unless the line goes in the background.
+// Returns the exit status of the line.
+int execute_line(pipeline& line) {
+  bool stopped;
+  return execute_line_to(line, -1, stopped);
+}
+
+
+// Returns the value of a shell or environment variable, or NULL if it isn't
+// set.
+const char* lookup_variable(string_view name) {
+  return variable_get(name);
+}
+
+
+// Appends the value of a special parameter: $?, $#, $$, $* or $@ (the
+// positional parameters joined by spaces), $0 or a positional one like $1.
+// Returns false if the name isn't one of them.
+static bool expand_special(string_view name, string& result) {
+  if (name == "?") {
+    result += to_string(last_status);
+  } else if (name == "#") {
+    result += to_string(positional_parameters.size());
+  } else if (name == "$") {
+    result += to_string(getpid());
+  } else if (name == "*" || name == "@") {
+    for (int i = 0; i < positional_parameters.size(); i++) {
+      if (i > 0) result += ' ';
+      result += positional_parameters[i];
+    }
+  } else if (isdigit(name[0])) {
+    size_t n = 0;
+    for (size_t i = 0; i < name.size(); i++) {
+      if (!isdigit(name[i])) return false;
+      n = n * 10 + (name[i] - '0');
+    }
+    if (n == 0) {
+      result += shell_name;
+    } else if (n <= positional_parameters.size()) {
+      result += positional_parameters[n - 1];
     }
+  } else {
+    return false;
+  }
+  return true;
+}
 
-    // restore stdout
-    dup2(backupfd, STDOUT_FILENO);
-    close(backupfd);
-    close(the_pipe[1]);
-    exit(return_value);
+
+// Appends the value of the variable named at text[i] (just past a $), either
+// as $name or ${name}, and returns the index after the name. A $ without a
+// name is kept as it is.
+size_t expand_variable(string_view text, size_t i, string& result) {
+  size_t start = i, end;
+  if (i < text.size() && text[i] == '{') {
+    end = text.find('}', i);
+    if (end == string_view::npos) {
+      result += '$';
+      return i;
+    }
+    start = i + 1;
+    i = end + 1;
+  } else if (i < text.size() && strchr("?#$*@0123456789", text[i])) {
+    // Special parameters, and positional ones past $9, are one character
+    end = ++i;
   } else {
-    // parent, wait for child and then return descriptor to the read end so
-    // it can be passed along
-    close(the_pipe[1]);
-    int status;
-    if(wait(&status) == -1)
-      perror("wait");
+    while (i < text.size() && (isalnum(text[i]) || text[i] == '_')) i++;
+    end = i;
+  }
+  if (end == start) {
+    result += '$';
+    return i;
+  }
+  string_view name = text.substr(start, end - start);
+  if (expand_special(name, result)) return i;
+  const char* value = lookup_variable(name);
+  if (value) result += value;
+  return i;
+}
 
-    return the_pipe[0];
+
+// Appends text that came from quotes or an expansion. In a glob pattern, the
+// characters that would match more than themselves are escaped.
+static void append_literal(string& result, string_view text, bool pattern) {
+  if (!pattern) {
+    result.append(text);
+    return;
+  }
+  for (size_t i = 0; i < text.size(); i++) {
+    if (string_view("*?[]\\").find(text[i]) != string_view::npos) {
+      result += '\\';
+    }
+    result += text[i];
   }
 }
 
 
-// Executes a line of input by either calling execute_external_command or
-// directly invoking the built-in command.
-int execute_line(vector<string>& tokens, map<string, command>& builtins) {
-  int return_value = 0; 
+static void expand_fields(const word& w, bool split, bool pattern,
+                          vector<string>& fields, int* status = NULL);
 
-  if (tokens.size() != 0) {
-    // Setup file redirection on the last command
-    int descriptor = redirectionScan(tokens);
-    if (descriptor == -1) return -1; 
 
-    // Split the line by pipes
-    vector< vector<string> > splitline = splitByPipes(tokens);
-    // Check for any invalid pipes
-    if (splitline.size() == 0) {
-      cerr << "Invalid pipes\n";
-      return -1;
+// Evaluates the expression of a $((...)), once the variables and
+// substitutions in it are expanded, and appends its value. An error is
+// reported, and appends nothing.
+static void expand_arithmetic(string_view expression, string& result) {
+  word w = { expression, WORD_QUOTED | WORD_DOLLAR };
+  vector<string> fields;
+  expand_fields(w, false, false, fields);
+  long long value;
+  string error;
+  if (!arith_evaluate(fields.empty() ? "" : fields[0], value, error)) {
+    cerr << error << endl;
+    return;
+  }
+  result += to_string(value);
+}
+
+
+// Whether the $ at text[i] starts a $((...)) rather than a command
+// substitution. end is set past its closing parentheses.
+static bool starts_arithmetic(string_view text, size_t i, size_t& end) {
+  if (text.substr(i, 3) != "$((") return false;
+  end = substitution_end(text, i);
+  return end != string_view::npos && text[end - 2] == ')';
+}
+
+
+// Expands a word as typed into the fields it stands for: variable references
+// are replaced by their values, command substitutions by the output of the
+// command, $((...)) by the value of the expression, and quotes and
+// backslashes are removed. With split, the output of a substitution outside
+// double quotes is broken into fields at blanks, as the tokenizer breaks up a
+// line, and "$@" gives a field for each positional parameter. An unquoted
+// field that expands to nothing is dropped. With pattern, the fields are glob
+// patterns, where only the glob characters typed outside quotes keep their
+// meaning. status is set to the exit status of each command substitution
+// run, if it isn't NULL.
+static void expand_fields(const word& w, bool split, bool pattern,
+                          vector<string>& fields, int* status) {
+  string_view text = w.text;
+  string result;
+  bool quoted = false;
+  bool in_double = false;
+  // Set when a $@ stood for no parameters, which leaves no field even quoted
+  bool no_parameters = false;
+  size_t end;
+  size_t i = 0;
+  while (i < text.size()) {
+    char c = text[i];
+    if (c == '\\' && i + 1 < text.size()) {
+      // In double quotes, a backslash only escapes the special characters
+      if (in_double && string_view("$`\"\\").find(text[i + 1]) ==
+                       string_view::npos) {
+        append_literal(result, text.substr(i, 1), pattern);
+      }
+      append_literal(result, text.substr(i + 1, 1), pattern);
+      i += 2;
+    }
+    else if (c == '\'' && !in_double) {
+      size_t close = text.find('\'', i + 1);
+      append_literal(result, text.substr(i + 1, close - i - 1), pattern);
+      quoted = true;
+      i = close + 1;
+    }
+    else if (c == '"') {
+      in_double = !in_double;
+      quoted = true;
+      i++;
+    }
+    else if (c == '$' && starts_arithmetic(text, i, end)) {
+      string value;
+      expand_arithmetic(text.substr(i + 3, end - i - 5), value);
+      append_literal(result, value, pattern);
+      i = end;
+    }
+    else if (c == '$' && split && (text.substr(i + 1, 1) == "@" ||
+                                   text.substr(i + 1, 3) == "{@}")) {
+      for (int p = 0; p < positional_parameters.size(); p++) {
+        if (p > 0) {
+          fields.push_back(result);
+          result.clear();
+        }
+        append_literal(result, positional_parameters[p], pattern);
+      }
+      if (positional_parameters.empty()) no_parameters = true;
+      i += text[i + 1] == '@' ? 2 : 4;
+    }
+    else if (c == '$' && i + 1 < text.size() && text[i + 1] == '(' &&
+             (end = substitution_end(text, i)) != string_view::npos) {
+      string output;
+      int ran = command_substitution(text.substr(i + 2, end - i - 3), output);
+      if (status) *status = ran;
+      i = end;
+      if (!split || in_double) {
+        append_literal(result, output, pattern);
+        continue;
+      }
+      for (size_t o = 0; o < output.size(); o++) {
+        if (!is_blank(output[o])) {
+          append_literal(result, string_view(output).substr(o, 1), pattern);
+        } else if (!result.empty() || quoted) {
+          fields.push_back(result);
+          result.clear();
+          quoted = false;
+        }
+      }
+    }
+    else if (c == '$' && pattern) {
+      string value;
+      i = expand_variable(text, i + 1, value);
+      append_literal(result, value, pattern);
+    }
+    else if (c == '$') {
+      i = expand_variable(text, i + 1, result);
     }
-    // Pipes are good to go
     else {
-      // Execute each piece of the split with appropriate file descriptors
-
-      // Iterate over all parts of the command except the last
-      for (int i = 0; i < splitline.size() - 1; i++) {
-        // execute command in a child process, get the descriptor for
-        // the pipes read end back
-        int readfd = piped_execution(splitline[i]);
-        // check for error
-        if (readfd == -1) return -1;
-        // set stdin to this fd
-        dup2(readfd, STDIN_FILENO);
-        close(readfd);
+      append_literal(result, text.substr(i, 1), pattern && in_double);
+      i++;
+    }
+  }
+  if (!result.empty() || (quoted && !no_parameters)) fields.push_back(result);
+}
+
+
+// Expands a word as typed into the text it stands for, as one field, setting
+// status as expand_fields does. Returns false if an unquoted word expanded to
+// nothing and should be dropped.
+bool expand_word(const word& w, arena& mem, string_view& expanded,
+                 int* status = NULL) {
+  // Most words have nothing to expand and are used as they are
+  if (w.flags == 0) {
+    expanded = w.text;
+    return true;
+  }
+
+  vector<string> fields;
+  expand_fields(w, false, false, fields, status);
+  if (fields.empty()) return false;
+  expanded = mem.copy(fields[0]);
+  return true;
+}
+
+
+// Expands every word of the pipeline, and the redirection file names, into
+// the words that will be executed: variable references are replaced with
+// their values, or with nothing if they aren't set, command substitutions
+// with the output of the command, split into words unless quoted, and quotes
+// are removed. Words with glob characters are left as patterns for
+// glob_expansion.
+void variable_substitution(pipeline& line, arena& mem, int* status) {
+  vector<string> fields;
+  for (int c = 0; c < line.commands.size(); c++) {
+    simple_command& cmd = line.commands[c];
+    cmd.argv.clear();
+    cmd.argv.reserve(cmd.words.size());
+    cmd.patterns.clear();
+    for (int i = 0; i < cmd.words.size(); i++) {
+      // Most words have nothing to expand and are used as they are
+      if (cmd.words[i].flags == 0) {
+        cmd.argv.push_back(cmd.words[i].text);
+        continue;
+      }
+      fields.clear();
+      bool pattern = cmd.words[i].flags & WORD_GLOB;
+      expand_fields(cmd.words[i], true, pattern, fields, status);
+      for (int f = 0; f < fields.size(); f++) {
+        if (pattern) cmd.patterns.push_back(cmd.argv.size());
+        cmd.argv.push_back(mem.copy(fields[f]));
       }
+    }
+    for (int r = 0; r < cmd.redirections.size(); r++) {
+      expand_word(cmd.redirections[r].target, mem, cmd.redirections[r].path,
+                  status);
+    }
+  }
+}
 
-      // The last part doesn't write to a pipe 
-      map<string, command>::iterator cmd = 
-                              builtins.find(splitline[splitline.size() - 1][0]);
 
-      if (cmd == builtins.end()) {
-        return_value = execute_external_command(splitline[splitline.size() - 1]);
-      } else {
-        return_value = ((*cmd->second)(splitline[splitline.size() - 1]));
+// Replaces the glob patterns variable_substitution left in the pipeline with
+// the paths they match, sorted. A pattern that matches nothing is kept as it
+// is, or dropped with the nullglob option; with failglob it is an error, and
+// error says which pattern. Each directory is read once for the whole line.
+// Returns false on an error.
+bool glob_expansion(pipeline& line, arena& mem, string& error) {
+  glob_cache cache;
+  vector<string_view> argv;
+  for (int c = 0; c < line.commands.size(); c++) {
+    simple_command& cmd = line.commands[c];
+    if (cmd.patterns.empty()) continue;
+    argv.clear();
+    int next = 0;
+    for (int a = 0; a < cmd.argv.size(); a++) {
+      if (next == cmd.patterns.size() || cmd.patterns[next] != a) {
+        argv.push_back(cmd.argv[a]);
+        continue;
       }
+      next++;
+      string_view pattern = cmd.argv[a];
+      bool magic = glob_has_magic(pattern);
+      if (magic && glob_expand(pattern, cache, mem, argv) > 0) continue;
+      if (magic && failglob) {
+        error = "no match: " + string(glob_unescape(pattern, mem));
+        return false;
+      }
+      if (!magic || !nullglob) argv.push_back(glob_unescape(pattern, mem));
     }
+    cmd.argv.swap(argv);
+    cmd.patterns.clear();
   }
+  return true;
+}
 
-  return return_value;
+
+// Reads everything from fd into text, which grows to take it, until the end.
+static void read_all(int fd, string& text) {
+  size_t used = text.size();
+  while (true) {
+    if (text.size() - used < CAPTURE_CHUNK) {
+      text.resize(max(2 * text.size(), used + CAPTURE_CHUNK));
+    }
+    ssize_t got = read(fd, &text[used], text.size() - used);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) break;
+    used += got;
+  }
+  text.resize(used);
 }
 
 
-// Substitutes any tokens that start with a $ with their appropriate value, or
-// with an empty string if no match is found.
-void variable_substitution(vector<string>& tokens) {
-  vector<string>::iterator token;
+// Runs an expanded line with the output of its last command going into
+// output rather than to stdout, unless it redirects it. A thread
+// reads the output from a pipe while the line runs, so a built-in in the last
+// stage still runs in the shell itself, writing into the pipe. A line that
+// stops leaves output empty. Returns the exit status of the line.
+static int capture_line(pipeline& line, string& output) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1) {
+    perror("pipe");
+    return 1;
+  }
+  // The reader has its own copy of the text, as it is left behind if the
+  // line stops
+  shared_ptr<string> text = make_shared<string>();
+  int read_fd = fds[0];
+  thread reader([=]() {
+    read_all(read_fd, *text);
+    close(read_fd);
+  });
+
+  // Output the last command redirects elsewhere goes there instead
+  bool stopped;
+  int return_value = execute_line_to(line, fds[1], stopped);
+  close(fds[1]);
+  if (stopped) {
+    reader.detach();
+  } else {
+    reader.join();
+    output.swap(*text);
+  }
+  return return_value;
+}
 
-  for (token = tokens.begin(); token != tokens.end(); ++token) {
 
-    if (token->at(0) == '$') {
-      string var_name = token->substr(1);
+// Calls the function the expanded command names. Its commands run in the
+// shell, so its redirections are the one case that moves the shell's own
+// descriptors, and they are put back afterwards. Returns its exit status.
+static int run_function(simple_command& command, arena& mem) {
+  if (command.redirections.empty()) return call_function(command.argv, mem);
+  redirect_plan plan;
+  string error;
+  if (!redirect_open(command, plan, error)) {
+    cerr << error << endl;
+    return 1;
+  }
+  vector<fd_action> saved;
+  redirect_shell(plan, &saved);
+  redirect_close(plan);
+  int status = call_function(command.argv, mem);
+  redirect_restore(saved);
+  return status;
+}
 
-      if (getenv(var_name.c_str()) != NULL) {
-        *token = getenv(var_name.c_str());
-      } else if (localvars.find(var_name) != localvars.end()) {
-        *token = localvars.find(var_name)->second;
-      } else {
-        *token = "";
-      }
+
+// Runs commands in a forked copy of the shell, a subshell, with its stdout
+// going into output, so whatever they change in the shell is thrown away with
+// it. code is run if given, and otherwise the expanded line, which calls a
+// function. Returns their exit status.
+static int capture_subshell(program* code, pipeline* line, arena& mem,
+                            string& output) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1) {
+    perror("pipe");
+    return 1;
+  }
+  cout.flush();
+  int cpid = fork();
+  if (cpid == -1) {
+    perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return 1;
+  }
+  if (cpid == 0) {
+    // child, what it starts stays in the shell's job, with its output
+    job_child_setup(-1);
+    job_control = false;
+    // and a failure in it is left to the command it is part of, as in bash
+    errexit = false;
+    dup2(fds[1], STDOUT_FILENO);
+    int status;
+    if (code) {
+      status = execute_program(*code, mem);
+    } else {
+      status = run_function(line->commands[0], mem);
     }
+    cout.flush();
+    exit(status);
+  }
+  close(fds[1]);
+  read_all(fds[0], output);
+  close(fds[0]);
+  int status;
+  while (waitpid(cpid, &status, 0) == -1) {
+    if (errno != EINTR) return 1;
   }
+  return exit_code(status);
+}
+
+
+// Expands and runs a pipeline with its output going into output, as
+// command_substitution does for a command that is just one pipeline.
+// Returns its exit status.
+static int capture_pipeline(pipeline& line, arena& mem, string& output) {
+  int substituted = 0;
+  local_variable_assignment(line, mem, &substituted);
+  variable_substitution(line, mem, &substituted);
+  string error;
+  if (!glob_expansion(line, mem, error)) {
+    cerr << error << endl;
+    return 1;
+  }
+
+  // A function runs in a subshell
+  if (line.commands.size() == 1 && !line.commands[0].argv.empty() &&
+      function_defined(line.commands[0].argv[0])) {
+    return capture_subshell(NULL, &line, mem, output);
+  }
+
+  int return_value = capture_line(line, output);
+  if (no_command(line)) return_value = substituted;
+  return return_value;
 }
 
-// Substitutes !! or !N with the command in history using the readline/history library
+
+int command_substitution(string_view command, string& output) {
+  trace_span span("command_substitution", tracing ? command : "");
+  output.clear();
+
+  // parse works in place, so give it a copy of the command
+  string text(command);
+  arena mem;
+  program code;
+  string error;
+  if (!parse(&text[0], mem, code, error)) {
+    cerr << error << endl;
+    return 1;
+  }
+  if (!code.root) return 0;
+
+  // A single pipeline runs as it would at the prompt, and anything more in a
+  // subshell
+  int return_value;
+  if (code.root->type == NODE_PIPELINE && !code.root->line->background) {
+    return_value = capture_pipeline(*code.root->line, mem, output);
+  } else {
+    return_value = capture_subshell(&code, NULL, mem, output);
+  }
+
+  // Trailing newlines are dropped
+  size_t end = output.find_last_not_of('\n');
+  output.erase(end == string::npos ? 0 : end + 1);
+  return return_value;
+}
+
+
+// Substitutes !!, !N or !prefix with the command from the history store, so
+// entries from earlier sessions and other shells can be recalled too
 void history_substitution(char* &line) {
   // check for a bang
   if (line[0] && line[1] && line[0] == '!') {
+    // The first token names the entry
+    size_t length = strcspn(line + 1, " \t");
+    string_view spec(line + 1, length);
+    size_t pos = 0;
     // Check for another bang to replace line with most recent command
-    if (line[1] == '!') {
-      if (history_length > 0) {
-        // Get the most recent command
-        const char* newline = history_get(history_length)->line;
-        // replace line with historical command
-        free(line);
-        line = (char*) malloc(strnlen(newline, 1024) + 1);
-        strcpy(line, newline);
-        line[strnlen(newline, 1024) + 1] = '\0';
-      }
+    if (spec == "!") {
+      pos = history_count();
     }
     // Check for a number to replace with the desired command
     else if (isdigit(line[1])) {
-      // Convert the rest of the first token into a string
-      string numberStr;
-      int i = 1;
-      while (line[i] && line[i] != ' ') {
-        numberStr.push_back(line[i]);
-        i++;
-      }
-      // Get the digit from the string
-      int pos = atoi(numberStr.c_str());
-      // Replace the string with the command if it exists
-      if (pos != 0 && history_length >= pos) {
-        const char* newline = history_get(pos)->line;
-        //replace
-        free(line);
-        line = (char*) malloc(strnlen(newline, 1024) + 1);
-        strcpy(line, newline);
-        line[strnlen(newline, 1024) + 1] = '\0';
-      }
+      pos = atoi(line + 1);
+    }
+    // Otherwise it's the most recent command starting with the prefix
+    else {
+      pos = history_find_prefix(spec);
+    }
+    // Replace the string with the command if it exists
+    string_view newline = history_entry(pos);
+    if (!newline.empty()) {
+      free(line);
+      line = (char*) malloc(newline.size() + 1);
+      memcpy(line, newline.data(), newline.size());
+      line[newline.size()] = '\0';
     }
   }
 }
 
-// Substitutes the first token for its alias if there is one
-void alias_substitution(vector<string>& tokens) {
-  // See if token exists
-  typedef map<string, string>::iterator it;
-  it posptr = aliases.find(tokens[0]);
-  if (posptr != aliases.end()) {
-    // Found an alias, replace the token
-    tokens[0] = posptr->second;
+// Sets a shell variable for each name=value word of a command that only
+// assigns variables. In front of a command, the assignments are kept in its
+// environment instead, and only go to that command's process.
+void local_variable_assignment(pipeline& line, arena& mem, int* status) {
+  for (int c = 0; c < line.commands.size(); c++) {
+    simple_command& command = line.commands[c];
+    vector<word>& assignments = command.assignments;
+    command.environment.clear();
+    for (int i = 0; i < assignments.size(); i++) {
+      size_t eq_pos = assignment_length(assignments[i].text);
+      string_view name = assignments[i].text.substr(0, eq_pos - 1);
+
+      // The value is expanded like any other word
+      word value = { assignments[i].text.substr(eq_pos),
+                     assignments[i].flags };
+      string_view expanded;
+      if (!expand_word(value, mem, expanded, status)) expanded = "";
+
+      if (command.words.empty()) {
+        variable_set(name, expanded, false);
+      } else {
+        string assignment = string(name) + "=" + string(expanded);
+        command.environment.push_back(mem.copy(assignment));
+      }
+    }
   }
 }
 
 
-// Examines each token and sets an env variable for any that are in the form
-// of key=value.
-void local_variable_assignment(vector<string> tokens) {
-  vector<string>::iterator token = tokens.begin();
+int run_pipeline(pipeline& line, arena& mem) {
+  // The status of the last command substitution, for a line without a
+  // command
+  int substituted = 0;
 
-  while (token != tokens.end()) {
-    string::size_type eq_pos = token->find("=");
+  // Handle local variable declarations
+  {
+    trace_span span("local_variable_assignment");
+    local_variable_assignment(line, mem, &substituted);
+  }
 
-    // If there is an equal sign in the token, assume the token is var=value
-    if (eq_pos != string::npos) {
-      string name = token->substr(0, eq_pos);
-      string value = token->substr(eq_pos + 1);
+  // Substitute variable references
+  {
+    trace_span span("variable_substitution");
+    variable_substitution(line, mem, &substituted);
+  }
 
-      localvars[name] = value;
+  // Expand glob patterns into the paths they match
+  bool expanded;
+  string error;
+  {
+    trace_span span("glob_expansion");
+    expanded = glob_expansion(line, mem, error);
+  }
+  if (!expanded) {
+    cerr << error << endl;
+    return 1;
+  }
 
-      token = tokens.erase(token);
-    } else {
-      ++token;
-    }
+  // Execute the line, or call the function it names
+  int return_value;
+  if (line.commands.size() == 1 && !line.background &&
+      !line.commands[0].argv.empty() &&
+      function_defined(line.commands[0].argv[0])) {
+    return_value = run_function(line.commands[0], mem);
+  } else {
+    return_value = execute_line(line);
   }
+  if (no_command(line)) return_value = substituted;
+  return return_value;
 }
 
 
-// Executes command in background, prints the job number and process id
-int background_execute(vector<string>& tokens) {
-  // Fork, execute in child, but do not wait in parent
-  int cpid;
+int run_line(char* text, arena& mem, bool more, bool& incomplete,
+             bool& syntax_error) {
+  // Start afresh for each line
+  mem.reset();
 
-  if ((cpid = fork()) == -1) {
-    perror("fork");
-    return -1;
+  trace_span span("line", tracing ? text : "");
+
+  // Break the raw input into words and build the commands from them
+  program code;
+  string error;
+  bool parsed;
+  {
+    trace_span span("parse");
+    parsed = parse(text, mem, code, error);
   }
-  
-  if (cpid == 0) {
-    // child, execute
-    int status = execute_line(tokens, builtins);
-    // This job is done, decrement count
-    jobnumber--; // will have to pipe to get this to work i think...
-    exit(status);
+  incomplete = !parsed && code.incomplete && more;
+  syntax_error = !parsed && !incomplete;
+  if (incomplete) return last_status;
+  if (!parsed) {
+    cerr << error << endl;
+    last_status = EXIT_SYNTAX_ERROR;
+    return EXIT_SYNTAX_ERROR;
   }
-  else {
-    // parent, print out the job and pid
-    jobnumber++;
-    cout << "[" << jobnumber << "] "<< cpid << endl;
-    return 0;
+
+  return execute_program(code, mem);
+}
+
+
+int run_batch(line_reader& reader) {
+  int return_value = 0;
+  // Memory for parsing each line, reused from one line to the next
+  arena mem;
+  // The lines of a command that isn't complete yet, and a copy of them to
+  // parse, which breaks it up
+  string pending, text;
+  bool incomplete = false;
+  bool syntax_error = false;
+
+  char* line;
+  while ((line = read_line(reader)) != NULL) {
+    // Collect any background jobs that finished
+    jobs_reap();
+
+    // Most lines are whole commands on their own, and parsed where they are,
+    // with a copy kept in case one isn't
+    if (!incomplete) {
+      pending = line;
+      return_value = run_line(line, mem, true, incomplete, syntax_error);
+    } else {
+      pending += '\n';
+      pending += line;
+      text = pending;
+      return_value = run_line(&text[0], mem, true, incomplete, syntax_error);
+    }
+    // The rest of a command that can't be parsed mustn't run on its own
+    if (syntax_error) return return_value;
   }
+  // Input that ends partway through a command is an error
+  if (incomplete) {
+    return_value = run_line(&pending[0], mem, false, incomplete,
+                            syntax_error);
+  }
+  return return_value;
 }
 
 
-// The main program
-int main() {
-  // Populate the map of available built-in functions
-  builtins["ls"] = &com_ls;
-  builtins["cd"] = &com_cd;
-  builtins["pwd"] = &com_pwd;
-  builtins["alias"] = &com_alias;
-  builtins["unalias"] = &com_unalias;
-  builtins["echo"] = &com_echo;
-  builtins["exit"] = &com_exit;
-  builtins["history"] = &com_history;
+// Reads and runs commands from the user until an EOF is received.
+void run_interactive() {
+  // Built-ins are offered along with $PATH programs when completing
+  typedef map<string, builtin>::iterator it;
+  for (it i = builtins.begin(); i != builtins.end(); i++) {
+    completion_index_add(i->first);
+  }
 
   // Specify the characters that readline uses to delimit words
   rl_basic_word_break_characters = (char *) WORD_DELIMITERS;
@@ -620,70 +1395,220 @@ int main() {
   // Tell the completer that we want to try completion first
   rl_attempted_completion_function = word_completion;
 
-  // The return value of the last command executed
+  // Keep readline from setting LINES and COLUMNS behind the variable table
+  rl_change_environment = 0;
+
+  // Replace readline's reverse search with one over the indexed history
+  history_widget_init();
+
+  // Redraw the prompt when a segment of it arrives late
+  prompt_init();
+
+  // The return value of the last command executed, and how long it ran
   int return_value = 0;
+  double seconds = 0;
+
+  // Open the history store and give readline its most recent entries, so
+  // they can be reached with the arrow keys
+  if (history_open(history_default_path())) {
+    size_t count = history_count();
+    for (size_t n = count > HISTORY_PRELOAD ? count - HISTORY_PRELOAD + 1 : 1;
+         n <= count; n++) {
+      add_history(string(history_entry(n)).c_str());
+    }
+    // The search index is built while the user types the first command
+    job_thread_start(history_index_build).detach();
+  }
+
+  // Memory for parsing each line, reused from one line to the next
+  arena mem;
+
+  // The lines of a command that isn't complete yet, and a copy of them to
+  // parse, which breaks it up
+  string pending, text;
+  bool incomplete = false;
+  // At the prompt, a line that can't be parsed is only reported
+  bool syntax_error = false;
 
   // Loop for multiple successive commands 
   while (true) {
 
-    // Get the prompt to show, based on the return value of the last command
-    string prompt = get_prompt(return_value);
+    // Report jobs that finished since the last prompt
+    jobs_notify();
+
+    // Get the prompt to show, based on the return value of the last command,
+    // or the one asking for the rest of a command
+    string prompt = incomplete ? CONTINUATION_PROMPT
+                               : get_prompt(return_value, seconds);
 
     // Read a line of input from the user
     char* line = readline(prompt.c_str());
 
-    // If the pointer is null, then an EOF has been received (ctrl-d)
+    // If the pointer is null, then an EOF has been received (ctrl-d), which
+    // only abandons a command that isn't finished
     if (!line) {
-      break;
+      if (!incomplete) break;
+      return_value = run_line(&pending[0], mem, false, incomplete,
+                              syntax_error);
+      continue;
     }
 
     // If the command is non-empty, attempt to execute it
-    if (line[0]) {
+    if (line[0] || incomplete) {
 
       // Check for !! or !N to replace the line with the history
-      history_substitution(line);
-
-      // Add this command to readline's history
-      add_history(line);
-
-      // Break the raw input line into tokens
-      vector<string> tokens = tokenize(line);
-
-      // Handle local variable declarations
-      local_variable_assignment(tokens);
-
-      // Substitute variable references
-      variable_substitution(tokens);
+      if (!incomplete) history_substitution(line);
 
-      // Substitue command for alias if it exists, also handles !! and !N
-      alias_substitution(tokens);
-
-      // Check for backgrounded command
-      if (tokens[tokens.size() - 1] == "&") {
-        // erase the token
-        tokens.erase(tokens.begin() + tokens.size() - 1);
-        // execute in background
-        return_value = background_execute(tokens);
+      // Add this line to readline's history and the history store, each line
+      // of a longer command on its own
+      if (line[0]) {
+        add_history(line);
+        history_append(line);
       }
-      else {
-        // Copy incase file redirection occurs
-        int stdoutcopy = dup(STDOUT_FILENO);
-        int stdincopy = dup(STDIN_FILENO);
-
-        // Execute the line
-        return_value = execute_line(tokens, builtins);
-
-        // Revert the std in and out
-        dup2(stdoutcopy, STDOUT_FILENO);
-        dup2(stdincopy, STDIN_FILENO);
-        close(stdoutcopy);
-        close(stdincopy);
+
+      // Parse and run the command once it is complete
+      if (incomplete) pending += '\n';
+      else pending.clear();
+      pending += line;
+      text = pending;
+      double start = monotonic_seconds();
+      int status = run_line(&text[0], mem, true, incomplete, syntax_error);
+      if (!incomplete) {
+        return_value = status;
+        seconds = monotonic_seconds() - start;
       }
     }
 
     // Free the memory for the input string
     free(line);
   }
+}
+
+
+// The main program. Usage:
+//   myshell [-e]              interactive, or commands from a non-tty stdin
+//   myshell [-e] -c commands  runs the given commands
+//   myshell [-e] script [arguments]
+//                             runs the commands in the script file
+// -e stops at the first command that fails. -t file (or $MYSHELL_TRACE)
+// records how long each phase of every line takes, see trace.h.
+int main(int argc, char** argv) {
+  // Populate the map of available built-in functions, noting those that
+  // change the shell
+  builtins["ls"] = { &com_ls, false };
+  builtins["cd"] = { &com_cd, true };
+  builtins["pwd"] = { &com_pwd, false };
+  builtins["alias"] = { &com_alias, true };
+  builtins["unalias"] = { &com_unalias, true };
+  builtins["echo"] = { &com_echo, false };
+  builtins["exit"] = { &com_exit, true };
+  builtins["exec"] = { &com_exec, true };
+  builtins["history"] = { &com_history, false };
+  builtins["set"] = { &com_set, true };
+  builtins["hash"] = { &com_hash, true };
+  builtins["jobs"] = { &com_jobs, true };
+  builtins["fg"] = { &com_fg, true };
+  builtins["bg"] = { &com_bg, true };
+  builtins["wait"] = { &com_wait, true };
+  // parallel forks copies of the shell to run its jobs, which is only safe
+  // from the main thread
+  builtins["parallel"] = { &com_parallel, true };
+  builtins["cat"] = { &com_cat, false };
+  builtins["tee"] = { &com_tee, false };
+  builtins["wc"] = { &com_wc, false };
+  builtins["grep"] = { &com_grep, false };
+  builtins["export"] = { &com_export, true };
+  builtins["test"] = { &com_test, false };
+  builtins["["] = { &com_test, false };
+  builtins["true"] = { &com_true, false };
+  builtins[":"] = { &com_true, false };
+  builtins["false"] = { &com_false, false };
+  builtins["break"] = { &com_break, true };
+  builtins["continue"] = { &com_continue, true };
+  builtins["return"] = { &com_return, true };
+
+  // Take in the environment the shell was started with
+  variables_init();
+  directory_init();
+
+  // Populate the map of shell options
+  options["errexit"] = &errexit;
+  options["pipefail"] = &pipefail;
+  options["spawn"] = &use_spawn;
+  options["nullglob"] = &nullglob;
+  options["failglob"] = &failglob;
+
+  // Read the command line arguments
+  const char* commands = NULL;
+  const char* script = NULL;
+  // The socket to serve commands on, or to send them to
+  const char* server = NULL;
+  const char* client = NULL;
+  // Where to write a trace of every phase of execution, if anywhere
+  const char* trace_path = getenv("MYSHELL_TRACE");
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "-e") {
+      errexit = true;
+    } else if (arg == "-t" && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (arg == "-c" && i + 1 < argc) {
+      commands = argv[++i];
+    } else if (arg == "--server" && i + 1 < argc) {
+      server = argv[++i];
+    } else if (arg == "--client" && i + 2 < argc) {
+      client = argv[++i];
+      commands = argv[++i];
+    } else if (arg[0] != '-' && !script) {
+      // The rest are the script's arguments
+      script = argv[i];
+      shell_name = script;
+      positional_parameters.assign(argv + i + 1, argv + argc);
+      break;
+    } else {
+      cerr << "usage: myshell [-e] [-t tracefile] [-c commands | script "
+           << "[arguments]]"
+           << endl
+           << "       myshell --server socket" << endl
+           << "       myshell --client socket commands" << endl;
+      return 2;
+    }
+  }
+
+  // A client only passes the commands on, to a shell that is already going
+  if (client) return run_client(client, commands);
+
+  if (trace_path && trace_path[0] && !trace_start(trace_path)) {
+    perror(trace_path);
+  }
 
-  return 0;
+  // A server runs each request in a worker forked from itself, started up
+  if (server) return run_server(server);
+
+  // Without commands to run, a terminal on stdin means a user at the prompt
+  interactive = !commands && !script && isatty(STDIN_FILENO);
+
+  // Take charge of the terminal and of reaping children
+  jobs_init(interactive);
+
+  if (interactive) {
+    run_interactive();
+    return 0;
+  }
+
+  // Otherwise run the lines straight through, without readline
+  line_reader reader;
+  if (commands) {
+    line_reader_init(reader, commands);
+  } else if (script) {
+    int fd = open(script, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      perror(script);
+      return EXIT_NOT_FOUND;
+    }
+    line_reader_init(reader, fd);
+  } else {
+    line_reader_init(reader, STDIN_FILENO);
+  }
+  return run_batch(reader);
 }
@@ -0,0 +1,108 @@
+#pragma once
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "builtin_io.h"
+#include "line_reader.h"
+#include "parser.h"
+
+
+using std::map;
+using std::string;
+using std::string_view;
+using std::vector;
+
+
+// Define 'command' as a type for built-in commands, which take their input
+// and output from io
+typedef int (*command)(vector<string>&, builtin_io&);
+
+// A built-in command, and whether it uses the shell's own state (its
+// directory, options, aliases, command hash or jobs). Piped into something
+// else, those run in a copy of the shell; the rest run on threads.
+struct builtin {
+  command function;
+  bool shell_state;
+};
+
+// A mapping of internal commands to their corresponding functions
+extern map<string, builtin> builtins;
+
+
+// Returns the value of a shell or environment variable, or NULL if it isn't
+// set.
+const char* lookup_variable(string_view name);
+
+
+// Sets a shell variable for each name=value word in front of a command. If a
+// value runs a command substitution, status is set to the exit status of the
+// last one.
+void local_variable_assignment(pipeline& line, arena& mem,
+                               int* status = NULL);
+
+
+// Expands every word of the pipeline, and the redirection file names, into
+// the words that will be executed: variable references are replaced with
+// their values, or with nothing if they aren't set, and quotes are removed.
+// If a word runs a command substitution, status is set to the exit status of
+// the last one.
+void variable_substitution(pipeline& line, arena& mem, int* status = NULL);
+
+
+// Runs the command (a whole line, as typed inside "$(...)") and sets output
+// to what it wrote to stdout, without any trailing newlines. A built-in at
+// the end runs in the shell, without a fork, unless it uses the shell's own
+// state. Returns its exit status.
+int command_substitution(string_view command, string& output);
+
+
+// Replaces the glob patterns variable_substitution left in the pipeline with
+// the paths they match, sorted, reading each directory once for the whole
+// line. Returns false with error set if failglob is on and a pattern matched
+// nothing.
+bool glob_expansion(pipeline& line, arena& mem, string& error);
+
+
+// Replaces the current process with the external command, found at the given
+// full path (from hash_lookup), with the environment envp. If that is missing,
+// $PATH is searched afresh. Only meant to be called in a child process; never
+// returns.
+void exec_external_command(vector<string_view>& words,
+                           const string& fullpath, char** envp);
+
+
+// Runs an external command to completion, with the built-in's stdin and
+// stdout, for built-ins that leave the options they don't support to the
+// real program. Returns its exit status.
+int run_external_command(vector<string>& tokens, builtin_io& io);
+
+
+// Executes an expanded pipeline, either in the foreground or as a background
+// job. Built-ins are invoked directly unless the line goes in the background.
+// Returns the exit status of the line.
+int execute_line(pipeline& line);
+
+
+// Expands and executes one pipeline of a parsed line, using mem for
+// everything built along the way. A lone command naming a function calls it.
+// Returns the exit status of the pipeline.
+int run_pipeline(pipeline& line, arena& mem);
+
+
+// Parses and executes text holding one or more lines of input, using mem for
+// everything built along the way. The text is modified in place. If it ends
+// partway through a command and more input may follow, nothing is run and
+// incomplete is set, so the caller can read another line onto it. If it
+// can't be parsed, nothing is run either, the error is reported and
+// syntax_error is set. Returns the exit status of the last command run, or 2
+// for a syntax error.
+int run_line(char* text, arena& mem, bool more, bool& incomplete,
+             bool& syntax_error);
+
+
+// Runs lines one after another until the input runs out, a line can't be
+// parsed or, with the errexit option, a command fails. A command may carry on
+// over several lines. Returns the status of the last line run.
+int run_batch(line_reader& reader);
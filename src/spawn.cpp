@@ -0,0 +1,85 @@
+#include "spawn.h"
+
+#include <cerrno>
+#include <csignal>
+#include <spawn.h>
+#include <unistd.h>
+
+#include "path_search.h"
+
+using namespace std;
+
+
+vector<char*> build_argv(vector<string_view>& words) {
+  vector<char*> argv(words.size() + 1); // need a null at the end
+  for (int i = 0; i < words.size(); i++) {
+    argv[i] = const_cast<char*>(words[i].data());
+  }
+  argv[words.size()] = NULL;
+  return argv;
+}
+
+
+int spawn_command(vector<string_view>& words, int in_fd, int out_fd,
+                  const redirect_plan& plan, int pgid, char** envp) {
+  string progname(words[0]);
+  string fullpath = hash_lookup(progname);
+  if (fullpath.empty()) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  // Wire the child's stdin, stdout and redirections as file actions, applied
+  // between the clone and the exec
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (in_fd != -1) {
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+  }
+  if (out_fd != -1) {
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+  }
+  redirect_spawn_actions(plan, &actions);
+
+  // Join the job's process group and undo the signals the shell ignores
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+  if (pgid != -1) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attributes, pgid);
+  }
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGTSTP);
+  sigaddset(&defaults, SIGTTIN);
+  sigaddset(&defaults, SIGTTOU);
+  sigaddset(&defaults, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attributes, &defaults);
+  // and nothing blocked, as a thread that spawns it may have SIGCHLD blocked
+  sigset_t none;
+  sigemptyset(&none);
+  posix_spawnattr_setsigmask(&attributes, &none);
+  posix_spawnattr_setflags(&attributes, flags);
+
+  vector<char*> argv = build_argv(words);
+  pid_t cpid;
+  int error = posix_spawn(&cpid, fullpath.c_str(), &actions, &attributes,
+                          &argv[0], envp);
+  // The hashed program has gone, search again
+  if (error == ENOENT && hash_forget(progname)) {
+    fullpath = hash_lookup(progname);
+    if (!fullpath.empty()) {
+      error = posix_spawn(&cpid, fullpath.c_str(), &actions, &attributes,
+                          &argv[0], envp);
+    }
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attributes);
+
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  return cpid;
+}
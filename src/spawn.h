@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "redirect.h"
+
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+
+// Builds an exec style argument list that points straight at the words,
+// without copying them. The words must be NUL terminated and outlive the
+// list.
+vector<char*> build_argv(vector<string_view>& words);
+
+
+// Starts an external command with posix_spawn, which shares the shell's
+// memory until the exec instead of copying its page tables like fork does.
+// The child's stdin and stdout are taken from in_fd and out_fd, or inherited
+// from the shell when they are -1, and then its redirections are applied.
+// The child joins process group pgid (0 makes it lead a new one) unless that
+// is -1, and gets the default handling of the terminal stop signals the shell
+// ignores. The program is found through the command hash; a hashed path that
+// has gone away is dropped and $PATH searched again. The child's environment
+// is envp. Returns the pid of the child, or -1 with errno set if it couldn't
+// start.
+int spawn_command(vector<string_view>& words, int in_fd, int out_fd,
+                  const redirect_plan& plan, int pgid, char** envp);
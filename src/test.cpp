@@ -0,0 +1,210 @@
+#include "builtins.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+
+using namespace std;
+
+// The status test returns for a malformed expression, as opposed to a false
+// one
+const int TEST_ERROR = 2;
+
+// The arguments of an expression being evaluated, and where test is in them
+struct test_state {
+  vector<string>& args;
+  size_t pos;
+  size_t end;
+  string error;
+};
+
+
+// Whether the text is an operator taking an operand on each side
+static bool is_binary(const string& op) {
+  static const char* const binaries[] = { "=", "==", "!=", "-eq", "-ne", "-lt",
+                                          "-le", "-gt", "-ge", "-nt", "-ot",
+                                          "-ef" };
+  for (int i = 0; i < sizeof(binaries) / sizeof(binaries[0]); i++) {
+    if (op == binaries[i]) return true;
+  }
+  return false;
+}
+
+
+// Whether the text is an operator taking one operand after it
+static bool is_unary(const string& op) {
+  return op.size() == 2 && op[0] == '-' &&
+         strchr("bcdefghLnprsSwxz", op[1]) != NULL;
+}
+
+
+// Reads an integer operand. Returns false with error set if it isn't one.
+static bool integer(test_state& t, const string& text, long long& value) {
+  const char* start = text.c_str();
+  while (isspace(*start)) start++;
+  char* end;
+  errno = 0;
+  value = strtoll(start, &end, 10);
+  while (isspace(*end)) end++;
+  if (end == start || *end || errno == ERANGE) {
+    if (t.error.empty()) t.error = text + ": integer expression expected";
+    return false;
+  }
+  return true;
+}
+
+
+// Evaluates a unary file or string test
+static bool unary(const string& op, const string& operand) {
+  if (op == "-n") return !operand.empty();
+  if (op == "-z") return operand.empty();
+  if (op == "-r") return access(operand.c_str(), R_OK) == 0;
+  if (op == "-w") return access(operand.c_str(), W_OK) == 0;
+  if (op == "-x") return access(operand.c_str(), X_OK) == 0;
+
+  struct stat info;
+  // -h and -L look at a link itself, the rest at what it leads to
+  if (op == "-h" || op == "-L") {
+    return lstat(operand.c_str(), &info) == 0 && S_ISLNK(info.st_mode);
+  }
+  if (stat(operand.c_str(), &info) != 0) return false;
+  switch (op[1]) {
+    case 'b': return S_ISBLK(info.st_mode);
+    case 'c': return S_ISCHR(info.st_mode);
+    case 'd': return S_ISDIR(info.st_mode);
+    case 'f': return S_ISREG(info.st_mode);
+    case 'g': return info.st_mode & S_ISGID;
+    case 'u': return info.st_mode & S_ISUID;
+    case 'p': return S_ISFIFO(info.st_mode);
+    case 'S': return S_ISSOCK(info.st_mode);
+    case 's': return info.st_size > 0;
+    default: return true;
+  }
+}
+
+
+// Evaluates a binary comparison of strings, integers or files
+static bool binary(test_state& t, const string& left, const string& op,
+                   const string& right) {
+  if (op == "=" || op == "==") return left == right;
+  if (op == "!=") return left != right;
+  if (op[1] == 'n' || op[1] == 'o' || op == "-ef") {
+    struct stat a, b;
+    bool has_a = stat(left.c_str(), &a) == 0;
+    bool has_b = stat(right.c_str(), &b) == 0;
+    if (op == "-ef") {
+      return has_a && has_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    }
+    // A missing file is older than any other
+    struct stat& newer = op == "-nt" ? a : b;
+    struct stat& older = op == "-nt" ? b : a;
+    bool has_newer = op == "-nt" ? has_a : has_b;
+    bool has_older = op == "-nt" ? has_b : has_a;
+    if (!has_newer) return false;
+    if (!has_older) return true;
+    return newer.st_mtim.tv_sec > older.st_mtim.tv_sec ||
+           (newer.st_mtim.tv_sec == older.st_mtim.tv_sec &&
+            newer.st_mtim.tv_nsec > older.st_mtim.tv_nsec);
+  }
+  long long a, b;
+  if (!integer(t, left, a) || !integer(t, right, b)) return false;
+  if (op == "-eq") return a == b;
+  if (op == "-ne") return a != b;
+  if (op == "-lt") return a < b;
+  if (op == "-le") return a <= b;
+  if (op == "-gt") return a > b;
+  return a >= b;
+}
+
+
+static bool test_or(test_state& t);
+
+
+// Evaluates a negation, a parenthesized expression, a comparison, a unary
+// test or a lone string, which is true if it isn't empty
+static bool test_primary(test_state& t) {
+  if (t.pos >= t.end) {
+    if (t.error.empty()) t.error = "argument expected";
+    return false;
+  }
+  vector<string>& args = t.args;
+  // A comparison comes first, so "test ! = x" compares "!"
+  if (t.pos + 2 < t.end && is_binary(args[t.pos + 1])) {
+    t.pos += 3;
+    return binary(t, args[t.pos - 3], args[t.pos - 2], args[t.pos - 1]);
+  }
+  const string& arg = args[t.pos];
+  if (arg == "!" && t.pos + 1 < t.end) {
+    t.pos++;
+    return !test_primary(t);
+  }
+  if (arg == "(" && t.pos + 1 < t.end) {
+    t.pos++;
+    bool value = test_or(t);
+    if (t.pos >= t.end || args[t.pos] != ")") {
+      if (t.error.empty()) t.error = "')' expected";
+      return false;
+    }
+    t.pos++;
+    return value;
+  }
+  if (is_unary(arg) && t.pos + 1 < t.end) {
+    t.pos += 2;
+    return unary(arg, args[t.pos - 1]);
+  }
+  t.pos++;
+  return !arg.empty();
+}
+
+
+// Evaluates tests joined by -a
+static bool test_and(test_state& t) {
+  bool value = test_primary(t);
+  while (t.pos < t.end && t.args[t.pos] == "-a") {
+    t.pos++;
+    // Both sides are read even when the first decides it
+    bool right = test_primary(t);
+    value = value && right;
+  }
+  return value;
+}
+
+
+// Evaluates tests joined by -o, which binds more loosely than -a
+static bool test_or(test_state& t) {
+  bool value = test_and(t);
+  while (t.pos < t.end && t.args[t.pos] == "-o") {
+    t.pos++;
+    bool right = test_and(t);
+    value = value || right;
+  }
+  return value;
+}
+
+
+int com_test(vector<string>& tokens, builtin_io& io) {
+  const string& name = tokens[0];
+  size_t end = tokens.size();
+  // [ needs a ] to end it, which isn't part of the expression
+  if (name == "[") {
+    if (tokens.back() != "]") {
+      io.err << "[: missing ']'" << endl;
+      return TEST_ERROR;
+    }
+    end--;
+  }
+  // No expression is false
+  if (end == 1) return 1;
+
+  test_state t = { tokens, 1, end, "" };
+  bool value = test_or(t);
+  if (t.error.empty() && t.pos < t.end) {
+    t.error = tokens[t.pos] + ": unexpected operator";
+  }
+  if (!t.error.empty()) {
+    io.err << name << ": " << t.error << endl;
+    return TEST_ERROR;
+  }
+  return value ? 0 : 1;
+}
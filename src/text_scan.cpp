@@ -0,0 +1,254 @@
+#include "text_scan.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Most blocks whose newlines can be tallied a byte each before they overflow
+const size_t MAX_TALLY_BLOCKS = 255;
+
+// The level the kernels run at
+static scan_level level = scan_best_level();
+
+
+scan_level scan_best_level() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    return SCAN_AVX2;
+  }
+  // Every x86-64 processor has SSE2
+  return SCAN_SSE2;
+#else
+  return SCAN_SCALAR;
+#endif
+}
+
+
+void scan_set_level(scan_level wanted) {
+  level = wanted;
+}
+
+
+// Whether a byte separates words
+static inline bool is_space(unsigned char c) {
+  return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
+}
+
+
+// The plain versions, which also finish what the wider ones leave over
+
+static size_t count_newlines_scalar(const char* data, size_t size) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; i++) {
+    count += data[i] == '\n';
+  }
+  return count;
+}
+
+
+static size_t count_words_scalar(const char* data, size_t size,
+                                 bool& in_word) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; i++) {
+    bool space = is_space(data[i]);
+    count += !space && !in_word;
+    in_word = !space;
+  }
+  return count;
+}
+
+
+// Finds each candidate with memchr and compares the rest of the needle
+static const char* find_substring_scalar(const char* data, size_t size,
+                                         string_view needle) {
+  size_t length = needle.size();
+  if (length == 0) return data;
+  const char* end = data + size;
+  for (const char* p = data; end - p >= (ptrdiff_t) length; p++) {
+    p = (const char*) memchr(p, needle[0], end - p - length + 1);
+    if (!p) return NULL;
+    if (memcmp(p + 1, needle.data() + 1, length - 1) == 0) return p;
+  }
+  return NULL;
+}
+
+
+#if defined(__x86_64__)
+
+// Each block's matches are subtracted from byte counters (a match is -1),
+// which are summed with a sum of absolute differences before they overflow.
+static size_t count_newlines_sse2(const char* data, size_t size) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t count = 0;
+  size_t i = 0;
+  while (size - i >= 16) {
+    size_t blocks = min((size - i) / 16, MAX_TALLY_BLOCKS);
+    __m128i tally = _mm_setzero_si128();
+    for (size_t b = 0; b < blocks; b++, i += 16) {
+      __m128i block = _mm_loadu_si128((const __m128i*) (data + i));
+      tally = _mm_sub_epi8(tally, _mm_cmpeq_epi8(block, newline));
+    }
+    __m128i sums = _mm_sad_epu8(tally, _mm_setzero_si128());
+    count += _mm_cvtsi128_si64(sums) +
+             _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+  }
+  return count + count_newlines_scalar(data + i, size - i);
+}
+
+
+__attribute__((target("avx2")))
+static size_t count_newlines_avx2(const char* data, size_t size) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t count = 0;
+  size_t i = 0;
+  while (size - i >= 32) {
+    size_t blocks = min((size - i) / 32, MAX_TALLY_BLOCKS);
+    __m256i tally = _mm256_setzero_si256();
+    for (size_t b = 0; b < blocks; b++, i += 32) {
+      __m256i block = _mm256_loadu_si256((const __m256i*) (data + i));
+      tally = _mm256_sub_epi8(tally, _mm256_cmpeq_epi8(block, newline));
+    }
+    __m256i sums = _mm256_sad_epu8(tally, _mm256_setzero_si256());
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+             _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+  }
+  return count + count_newlines_scalar(data + i, size - i);
+}
+
+
+// A bit per byte says whether it is a space; a word starts at each bit clear
+// whose previous bit (carried over from the block before for the first) is
+// set.
+static size_t count_words_sse2(const char* data, size_t size, bool& in_word) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i span = _mm_set1_epi8('\r' - '\t');
+  size_t count = 0;
+  uint32_t after_space = !in_word;
+  size_t i = 0;
+  for (; size - i >= 16; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*) (data + i));
+    __m128i control = _mm_sub_epi8(block, tab);
+    __m128i spaces = _mm_or_si128(
+        _mm_cmpeq_epi8(block, space),
+        _mm_cmpeq_epi8(_mm_min_epu8(control, span), control));
+    uint32_t mask = _mm_movemask_epi8(spaces);
+    count += __builtin_popcount(~mask & ((mask << 1) | after_space) & 0xFFFF);
+    after_space = mask >> 15;
+  }
+  in_word = !after_space;
+  return count + count_words_scalar(data + i, size - i, in_word);
+}
+
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_words_avx2(const char* data, size_t size, bool& in_word) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i span = _mm256_set1_epi8('\r' - '\t');
+  size_t count = 0;
+  uint32_t after_space = !in_word;
+  size_t i = 0;
+  for (; size - i >= 32; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*) (data + i));
+    __m256i control = _mm256_sub_epi8(block, tab);
+    __m256i spaces = _mm256_or_si256(
+        _mm256_cmpeq_epi8(block, space),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(control, span), control));
+    uint32_t mask = _mm256_movemask_epi8(spaces);
+    count += __builtin_popcount(~mask & ((mask << 1) | after_space));
+    after_space = mask >> 31;
+  }
+  in_word = !after_space;
+  return count + count_words_scalar(data + i, size - i, in_word);
+}
+
+
+// Compares the needle's first byte with each position of a block and its
+// last byte with the positions length - 1 further on; only where both match
+// is the rest of the needle compared.
+static const char* find_substring_sse2(const char* data, size_t size,
+                                       string_view needle) {
+  size_t length = needle.size();
+  if (length == 0) return data;
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[length - 1]);
+  size_t i = 0;
+  for (; size - i >= length - 1 + 16; i += 16) {
+    __m128i starts = _mm_loadu_si128((const __m128i*) (data + i));
+    __m128i ends = _mm_loadu_si128((const __m128i*) (data + i + length - 1));
+    uint32_t mask = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, last)));
+    while (mask) {
+      const char* candidate = data + i + __builtin_ctz(mask);
+      if (length <= 2 ||
+          memcmp(candidate + 1, needle.data() + 1, length - 2) == 0) {
+        return candidate;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return find_substring_scalar(data + i, size - i, needle);
+}
+
+
+__attribute__((target("avx2")))
+static const char* find_substring_avx2(const char* data, size_t size,
+                                       string_view needle) {
+  size_t length = needle.size();
+  if (length == 0) return data;
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[length - 1]);
+  size_t i = 0;
+  for (; size - i >= length - 1 + 32; i += 32) {
+    __m256i starts = _mm256_loadu_si256((const __m256i*) (data + i));
+    __m256i ends = _mm256_loadu_si256(
+        (const __m256i*) (data + i + length - 1));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(starts, first), _mm256_cmpeq_epi8(ends, last)));
+    while (mask) {
+      const char* candidate = data + i + __builtin_ctz(mask);
+      if (length <= 2 ||
+          memcmp(candidate + 1, needle.data() + 1, length - 2) == 0) {
+        return candidate;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return find_substring_scalar(data + i, size - i, needle);
+}
+
+#endif
+
+
+size_t count_newlines(const char* data, size_t size) {
+#if defined(__x86_64__)
+  if (level == SCAN_AVX2) return count_newlines_avx2(data, size);
+  if (level == SCAN_SSE2) return count_newlines_sse2(data, size);
+#endif
+  return count_newlines_scalar(data, size);
+}
+
+
+size_t count_words(const char* data, size_t size, bool& in_word) {
+#if defined(__x86_64__)
+  if (level == SCAN_AVX2) return count_words_avx2(data, size, in_word);
+  if (level == SCAN_SSE2) return count_words_sse2(data, size, in_word);
+#endif
+  return count_words_scalar(data, size, in_word);
+}
+
+
+const char* find_substring(const char* data, size_t size, string_view needle) {
+#if defined(__x86_64__)
+  if (level == SCAN_AVX2) return find_substring_avx2(data, size, needle);
+  if (level == SCAN_SSE2) return find_substring_sse2(data, size, needle);
+#endif
+  return find_substring_scalar(data, size, needle);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <string_view>
+
+
+using std::string_view;
+
+
+// The instruction sets the text kernels can use, from plainest to widest
+enum scan_level { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+
+
+// Returns the widest level this CPU supports.
+scan_level scan_best_level();
+
+
+// Makes the kernels use the given level, which the CPU must support, so they
+// can be checked and timed against each other. They start at the best.
+void scan_set_level(scan_level level);
+
+
+// Returns the number of newlines in the data.
+size_t count_newlines(const char* data, size_t size);
+
+
+// Returns the number of words that start in the data, a word being a run of
+// anything but spaces, tabs, newlines, \v, \f and \r. in_word says whether
+// the data carries on a word from the block before it, and is updated for
+// the next block.
+size_t count_words(const char* data, size_t size, bool& in_word);
+
+
+// Returns the first occurrence of needle in the data, or NULL. Candidates are
+// found a block at a time by matching the needle's first and last bytes, and
+// only those are compared in full.
+const char* find_substring(const char* data, size_t size, string_view needle);
@@ -0,0 +1,138 @@
+#include "timing.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/time.h>
+#include <time.h>
+
+using namespace std;
+
+// The report when TIMEFORMAT isn't set, for the pipeline and for each stage
+const char* const DEFAULT_TOTAL_FORMAT =
+  "real\t%Rs\nuser\t%Us\nsys\t%Ss\nmaxrss\t%M KB\n"
+  "faults\t%F major, %f minor\nswitches\t%w voluntary, %c involuntary";
+const char* const DEFAULT_STAGE_FORMAT =
+  "%N: %C\n\tuser %Us  sys %Ss  maxrss %M KB  faults %F/%f  "
+  "switches %w/%c  exit %x";
+
+
+double monotonic_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+struct rusage self_usage() {
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage;
+}
+
+
+// Returns a time value in seconds
+static double seconds(const struct timeval& time) {
+  return time.tv_sec + time.tv_usec / 1e6;
+}
+
+
+// Returns the time value that is a minus b
+static struct timeval time_difference(const struct timeval& a,
+                                      const struct timeval& b) {
+  struct timeval difference;
+  timersub(&a, &b, &difference);
+  return difference;
+}
+
+
+struct rusage usage_since(const struct rusage& before,
+                          const struct rusage& after) {
+  struct rusage used = after;
+  used.ru_utime = time_difference(after.ru_utime, before.ru_utime);
+  used.ru_stime = time_difference(after.ru_stime, before.ru_stime);
+  used.ru_majflt = after.ru_majflt - before.ru_majflt;
+  used.ru_minflt = after.ru_minflt - before.ru_minflt;
+  used.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+  used.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+  return used;
+}
+
+
+void add_usage(struct rusage& total, const struct rusage& more) {
+  timeradd(&total.ru_utime, &more.ru_utime, &total.ru_utime);
+  timeradd(&total.ru_stime, &more.ru_stime, &total.ru_stime);
+  total.ru_maxrss = max(total.ru_maxrss, more.ru_maxrss);
+  total.ru_majflt += more.ru_majflt;
+  total.ru_minflt += more.ru_minflt;
+  total.ru_nvcsw += more.ru_nvcsw;
+  total.ru_nivcsw += more.ru_nivcsw;
+}
+
+
+// Formats seconds with the given number of decimal places
+static string format_seconds(double value, int places) {
+  char text[64];
+  snprintf(text, sizeof(text), "%.*f", places, value);
+  return text;
+}
+
+
+string format_usage(const string& format, const command_usage& used,
+                    int stage) {
+  const struct rusage& usage = used.usage;
+  double user = seconds(usage.ru_utime);
+  double sys = seconds(usage.ru_stime);
+
+  string text;
+  for (size_t i = 0; i < format.size(); i++) {
+    if (format[i] != '%' || i + 1 == format.size()) {
+      text += format[i];
+      continue;
+    }
+    i++;
+    // An optional number of decimal places
+    int places = 3;
+    if (isdigit(format[i]) && i + 1 < format.size()) {
+      places = format[i] - '0';
+      i++;
+    }
+    switch (format[i]) {
+      case 'R': text += format_seconds(used.real, places); break;
+      case 'U': text += format_seconds(user, places); break;
+      case 'S': text += format_seconds(sys, places); break;
+      case 'P':
+        text += format_seconds(used.real > 0 ? 100 * (user + sys) / used.real
+                                             : 0, places);
+        break;
+      case 'M': text += to_string(usage.ru_maxrss); break;
+      case 'F': text += to_string(usage.ru_majflt); break;
+      case 'f': text += to_string(usage.ru_minflt); break;
+      case 'w': text += to_string(usage.ru_nvcsw); break;
+      case 'c': text += to_string(usage.ru_nivcsw); break;
+      case 'x': text += to_string(used.status); break;
+      case 'C': text += used.text; break;
+      case 'N': text += to_string(stage); break;
+      case '%': text += '%'; break;
+      // Anything else is left alone
+      default: text += '%'; text += format[i]; break;
+    }
+  }
+  return text;
+}
+
+
+void report_usage(const char* format, const command_usage& total,
+                  const vector<command_usage>& stages) {
+  bool custom = format && format[0];
+  string report = format_usage(custom ? format : DEFAULT_TOTAL_FORMAT, total,
+                               0) + "\n";
+  if (stages.size() > 1) {
+    for (int i = 0; i < stages.size(); i++) {
+      report += format_usage(custom ? format : DEFAULT_STAGE_FORMAT,
+                             stages[i], i + 1) + "\n";
+    }
+  }
+  cerr << report;
+}
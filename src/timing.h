@@ -0,0 +1,57 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+
+using std::string;
+using std::vector;
+
+
+// What a timed command used
+struct command_usage {
+  // The command line, or the stage of it
+  string text;
+  // Seconds of wall time. A stage has its whole pipeline's.
+  double real;
+  struct rusage usage;
+  // The exit status
+  int status;
+};
+
+
+// Returns the seconds on the monotonic clock, which only ever goes forward
+double monotonic_seconds();
+
+
+// Returns what the calling thread of the shell has used so far, so each
+// built-in running at the same time is measured on its own.
+struct rusage self_usage();
+
+
+// Returns what was used between the two readings. The maximum resident size
+// is the later one's, as it can't be split.
+struct rusage usage_since(const struct rusage& before,
+                          const struct rusage& after);
+
+
+// Adds what another process used to the total. The maximum resident size is
+// the largest of them.
+void add_usage(struct rusage& total, const struct rusage& more);
+
+
+// Formats what a command used. In the format %R, %U and %S are the real, user
+// and system seconds (a digit after the % sets the decimal places, 3 by
+// default), %P the share of a CPU used, %M the maximum resident size in KB,
+// %F and %f the major and minor page faults, %w and %c the voluntary and
+// involuntary context switches, %x the exit status, %C the command and %N
+// the stage (0 for the whole pipeline). %% is a %.
+string format_usage(const string& format, const command_usage& used,
+                    int stage);
+
+
+// Prints the report for a timed pipeline to stderr: the total, then a line
+// for each stage if there is more than one. The TIMEFORMAT variable, when
+// set, is the format for every one of those lines.
+void report_usage(const char* format, const command_usage& total,
+                  const vector<command_usage>& stages);
@@ -0,0 +1,247 @@
+#include "trace.h"
+
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jobs.h"
+
+using namespace std;
+
+// How much is buffered before the writer is woken, and how long events can
+// wait when there are fewer
+const size_t TRACE_BUFFER_SIZE = 64 * 1024;
+const chrono::seconds TRACE_FLUSH_INTERVAL(1);
+
+bool tracing = false;
+
+// The trace file, and whether it holds one event per line
+static int trace_fd = -1;
+static bool trace_lines = false;
+// The shell's pid, which every event is filed under
+static int trace_pid;
+
+// What the writer thread shares with the shell: the events waiting for it,
+// and what wakes it
+struct trace_writer {
+  mutex lock;
+  condition_variable wake;
+  string pending;
+  bool stopping;
+  thread writer;
+};
+
+// Never destroyed, as a forked child exits with a copy of it still in use
+static trace_writer* writer = NULL;
+
+// Set in forked children, which have no writer thread and may have copied
+// the lock while it was held. They write their events straight out.
+static bool trace_in_child = false;
+
+
+// Writes the whole of the text to the trace file
+static void write_out(const string& text) {
+  size_t done = 0;
+  while (done < text.size()) {
+    ssize_t written = write(trace_fd, text.data() + done, text.size() - done);
+    if (written <= 0) return;
+    done += written;
+  }
+}
+
+
+// Hands the pending events to the file whenever enough have built up, a
+// while has passed, or the trace is stopping
+static void writer_loop() {
+  string writing;
+  unique_lock<mutex> hold(writer->lock);
+  while (true) {
+    writer->wake.wait_for(hold, TRACE_FLUSH_INTERVAL, [] {
+      return writer->stopping || writer->pending.size() >= TRACE_BUFFER_SIZE;
+    });
+    writing.swap(writer->pending);
+    bool stopping = writer->stopping;
+    hold.unlock();
+    write_out(writing);
+    writing.clear();
+    if (stopping) return;
+    hold.lock();
+  }
+}
+
+
+// Runs in the child after a fork
+static void trace_forked() {
+  trace_in_child = true;
+}
+
+
+bool trace_start(const string& path) {
+  trace_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+                  O_CLOEXEC, 0644);
+  if (trace_fd == -1) return false;
+  trace_lines = path.size() > 6 && path.substr(path.size() - 6) == ".jsonl";
+  trace_pid = getpid();
+  if (!trace_lines) write_out("[\n");
+
+  pthread_atfork(NULL, NULL, trace_forked);
+  writer = new trace_writer();
+  writer->stopping = false;
+  writer->writer = job_thread_start(writer_loop);
+  tracing = true;
+  atexit(trace_stop);
+  return true;
+}
+
+
+void trace_stop() {
+  // Only the shell itself owns the trace
+  if (!tracing || trace_in_child) return;
+  tracing = false;
+  {
+    lock_guard<mutex> hold(writer->lock);
+    writer->stopping = true;
+  }
+  writer->wake.notify_one();
+  writer->writer.join();
+
+  // Name the process, which also ends the array without a trailing comma
+  char name[128];
+  snprintf(name, sizeof(name), "{\"name\":\"process_name\",\"ph\":\"M\","
+           "\"pid\":%d,\"args\":{\"name\":\"myshell\"}}%s\n", trace_pid,
+           trace_lines ? "" : "]");
+  write_out(name);
+  close(trace_fd);
+}
+
+
+double trace_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+
+// Appends the text to the event with JSON escapes
+static void append_escaped(string& event, string_view text) {
+  for (size_t i = 0; i < text.size(); i++) {
+    unsigned char c = text[i];
+    if (c == '"' || c == '\\') {
+      event += '\\';
+      event += c;
+    } else if (c < ' ') {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      event += escape;
+    } else {
+      event += c;
+    }
+  }
+}
+
+
+// Returns the id of the calling thread
+static int thread_id() {
+  static thread_local int id = syscall(SYS_gettid);
+  return id;
+}
+
+
+// Appends a number of microseconds, to the nanosecond. Much quicker than
+// printf's floating point.
+static void append_micros(string& event, double micros) {
+  long long nanos = llround(micros * 1000);
+  char digits[32];
+  char* end = to_chars(digits, digits + sizeof(digits), nanos / 1000).ptr;
+  *end++ = '.';
+  int fraction = nanos % 1000;
+  *end++ = '0' + fraction / 100;
+  *end++ = '0' + fraction / 10 % 10;
+  *end++ = '0' + fraction % 10;
+  event.append(digits, end - digits);
+}
+
+
+// Appends an integer
+static void append_number(string& event, long long number) {
+  char digits[32];
+  char* end = to_chars(digits, digits + sizeof(digits), number).ptr;
+  event.append(digits, end - digits);
+}
+
+
+// Formats an event and sends it on its way
+static void record(const char* name, const char* phase, double start,
+                   double duration, string_view detail) {
+  // Reused from one event to the next
+  static thread_local string event;
+  event = "{\"name\":\"";
+  event += name;
+  event += "\",\"cat\":\"shell\",\"ph\":\"";
+  event += phase;
+  event += phase[0] == 'X' ? "\",\"ts\":" : "\",\"s\":\"t\",\"ts\":";
+  append_micros(event, start);
+  if (phase[0] == 'X') {
+    event += ",\"dur\":";
+    append_micros(event, duration);
+  }
+  event += ",\"pid\":";
+  append_number(event, trace_pid);
+  event += ",\"tid\":";
+  append_number(event, trace_in_child ? getpid() : thread_id());
+  if (!detail.empty()) {
+    event += ",\"args\":{\"detail\":\"";
+    append_escaped(event, detail);
+    event += "\"}";
+  }
+  event += trace_lines ? "}\n" : "},\n";
+
+  if (trace_in_child) {
+    write_out(event);
+    return;
+  }
+  bool full;
+  {
+    lock_guard<mutex> hold(writer->lock);
+    writer->pending += event;
+    full = writer->pending.size() >= TRACE_BUFFER_SIZE;
+  }
+  if (full) writer->wake.notify_one();
+}
+
+
+void trace_complete(const char* name, double start, double end,
+                    string_view detail) {
+  if (!tracing) return;
+  record(name, "X", start, end - start, detail);
+}
+
+
+void trace_instant(const char* name, string_view detail) {
+  if (!tracing) return;
+  record(name, "i", trace_now(), 0, detail);
+}
+
+
+trace_span::trace_span(const char* name, string_view detail)
+    : name(name), start(0) {
+  if (!tracing) return;
+  this->detail = detail;
+  start = trace_now();
+}
+
+
+trace_span::~trace_span() {
+  if (!tracing || !start) return;
+  trace_complete(name, start, trace_now(), detail);
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+
+using std::string;
+using std::string_view;
+
+
+// Whether events are being recorded. Checked before anything else is done,
+// so tracing costs one test when it's off.
+extern bool tracing;
+
+
+// Starts recording events to the file at path, in Chrome's trace event
+// format (a JSON array), or as one JSON object per line if the name ends in
+// ".jsonl". Either loads into Perfetto or chrome://tracing. Events are handed
+// to a writer thread in large buffers. Returns false if the file can't be
+// opened.
+bool trace_start(const string& path);
+
+
+// Writes out everything recorded and closes the trace. Called at exit.
+void trace_stop();
+
+
+// Returns the time events are stamped with, in microseconds on the
+// monotonic clock.
+double trace_now();
+
+
+// Records a phase that ran from start to end, with detail (such as the
+// command) shown as its argument.
+void trace_complete(const char* name, double start, double end,
+                    string_view detail);
+
+
+// Records a moment, such as a child about to exec.
+void trace_instant(const char* name, string_view detail);
+
+
+// Records the phase that lasts as long as the span is in scope.
+class trace_span {
+ public:
+  trace_span(const char* name, string_view detail = string_view());
+  ~trace_span();
+
+ private:
+  trace_span(const trace_span&);
+  trace_span& operator=(const trace_span&);
+
+  const char* name;
+  string detail;
+  double start;
+};
@@ -0,0 +1,196 @@
+#include "variables.h"
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+using namespace std;
+
+// An external reference to the execution environment
+extern char** environ;
+
+// Slots the table starts with; it always has a power of two
+const size_t MIN_VARIABLE_SLOTS = 64;
+
+// One slot of the variable table. A slot with no name is free.
+struct variable_slot {
+  string name;
+  string value;
+  // Whether the variable has a value, rather than only being marked for
+  // export
+  bool set;
+  bool exported;
+};
+
+// Open addressing with linear probing, kept at most half full. Variables are
+// never removed, so a free slot always ends a probe.
+static vector<variable_slot> table(MIN_VARIABLE_SLOTS);
+static size_t used = 0;
+
+// Bumped whenever an exported variable changes
+static unsigned long generation = 1;
+
+// The environment built from the exported variables, and the generation it
+// was built at
+static vector<string> environment_text;
+static vector<char*> environment;
+static unsigned long environment_generation = 0;
+
+// Held while the table changes and while an environment is built from it,
+// since built-ins on threads build environments of their own
+static mutex environment_lock;
+
+
+// FNV-1a, which is quick for the short names variables have
+static size_t hash_name(string_view name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < name.size(); i++) {
+    hash = (hash ^ (unsigned char) name[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+
+// Returns the slot holding the name, or the free slot where it would go
+static size_t find_slot(const vector<variable_slot>& slots, string_view name) {
+  size_t mask = slots.size() - 1;
+  size_t i = hash_name(name) & mask;
+  while (!slots[i].name.empty() && slots[i].name != name) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+
+// Returns the slot for the name, adding an unset one if there is none
+static variable_slot& slot_for(string_view name) {
+  size_t i = find_slot(table, name);
+  if (!table[i].name.empty()) return table[i];
+
+  // Double the table before it gets more than half full
+  if (2 * (used + 1) > table.size()) {
+    vector<variable_slot> bigger(2 * table.size());
+    for (size_t s = 0; s < table.size(); s++) {
+      if (table[s].name.empty()) continue;
+      bigger[find_slot(bigger, table[s].name)] = std::move(table[s]);
+    }
+    table.swap(bigger);
+    i = find_slot(table, name);
+  }
+  used++;
+  variable_slot& slot = table[i];
+  slot.name = name;
+  slot.set = false;
+  slot.exported = false;
+  return slot;
+}
+
+
+void variables_init() {
+  for (char** e = environ; *e; e++) {
+    const char* equals = strchr(*e, '=');
+    if (!equals) continue;
+    variable_set(string_view(*e, equals - *e), equals + 1, true);
+  }
+  variables_environment();
+}
+
+
+bool is_variable_name(string_view name) {
+  if (name.empty() || !(isalpha(name[0]) || name[0] == '_')) return false;
+  for (size_t i = 1; i < name.size(); i++) {
+    if (!(isalnum(name[i]) || name[i] == '_')) return false;
+  }
+  return true;
+}
+
+
+const char* variable_get(string_view name) {
+  const variable_slot& slot = table[find_slot(table, name)];
+  if (slot.name.empty() || !slot.set) return NULL;
+  return slot.value.c_str();
+}
+
+
+void variable_set(string_view name, string_view value, bool exported) {
+  lock_guard<mutex> guard(environment_lock);
+  variable_slot& slot = slot_for(name);
+  bool changed = !slot.set || slot.value != value;
+  slot.value = value;
+  slot.set = true;
+  if (exported && !slot.exported) {
+    slot.exported = true;
+    generation++;
+  } else if (slot.exported && changed) {
+    generation++;
+  }
+}
+
+
+void variable_export(string_view name) {
+  lock_guard<mutex> guard(environment_lock);
+  variable_slot& slot = slot_for(name);
+  if (slot.exported) return;
+  slot.exported = true;
+  if (slot.set) generation++;
+}
+
+
+unsigned long variables_generation() {
+  return generation;
+}
+
+
+// Fills text with "name=value" for each exported variable, and envp with
+// pointers to them ending in NULL. The lock must be held.
+static void build_environment(vector<string>& text, vector<char*>& envp) {
+  text.clear();
+  for (size_t s = 0; s < table.size(); s++) {
+    const variable_slot& slot = table[s];
+    if (slot.name.empty() || !slot.exported || !slot.set) continue;
+    text.push_back(slot.name + "=" + slot.value);
+  }
+  // Only point at the strings once they have stopped moving
+  envp.clear();
+  for (size_t i = 0; i < text.size(); i++) envp.push_back(&text[i][0]);
+  envp.push_back(NULL);
+}
+
+
+char** variables_environment() {
+  lock_guard<mutex> guard(environment_lock);
+  if (environment_generation != generation) {
+    build_environment(environment_text, environment);
+    environment_generation = generation;
+    environ = &environment[0];
+  }
+  return &environment[0];
+}
+
+
+vector<char*> variables_environment_copy(vector<string>& text) {
+  lock_guard<mutex> guard(environment_lock);
+  vector<char*> envp;
+  build_environment(text, envp);
+  return envp;
+}
+
+
+vector<char*> command_environment(const vector<string_view>& assignments) {
+  vector<char*> result;
+  for (char** e = variables_environment(); *e; e++) {
+    bool replaced = false;
+    for (size_t a = 0; a < assignments.size() && !replaced; a++) {
+      // The names match if they end at the same = sign
+      size_t length = assignments[a].find('=') + 1;
+      replaced = strncmp(*e, assignments[a].data(), length) == 0;
+    }
+    if (!replaced) result.push_back(*e);
+  }
+  for (size_t a = 0; a < assignments.size(); a++) {
+    result.push_back(const_cast<char*>(assignments[a].data()));
+  }
+  result.push_back(NULL);
+  return result;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+
+// Loads the environment the shell was started with into the variable table,
+// every variable exported.
+void variables_init();
+
+
+// Whether the text is a valid variable name: a letter or underscore, then
+// letters, digits and underscores.
+bool is_variable_name(string_view name);
+
+
+// Returns the value of a variable, or NULL if it isn't set. The value is only
+// valid until a variable is next set.
+const char* variable_get(string_view name);
+
+
+// Sets a variable, which stays exported if it was. With exported, it is
+// exported from now on as well.
+void variable_set(string_view name, string_view value, bool exported);
+
+
+// Marks a variable for export. One that isn't set yet is exported once it is.
+void variable_export(string_view name);
+
+
+// Counts the changes to the exported variables, so anything built from them
+// can tell when it is out of date.
+unsigned long variables_generation();
+
+
+// Returns the exported variables as an exec environment of "name=value"
+// strings, ending in NULL. It is only rebuilt when the exported variables
+// have changed since the last call, and environ is pointed at it, so getenv
+// and exec in the shell see the same variables. Only for the main thread,
+// as it is replaced the next time it is rebuilt.
+char** variables_environment();
+
+
+// Builds a copy of the exported variables as an exec environment, with the
+// strings kept in text, for a built-in on a thread. Unlike the one
+// variables_environment returns, it stays valid if the shell changes a
+// variable or rebuilds environ meanwhile.
+vector<char*> variables_environment_copy(vector<string>& text);
+
+
+// Returns the shell's environment with the "name=value" assignments added,
+// or replacing the variables of the same name, for one command. The
+// assignments must be NUL terminated and outlive the result.
+vector<char*> command_environment(const vector<string_view>& assignments);